@@ -0,0 +1,494 @@
+/*
+ * In-process benchmark of the unpacking pipeline, for unzboot bench
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unzboot.h"
+
+/*
+ * Where the output goes: nowhere, to time the decoders alone, or to files
+ * written like an extraction does, holes included.
+ */
+enum bench_engine {
+    BENCH_ENGINE_NULL,
+    BENCH_ENGINE_FILE,
+    BENCH_N_ENGINES,
+};
+
+static const char *const engine_names[BENCH_N_ENGINES] = {
+    [BENCH_ENGINE_NULL] = "null",
+    [BENCH_ENGINE_FILE] = "file",
+};
+
+struct bench {
+    const char  *prog;
+    const char  *input_file;
+    /* loaded once, every run unpacks it from memory */
+    const uint8_t *image;
+    size_t      size;
+    /* where the file engine writes to, out.<thread> */
+    char        *out_dir;
+    /* the decoders of each thread, kept from one run to the next */
+    struct decoder_cache **caches;
+    gboolean    recursive;
+    int         max_depth;
+};
+
+struct bench_worker {
+    struct bench *b;
+    enum bench_engine engine;
+    int         index;
+    gboolean    quiet;
+    uint64_t    out_bytes;
+    int         ret;
+};
+
+/* The samples of an engine and thread count, without the outliers */
+struct bench_result {
+    int         runs;
+    int         outliers;
+    double      mean_ns;
+    /* half width of the 95% confidence interval of the mean */
+    double      ci_ns;
+    double      median_ns;
+    double      min_ns;
+    double      max_ns;
+};
+
+static gint runs = 20;
+static gint warmup = 3;
+static gchar *engines_arg;
+static gchar *threads_arg;
+static gchar *out_dir_arg;
+static gboolean json;
+static gboolean recursive;
+static gint max_depth = UNPACK_DEFAULT_MAX_DEPTH;
+static gchar **filenames;
+
+static GOptionEntry entries[] = {
+    { "runs", 'n', 0, G_OPTION_ARG_INT, &runs,
+      "Timed runs of each engine and thread count (default: 20)", "N" },
+    { "warmup", 0, 0, G_OPTION_ARG_INT, &warmup,
+      "Runs before the timed ones, left out (default: 3)", "N" },
+    { "engine", 0, 0, G_OPTION_ARG_STRING, &engines_arg,
+      "Comma separated engines: null, which discards the output, or file "
+      "(default: null,file)", "LIST" },
+    { "threads", 0, 0, G_OPTION_ARG_STRING, &threads_arg,
+      "Comma separated numbers of images unpacked at the same time "
+      "(default: 1 and the number of CPUs)", "LIST" },
+    { "output-dir", 0, 0, G_OPTION_ARG_FILENAME, &out_dir_arg,
+      "Write the output of the file engine in DIR (default: $TMPDIR)",
+      "DIR" },
+    { "json", 0, 0, G_OPTION_ARG_NONE, &json,
+      "Print a JSON object on a line for each engine and thread count", NULL },
+    { "recursive", 'r', 0, G_OPTION_ARG_NONE, &recursive,
+      "Keep unpacking nested formats until a kernel image is found", NULL },
+    { "max-depth", 0, 0, G_OPTION_ARG_INT, &max_depth,
+      "Maximum number of nested formats to unpack (default: 8)", "N" },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames,
+      NULL, NULL },
+    G_OPTION_ENTRY_NULL
+};
+
+static int bench_unpack(struct bench *b, enum bench_engine engine, int index,
+                        gboolean quiet, uint64_t *out_bytes)
+{
+    struct unpack_ctx ctx;
+    struct sink *out;
+    char *path = NULL;
+    int ret;
+
+    unpack_ctx_init(&ctx, b->prog, b->input_file);
+    ctx.recursive = b->recursive;
+    ctx.max_depth = b->max_depth;
+    ctx.quiet = quiet;
+    ctx.cache = b->caches[index];
+
+    if (engine == BENCH_ENGINE_FILE) {
+        path = g_strdup_printf("%s/out.%d", b->out_dir, index);
+        out = file_sink_new(&ctx, path);
+    } else {
+        out = null_sink_new(&ctx);
+    }
+    ret = out ? unpack_image(&ctx, b->image, b->size, out, TRUE) : -1;
+    *out_bytes = ctx.out_bytes;
+
+    unpack_ctx_clear(&ctx);
+    g_free(path);
+    return ret;
+}
+
+static gpointer bench_worker_thread(gpointer data)
+{
+    struct bench_worker *w = data;
+
+    w->ret = bench_unpack(w->b, w->engine, w->index, w->quiet, &w->out_bytes);
+    return NULL;
+}
+
+/*
+ * Unpack the image once in each of nthreads threads, the calling one
+ * included, and store in *ns how long it took all of them.
+ */
+static int bench_sample(struct bench *b, enum bench_engine engine,
+                        int nthreads, uint64_t *ns, uint64_t *out_bytes)
+{
+    struct bench_worker *workers = g_new0(struct bench_worker, nthreads);
+    GThread **threads = g_new(GThread *, nthreads);
+    uint64_t start;
+    int i, ret = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        workers[i].b = b;
+        workers[i].engine = engine;
+        workers[i].index = i;
+        workers[i].quiet = TRUE;
+    }
+
+    start = unpack_clock_ns();
+    for (i = 1; i < nthreads; i++) {
+        threads[i] = g_thread_new("bench", bench_worker_thread, &workers[i]);
+    }
+    bench_worker_thread(&workers[0]);
+    for (i = 1; i < nthreads; i++) {
+        g_thread_join(threads[i]);
+    }
+    *ns = unpack_clock_ns() - start;
+
+    *out_bytes = 0;
+    for (i = 0; i < nthreads; i++) {
+        *out_bytes += workers[i].out_bytes;
+        if (workers[i].ret < 0) {
+            ret = -1;
+        }
+    }
+    g_free(threads);
+    g_free(workers);
+    return ret;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* The q quantile of n sorted samples, interpolated between the closest two */
+static double quantile(const double *sorted, int n, double q)
+{
+    double pos = q * (n - 1);
+    int i = (int)pos;
+
+    if (i + 1 >= n) {
+        return sorted[n - 1];
+    }
+    return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+/* The two-sided 95% critical value of Student's t distribution */
+static double student_t95(int df)
+{
+    static const double t[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+        2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+        2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052,
+        2.048, 2.045, 2.042,
+    };
+
+    if (df < 1) {
+        return 0;
+    } else if (df <= (int)G_N_ELEMENTS(t)) {
+        return t[df - 1];
+    } else if (df <= 40) {
+        return 2.021;
+    } else if (df <= 60) {
+        return 2.000;
+    } else if (df <= 120) {
+        return 1.980;
+    }
+    return 1.960;
+}
+
+/*
+ * Leave out the samples beyond Tukey's fences, 1.5 times the interquartile
+ * range away from the quartiles, which are mostly runs that were preempted
+ * or stalled on I/O, and summarise the rest.
+ */
+static void bench_summarise(double *samples, int n, struct bench_result *r)
+{
+    double q1, q3, lo, hi, sum = 0, sq = 0;
+    int i, kept = 0;
+
+    qsort(samples, n, sizeof(*samples), compare_double);
+    q1 = quantile(samples, n, 0.25);
+    q3 = quantile(samples, n, 0.75);
+    lo = q1 - 1.5 * (q3 - q1);
+    hi = q3 + 1.5 * (q3 - q1);
+
+    /* the samples are sorted, those kept stay at the front */
+    for (i = 0; i < n; i++) {
+        if (samples[i] >= lo && samples[i] <= hi) {
+            samples[kept++] = samples[i];
+        }
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->runs = kept;
+    r->outliers = n - kept;
+    if (kept == 0) {
+        return;
+    }
+    for (i = 0; i < kept; i++) {
+        sum += samples[i];
+    }
+    r->mean_ns = sum / kept;
+    for (i = 0; i < kept; i++) {
+        sq += (samples[i] - r->mean_ns) * (samples[i] - r->mean_ns);
+    }
+    if (kept > 1) {
+        r->ci_ns = student_t95(kept - 1) * sqrt(sq / (kept - 1)) / sqrt(kept);
+    }
+    r->median_ns = quantile(samples, kept, 0.5);
+    r->min_ns = samples[0];
+    r->max_ns = samples[kept - 1];
+}
+
+static void bench_print(const struct bench *b, enum bench_engine engine,
+                        int nthreads, uint64_t out_bytes,
+                        const struct bench_result *r)
+{
+    /* of output, like --stats, and the interval of the mean time mapped */
+    double mbps = out_bytes * 1e3 / r->mean_ns;
+    double mbps_ci = mbps * r->ci_ns / r->mean_ns;
+    double ns_per_byte = r->mean_ns / out_bytes;
+    double ns_per_byte_ci = r->ci_ns / out_bytes;
+
+    if (json) {
+        GString *s = g_string_new("{\"input\":");
+
+        json_append_string(s, b->input_file);
+        g_string_append_printf(s, ",\"engine\":\"%s\",\"threads\":%d,"
+                               "\"runs\":%d,\"outliers\":%d,"
+                               "\"bytes_in\":%zu,\"bytes_out\":%"
+                               G_GUINT64_FORMAT ",\"mb_per_s\":%.1f,"
+                               "\"mb_per_s_ci95\":%.1f,"
+                               "\"ns_per_byte\":%.4f,"
+                               "\"ns_per_byte_ci95\":%.4f,"
+                               "\"median_ms\":%.3f,\"min_ms\":%.3f,"
+                               "\"max_ms\":%.3f}",
+                               engine_names[engine], nthreads, r->runs,
+                               r->outliers, b->size, out_bytes, mbps, mbps_ci,
+                               ns_per_byte, ns_per_byte_ci,
+                               r->median_ns / 1e6, r->min_ns / 1e6,
+                               r->max_ns / 1e6);
+        printf("%s\n", s->str);
+        g_string_free(s, TRUE);
+        return;
+    }
+    printf("%-6s %7d %9.1f ± %-7.1f %8.4f ± %-8.4f %10.3f %5d/%d\n",
+           engine_names[engine], nthreads, mbps, mbps_ci, ns_per_byte,
+           ns_per_byte_ci, r->median_ns / 1e6, r->outliers,
+           r->outliers + r->runs);
+}
+
+/* Time an engine with a number of threads, return -1 if unpacking failed */
+static int bench_run(struct bench *b, enum bench_engine engine, int nthreads)
+{
+    struct bench_result r;
+    uint64_t ns, out_bytes = 0;
+    double *samples = g_new(double, runs);
+    int i;
+
+    for (i = 0; i < warmup + runs; i++) {
+        if (bench_sample(b, engine, nthreads, &ns, &out_bytes) < 0) {
+            fprintf(stderr, "%s: cannot unpack %s\n", b->prog, b->input_file);
+            g_free(samples);
+            return -1;
+        }
+        if (i >= warmup) {
+            samples[i - warmup] = ns;
+        }
+    }
+    bench_summarise(samples, runs, &r);
+    bench_print(b, engine, nthreads, out_bytes, &r);
+    g_free(samples);
+    return 0;
+}
+
+static gboolean parse_engines(const char *arg, gboolean *enabled)
+{
+    gchar **names = g_strsplit(arg, ",", -1);
+    gboolean ok = TRUE;
+    int i, j;
+
+    for (i = 0; names[i]; i++) {
+        for (j = 0; j < BENCH_N_ENGINES; j++) {
+            if (strcmp(names[i], engine_names[j]) == 0) {
+                enabled[j] = TRUE;
+                break;
+            }
+        }
+        if (j == BENCH_N_ENGINES) {
+            ok = FALSE;
+        }
+    }
+    g_strfreev(names);
+    return ok;
+}
+
+/* Return an array of the thread counts in arg, or NULL if it is not valid */
+static GArray *parse_threads(const char *arg)
+{
+    GArray *counts = g_array_new(FALSE, FALSE, sizeof(int));
+    gchar **values = g_strsplit(arg, ",", -1);
+    int i;
+
+    for (i = 0; values[i]; i++) {
+        char *end;
+        long n = strtol(values[i], &end, 10);
+
+        if (*values[i] == '\0' || *end != '\0' || n < 1 || n > 1024) {
+            g_array_free(counts, TRUE);
+            counts = NULL;
+            break;
+        }
+        g_array_append_vals(counts, &(int){ n }, 1);
+    }
+    g_strfreev(values);
+    return counts;
+}
+
+int unpack_bench(int argc, char *argv[])
+{
+    gboolean enabled[BENCH_N_ENGINES] = { FALSE };
+    struct bench b = { .prog = argv[0] };
+    GOptionContext *context;
+    GError *error = NULL;
+    GArray *thread_counts;
+    gchar *contents = NULL;
+    char *template;
+    uint64_t out_bytes;
+    gsize size;
+    guint i, j;
+    int ret = 0, max_threads = 1;
+
+    context = g_option_context_new("bench <input file>");
+    g_option_context_set_summary(context, "Unpack an image repeatedly in "
+                                 "memory and report the throughput of each "
+                                 "engine and number of threads.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s: %s\n", b.prog, error->message);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free(context);
+
+    /* the subcommand name is left with the file names */
+    if (!filenames || g_strv_length(filenames) != 2) {
+        fprintf(stderr, "Usage: %s bench [OPTION...] <input file>\n", b.prog);
+        exit(EXIT_FAILURE);
+    }
+    if (runs < 1 || warmup < 0) {
+        fprintf(stderr, "%s: there must be at least one run\n", b.prog);
+        exit(EXIT_FAILURE);
+    }
+    if (!parse_engines(engines_arg ? engines_arg : "null,file", enabled)) {
+        fprintf(stderr, "%s: unknown engine in \"%s\"\n", b.prog,
+                engines_arg);
+        exit(EXIT_FAILURE);
+    }
+    if (threads_arg) {
+        thread_counts = parse_threads(threads_arg);
+        if (!thread_counts) {
+            fprintf(stderr, "%s: invalid number of threads in \"%s\"\n",
+                    b.prog, threads_arg);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        int ncpus = g_get_num_processors();
+
+        thread_counts = g_array_new(FALSE, FALSE, sizeof(int));
+        g_array_append_vals(thread_counts, &(int){ 1 }, 1);
+        if (ncpus > 1) {
+            g_array_append_vals(thread_counts, &ncpus, 1);
+        }
+    }
+
+    for (j = 0; j < thread_counts->len; j++) {
+        max_threads = MAX(max_threads, g_array_index(thread_counts, int, j));
+    }
+    b.caches = g_new(struct decoder_cache *, max_threads);
+    for (j = 0; j < (guint)max_threads; j++) {
+        b.caches[j] = decoder_cache_new(NULL);
+    }
+
+    b.input_file = filenames[1];
+    b.recursive = recursive;
+    b.max_depth = max_depth;
+    if (!g_file_get_contents(b.input_file, &contents, &size, &error)) {
+        fprintf(stderr, "%s: %s\n", b.prog, error->message);
+        exit(EXIT_FAILURE);
+    }
+    b.image = (const uint8_t *)contents;
+    b.size = size;
+
+    template = g_build_filename(out_dir_arg ? out_dir_arg : g_get_tmp_dir(),
+                                "unzboot-bench-XXXXXX", NULL);
+    b.out_dir = g_mkdtemp(template);
+    if (!b.out_dir) {
+        fprintf(stderr, "%s: %s: cannot create a directory for the output: "
+                "%s\n", b.prog, template, g_strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Unpack it once to check it can be, reporting what is found */
+    if (bench_unpack(&b, BENCH_ENGINE_NULL, 0, json, &out_bytes) < 0) {
+        fprintf(stderr, "%s: cannot unpack %s\n", b.prog, b.input_file);
+        ret = -1;
+        goto out;
+    }
+    if (!json) {
+        printf("%s: %zu bytes in, %" G_GUINT64_FORMAT " bytes out, %d runs "
+               "after %d to warm up\n", b.input_file, b.size, out_bytes, runs,
+               warmup);
+        printf("engine threads      MB/s ± 95%%       ns/byte ± 95%%      "
+               "median ms outliers\n");
+    }
+
+    for (i = 0; i < BENCH_N_ENGINES && ret == 0; i++) {
+        for (j = 0; j < thread_counts->len && enabled[i] && ret == 0; j++) {
+            ret = bench_run(&b, i, g_array_index(thread_counts, int, j));
+        }
+    }
+
+out:
+    for (j = 0; j < (guint)max_threads; j++) {
+        char *path = g_strdup_printf("%s/out.%u", b.out_dir, j);
+
+        unlink(path);
+        g_free(path);
+        decoder_cache_free(b.caches[j]);
+    }
+    g_free(b.caches);
+    rmdir(b.out_dir);
+    g_free(template);
+    g_array_free(thread_counts, TRUE);
+    g_free(contents);
+    g_free(engines_arg);
+    g_free(threads_arg);
+    g_free(out_dir_arg);
+    g_strfreev(filenames);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
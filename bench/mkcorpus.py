@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+#
+# Generate Linux EFI zboot images of any size, for benchmarks
+#
+# Copyright (c) 2023 Enric Balletbo i Serra
+#
+# SPDX-License-Identifier: MIT
+
+"""Generate EFI zboot images with a synthetic or real kernel Image as
+payload, of the given sizes, for every compression type and level asked for.
+A manifest.json listing them is written next to them, unless a single image
+is written with --file."""
+
+import argparse
+import bz2
+import itertools
+import json
+import lzma
+import os
+import random
+import shutil
+import struct
+import subprocess
+import zlib
+
+# struct linux_efi_zboot_header, in unzboot.h
+ZBOOT_HEADER = struct.Struct('<2s2s4sII8s32s4sI')
+ZBOOT_PAYLOAD_OFFSET = 4096
+
+CHUNK_SIZE = 1 << 20
+BLOCK_SIZE = 4096
+
+# the compression_type of the kernel for each format, and its default level
+TYPES = {
+    'gzip': ('gzip', 9),
+    'zstd': ('zstd22', 22),
+    'xz': ('xzkern', 6),
+    'lzma': ('lzma', 9),
+    'lz4': ('lz4', 9),
+    'lzo': ('lzo', 9),
+    'bzip2': ('bzip2', 9),
+}
+
+# formats compressed by an external tool, like the kernel build does
+TOOLS = {
+    'zstd': lambda level: ['zstd', '-q', '-c', '-%d' % level] +
+                          (['--ultra'] if level > 19 else []),
+    'lz4': lambda level: ['lz4', '-q', '-l', '-c', '-%d' % level],
+    'lzo': lambda level: ['lzop', '-q', '-c', '-%d' % level],
+}
+
+
+def parse_size(s):
+    units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    if s[-1].upper() in units:
+        return int(s[:-1]) * units[s[-1].upper()]
+    return int(s)
+
+
+def kernel_header(arch, size):
+    # just what tells an ARM64 or RISC-V Image apart, at offset 56
+    header = bytearray(64)
+    struct.pack_into('<Q', header, 16, size)
+    if arch == 'arm64':
+        header[56:60] = b'ARM\x64'
+    else:
+        header[48:56] = b'RISCV\0\0\0'
+        header[56:60] = b'RSC\x05'
+    return bytes(header)
+
+
+def synthetic_payload(arch, size, seed):
+    """A kernel Image look-alike: some blocks are zeros, some random, most
+    repeat a few patterns with small changes, so that it compresses by
+    about as much as a real kernel does."""
+    rng = random.Random(seed)
+    patterns = [rng.randbytes(256) for _ in range(64)]
+    yield kernel_header(arch, size)
+    left = size - 64
+    while left > 0:
+        kind = rng.random()
+        if kind < 0.1:
+            block = bytes(BLOCK_SIZE)
+        elif kind < 0.3:
+            block = rng.randbytes(BLOCK_SIZE)
+        else:
+            block = bytearray(b''.join(rng.choice(patterns)
+                                       for _ in range(BLOCK_SIZE // 256)))
+            for i in range(0, BLOCK_SIZE, 64):
+                block[i + rng.randrange(64)] = rng.randrange(256)
+        block = bytes(block[:left])
+        left -= len(block)
+        yield block
+
+
+def real_payload(path, size):
+    """A real Image, repeated or truncated to size."""
+    with open(path, 'rb') as f:
+        image = f.read()
+    left = size
+    while left > 0:
+        yield image[:left]
+        left -= min(left, len(image))
+
+
+def chunked(blocks):
+    buf = bytearray()
+    for block in blocks:
+        buf += block
+        if len(buf) >= CHUNK_SIZE:
+            yield bytes(buf)
+            buf.clear()
+    if buf:
+        yield bytes(buf)
+
+
+def compress(out, kind, level, chunks):
+    if kind in TOOLS:
+        proc = subprocess.Popen(TOOLS[kind](level), stdin=subprocess.PIPE,
+                                stdout=out)
+        for chunk in chunks:
+            proc.stdin.write(chunk)
+        proc.stdin.close()
+        if proc.wait() != 0:
+            raise RuntimeError('%s failed' % kind)
+        return
+
+    if kind == 'gzip':
+        c = zlib.compressobj(level, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+    elif kind == 'xz':
+        # the kernel checks xz streams with CRC32, see scripts/xz_wrap.sh
+        c = lzma.LZMACompressor(lzma.FORMAT_XZ, check=lzma.CHECK_CRC32,
+                                preset=level)
+    elif kind == 'lzma':
+        c = lzma.LZMACompressor(lzma.FORMAT_ALONE, preset=level)
+    else:
+        c = bz2.BZ2Compressor(level)
+    for chunk in chunks:
+        out.write(c.compress(chunk))
+    out.write(c.flush())
+
+
+def write_zboot(path, kind, level, size, chunks):
+    with open(path, 'wb') as out:
+        out.seek(ZBOOT_PAYLOAD_OFFSET)
+        out.flush()
+        compress(out, kind, level, chunks)
+        out.seek(0, os.SEEK_END)
+        # like the *_with_size commands of Makefile.zboot, for all but gzip
+        if kind != 'gzip':
+            out.write(struct.pack('<I', size))
+        payload_size = out.tell() - ZBOOT_PAYLOAD_OFFSET
+        out.seek(0)
+        out.write(ZBOOT_HEADER.pack(b'MZ', bytes(2), b'zimg',
+                                    ZBOOT_PAYLOAD_OFFSET, payload_size,
+                                    bytes(8), TYPES[kind][0].encode(),
+                                    b'\xcd\x23\x82\x81', 0))
+    return payload_size
+
+
+def available(kind):
+    return kind not in TOOLS or shutil.which(TOOLS[kind](1)[0]) is not None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('-o', '--output',
+                        help='directory to write the images to')
+    parser.add_argument('--file',
+                        help='write a single image to FILE instead, of the '
+                             'first type, level and size')
+    parser.add_argument('--size', default='16M',
+                        help='comma separated sizes of the uncompressed '
+                             'Image, with a K, M or G suffix')
+    parser.add_argument('--type', default='gzip',
+                        help='comma separated formats, or "all" of them')
+    parser.add_argument('--level', default='default',
+                        help='comma separated compression levels')
+    parser.add_argument('--count', type=int, default=1,
+                        help='images of each kind, with different contents')
+    parser.add_argument('--payload',
+                        help='a kernel Image to use instead of a '
+                             'synthetic one, already decompressed')
+    parser.add_argument('--arch', choices=['arm64', 'riscv'],
+                        default='arm64')
+    parser.add_argument('--seed', type=int, default=0)
+    args = parser.parse_args()
+
+    kinds = list(TYPES) if args.type == 'all' else args.type.split(',')
+    for kind in kinds:
+        if kind not in TYPES:
+            parser.error('unknown compression type %s' % kind)
+    sizes = [parse_size(s) for s in args.size.split(',')]
+    if args.file:
+        level = TYPES[kinds[0]][1] if args.level == 'default' else \
+            int(args.level.split(',')[0])
+        if args.payload:
+            blocks = real_payload(args.payload, sizes[0])
+        else:
+            blocks = synthetic_payload(args.arch, sizes[0], args.seed)
+        write_zboot(args.file, kinds[0], level, sizes[0], chunked(blocks))
+        return
+    if not args.output:
+        parser.error('either --output or --file is needed')
+
+    os.makedirs(args.output, exist_ok=True)
+    manifest = []
+    for kind in kinds:
+        if not available(kind):
+            print('skipping %s, %s is not installed' %
+                  (kind, TOOLS[kind](1)[0]))
+            continue
+        levels = [TYPES[kind][1]] if args.level == 'default' else \
+            [int(level) for level in args.level.split(',')]
+        for level, size, n in itertools.product(levels, sizes,
+                                                range(args.count)):
+            name = '%s-%d-%d-%d.efi' % (kind, level, size, n)
+            path = os.path.join(args.output, name)
+            if args.payload:
+                blocks = real_payload(args.payload, size)
+            else:
+                blocks = synthetic_payload(args.arch, size, args.seed + n)
+            payload_size = write_zboot(path, kind, level, size,
+                                       chunked(blocks))
+            manifest.append({
+                'path': name,
+                'compression': kind,
+                'level': level,
+                'image_size': size,
+                'payload_size': payload_size,
+            })
+            print(name)
+
+    with open(os.path.join(args.output, 'manifest.json'), 'w') as f:
+        json.dump(manifest, f, indent=2)
+        f.write('\n')
+
+
+if __name__ == '__main__':
+    main()
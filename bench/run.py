@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+#
+# Extract an image repeatedly and report how long it took
+#
+# Copyright (c) 2023 Enric Balletbo i Serra
+#
+# SPDX-License-Identifier: MIT
+
+"""Run unzboot on an image several times and print the median and p95 of
+the times it reports with --stats=json, as a single JSON object."""
+
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+
+def drop_cache(path):
+    # Only the clean pages of the file are dropped, which is all of them
+    # for an input that is never written; no privileges are needed.
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+
+def percentile(values, p):
+    # nearest rank, so that it is one of the samples
+    values = sorted(values)
+    return values[max(0, math.ceil(p / 100 * len(values)) - 1)]
+
+
+def summary(values):
+    return {
+        'median': round(percentile(values, 50), 3),
+        'p95': round(percentile(values, 95), 3),
+        'min': round(min(values), 3),
+        'max': round(max(values), 3),
+    }
+
+
+def run(args, output):
+    if args.cache == 'cold':
+        drop_cache(args.image)
+    cmd = [args.unzboot, '--stats=json', '--input=' + args.input]
+    cmd += args.extra + [args.image, output]
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, check=True,
+                          universal_newlines=True)
+    # the statistics are the last line, after what unzboot has found
+    return json.loads(proc.stdout.splitlines()[-1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('unzboot')
+    parser.add_argument('image')
+    parser.add_argument('--input', choices=['mmap', 'read', 'stream'],
+                        default='mmap')
+    parser.add_argument('--cache', choices=['warm', 'cold'], default='warm')
+    parser.add_argument('--runs', type=int, default=20)
+    parser.add_argument('--name')
+    parser.add_argument('extra', nargs='*',
+                        help='more options for unzboot, after --')
+    args = parser.parse_args()
+
+    samples = []
+    with tempfile.TemporaryDirectory() as tmp:
+        output = os.path.join(tmp, 'out')
+        if args.cache == 'warm':
+            run(args, output)
+        for _ in range(args.runs):
+            samples.append(run(args, output))
+
+    phases = samples[0]['phases_ms'].keys()
+    result = {
+        'name': args.name or os.path.basename(args.image),
+        'image': os.path.basename(args.image),
+        'input': args.input,
+        'cache': args.cache,
+        'runs': args.runs,
+        'bytes_in': samples[0]['bytes_in'],
+        'bytes_out': samples[0]['bytes_out'],
+        'wall_ms': summary([s['wall_ms'] for s in samples]),
+        'mb_per_s': summary([s['mb_per_s'] for s in samples]),
+        'phases_ms': {p: summary([s['phases_ms'][p] for s in samples])
+                      for p in phases},
+        'max_rss_kb': summary([s['rusage']['max_rss_kb'] for s in samples]),
+    }
+    json.dump(result, sys.stdout)
+    sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()
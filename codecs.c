@@ -0,0 +1,1386 @@
+/*
+ * Streaming decoders of the compression formats found in kernel images
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * Gunzip functionality in this file is derived from u-boot:
+ *
+ * (C) Copyright 2008 Semihalf
+ *
+ * (C) Copyright 2000-2005
+ * Wolfgang Denk, DENX Software Engineering, wd@denx.de.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+/* for ZSTD_createDStream_advanced(), exported by the shared library too */
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+
+#include "probes.h"
+#include "unzboot.h"
+
+#define ZALLOC_ALIGNMENT	16
+
+#define HEAD_CRC	        2
+#define EXTRA_FIELD         4
+#define ORIG_NAME           8
+#define COMMENT	            0x10
+#define RESERVED            0xe0
+#define DEFLATED            8
+
+#define GZIP_TRAILER_SIZE   8
+
+static inline uint32_t ldl_le(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t ldl_be(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void advance(const uint8_t **in, size_t *inlen, size_t n)
+{
+    *in += n;
+    *inlen -= n;
+}
+
+/*
+ * Decoders run in several threads at once, the counters are updated
+ * atomically.
+ */
+static struct zalloc_stats zalloc_stats;
+static uint64_t zalloc_in_use;
+
+static _Thread_local struct unpack_cost verify_cost;
+
+void codec_get_zalloc_stats(struct zalloc_stats *stats)
+{
+    stats->allocs = __atomic_load_n(&zalloc_stats.allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&zalloc_stats.frees, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&zalloc_stats.bytes, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&zalloc_stats.peak_bytes,
+                                        __ATOMIC_RELAXED);
+}
+
+void codec_take_verify_cost(struct unpack_cost *cost)
+{
+    *cost = verify_cost;
+    memset(&verify_cost, 0, sizeof(verify_cost));
+}
+
+/*
+ * The libraries free their memory without telling its size, which the
+ * allocators need: every allocation made for them is prefixed with it. The
+ * prefix keeps the alignment of the allocation.
+ */
+static void *sized_alloc(const struct unpack_allocator *a, size_t size)
+{
+    uint64_t *p;
+
+    size = (size + ZALLOC_ALIGNMENT - 1) & ~(size_t)(ZALLOC_ALIGNMENT - 1);
+    p = unpack_alloc(a, size + ZALLOC_ALIGNMENT);
+    *p = size;
+    return (uint8_t *)p + ZALLOC_ALIGNMENT;
+}
+
+static inline uint64_t *sized_prefix(void *addr)
+{
+    return (uint64_t *)((uint8_t *)addr - ZALLOC_ALIGNMENT);
+}
+
+/* Free what sized_alloc() returned and return its size */
+static size_t sized_free(const struct unpack_allocator *a, void *addr)
+{
+    uint64_t *p = sized_prefix(addr);
+    size_t size = *p;
+
+    unpack_free(a, p, size + ZALLOC_ALIGNMENT);
+    return size;
+}
+
+/* For the libraries that take the count and size of items separately */
+static void *sized_alloc_n(const struct unpack_allocator *a, size_t nmemb,
+                           size_t size)
+{
+    if (size && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    return sized_alloc(a, nmemb * size);
+}
+
+static void *zalloc(void *x, unsigned items, unsigned size)
+{
+    uint64_t in_use, peak;
+    void *addr;
+
+    addr = sized_alloc_n(x, items, size);
+    if (!addr) {
+        return NULL;
+    }
+    size = *sized_prefix(addr);
+
+    __atomic_add_fetch(&zalloc_stats.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&zalloc_stats.bytes, size, __ATOMIC_RELAXED);
+    in_use = __atomic_add_fetch(&zalloc_in_use, size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&zalloc_stats.peak_bytes, __ATOMIC_RELAXED);
+    while (in_use > peak &&
+           !__atomic_compare_exchange_n(&zalloc_stats.peak_bytes, &peak,
+                                        in_use, TRUE, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+        /* peak is updated with the current value, try again */
+    }
+
+    return addr;
+}
+
+static void zfree(void *x, void *addr)
+{
+    size_t size;
+
+    if (!addr) {
+        return;
+    }
+    size = sized_free(x, addr);
+    __atomic_add_fetch(&zalloc_stats.frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&zalloc_in_use, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * gzip, possibly made of several concatenated members. The header of each
+ * member is parsed here and the deflate data is inflated raw, so that the CRC
+ * and length in the trailer are checked in the open.
+ */
+enum gzip_step {
+    GZIP_HEADER,
+    GZIP_BODY,
+    GZIP_TRAILER,
+    GZIP_MEMBER_END,
+};
+
+struct gzip_state {
+    const struct unpack_allocator *a;
+    z_stream        s;
+    enum gzip_step  state;
+    uint32_t        crc;
+    uint32_t        isize;
+};
+
+/*
+ * Return the size of the gzip member header at src, 0 if more data is needed
+ * to tell or -1 if it is not valid.
+ */
+static ssize_t gzip_header_len(const uint8_t *src, size_t srclen,
+                               GError **error)
+{
+    int flags;
+    size_t i;
+
+    /* skip header */
+    i = 10;
+    if (srclen < 10) {
+        return 0;
+    }
+    flags = src[3];
+    if (src[0] != 0x1f || src[1] != 0x8b ||
+        src[2] != DEFLATED || (flags & RESERVED) != 0) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                    "Bad gzipped data");
+        return -1;
+    }
+    if ((flags & EXTRA_FIELD) != 0) {
+        if (srclen < 12) {
+            return 0;
+        }
+        i = 12 + src[10] + (src[11] << 8);
+    }
+    if ((flags & ORIG_NAME) != 0) {
+        while (i < srclen && src[i++] != 0) {
+            /* do nothing */
+        }
+    }
+    if ((flags & COMMENT) != 0) {
+        while (i < srclen && src[i++] != 0) {
+            /* do nothing */
+        }
+    }
+    if ((flags & HEAD_CRC) != 0) {
+        i += 2;
+    }
+    if (i >= srclen) {
+        return 0;
+    }
+    return i;
+}
+
+static void *gzip_init(const struct unpack_allocator *a, GError **error)
+{
+    struct gzip_state *gz = unpack_new0(a, struct gzip_state);
+    int r;
+
+    gz->a = a;
+    gz->s.zalloc = zalloc;
+    gz->s.zfree = zfree;
+    gz->s.opaque = (void *)a;
+    r = inflateInit2(&gz->s, -MAX_WBITS);
+    if (r != Z_OK) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_FAILED,
+                    "inflateInit2() returned %d", r);
+        unpack_free(a, gz, sizeof(*gz));
+        return NULL;
+    }
+    gz->state = GZIP_HEADER;
+    return gz;
+}
+
+static int gzip_reset(void *state)
+{
+    struct gzip_state *gz = state;
+
+    gz->state = GZIP_HEADER;
+    return inflateReset(&gz->s) == Z_OK ? 0 : -1;
+}
+
+static int gunzip(void *state, const uint8_t **in, size_t *inlen,
+                  uint8_t **out, size_t *outlen, gboolean eof,
+                  GError **error)
+{
+    struct gzip_state *gz = state;
+    z_stream *s = &gz->s;
+    size_t avail_in, avail_out;
+    struct unpack_cost start;
+    ssize_t n;
+    int r;
+
+    for (;;) {
+        switch (gz->state) {
+        case GZIP_HEADER:
+            n = gzip_header_len(*in, *inlen, error);
+            if (n <= 0) {
+                return n;
+            }
+            advance(in, inlen, n);
+            inflateReset(s);
+            gz->crc = crc32(0, NULL, 0);
+            gz->isize = 0;
+            gz->state = GZIP_BODY;
+            break;
+        case GZIP_BODY:
+            avail_in = MIN(*inlen, UINT_MAX);
+            avail_out = MIN(*outlen, UINT_MAX);
+            s->next_in = (uint8_t *)*in;
+            s->avail_in = avail_in;
+            s->next_out = *out;
+            s->avail_out = avail_out;
+            r = inflate(s, Z_NO_FLUSH);
+            if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+                g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                            "inflate() returned %d", r);
+                return -1;
+            }
+            unpack_cost_begin(&start);
+            gz->crc = crc32(gz->crc, *out, avail_out - s->avail_out);
+            unpack_cost_add_since(&verify_cost, &start);
+            if (G_UNLIKELY(trace_enabled)) {
+                trace_span("crc", start.ns, unpack_clock_ns());
+            }
+            gz->isize += avail_out - s->avail_out;
+            advance(in, inlen, avail_in - s->avail_in);
+            *out += avail_out - s->avail_out;
+            *outlen -= avail_out - s->avail_out;
+            if (r != Z_STREAM_END) {
+                return 0;
+            }
+            gz->state = GZIP_TRAILER;
+            break;
+        case GZIP_TRAILER:
+            if (*inlen < GZIP_TRAILER_SIZE) {
+                return 0;
+            }
+            UNZBOOT_PROBE3(verify, gz->crc, gz->isize,
+                           ldl_le(*in) == gz->crc &&
+                           ldl_le(*in + 4) == gz->isize);
+            if (ldl_le(*in) != gz->crc || ldl_le(*in + 4) != gz->isize) {
+                g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                            "gunzip CRC or length mismatch");
+                return -1;
+            }
+            advance(in, inlen, GZIP_TRAILER_SIZE);
+            gz->state = GZIP_MEMBER_END;
+            break;
+        case GZIP_MEMBER_END:
+            /* another member follows, or trailing data that is ignored */
+            if (*inlen < 2) {
+                return eof ? 1 : 0;
+            }
+            if ((*in)[0] != 0x1f || (*in)[1] != 0x8b) {
+                return 1;
+            }
+            gz->state = GZIP_HEADER;
+            break;
+        }
+    }
+}
+
+static void gzip_end(void *state)
+{
+    struct gzip_state *gz = state;
+
+    inflateEnd(&gz->s);
+    unpack_free(gz->a, gz, sizeof(*gz));
+}
+
+/* The size in the trailer of the last member, modulo 4 GiB as gzip -l has it */
+static int64_t gzip_content_size(const uint8_t *buf, size_t len)
+{
+    if (len < 18) {
+        return -1;
+    }
+    return ldl_le(buf + len - 4);
+}
+
+static const struct decoder_ops gzip_ops = {
+    .init = gzip_init,
+    .reset = gzip_reset,
+    .decode = gunzip,
+    .end = gzip_end,
+    .content_size = gzip_content_size,
+};
+
+#ifdef HAVE_ZSTD
+struct zstd_state {
+    const struct unpack_allocator *a;
+    ZSTD_DStream    *ds;
+    gboolean        frame_end;
+};
+
+static void *zstd_alloc(void *opaque, size_t size)
+{
+    return sized_alloc(opaque, size);
+}
+
+static void zstd_free(void *opaque, void *addr)
+{
+    if (addr) {
+        sized_free(opaque, addr);
+    }
+}
+
+static void *zstd_init(const struct unpack_allocator *a, GError **error)
+{
+    struct zstd_state *z = unpack_new0(a, struct zstd_state);
+    ZSTD_customMem mem = { zstd_alloc, zstd_free, (void *)a };
+
+    z->a = a;
+    z->ds = ZSTD_createDStream_advanced(mem);
+    if (!z->ds) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_FAILED,
+                    "ZSTD_createDStream_advanced() failed");
+        unpack_free(a, z, sizeof(*z));
+        return NULL;
+    }
+    ZSTD_initDStream(z->ds);
+    return z;
+}
+
+static int zstd_reset(void *state)
+{
+    struct zstd_state *z = state;
+
+    z->frame_end = FALSE;
+    return ZSTD_isError(ZSTD_initDStream(z->ds)) ? -1 : 0;
+}
+
+static int zstd_decode(void *state, const uint8_t **in, size_t *inlen,
+                       uint8_t **out, size_t *outlen, gboolean eof,
+                       GError **error)
+{
+    struct zstd_state *z = state;
+    ZSTD_inBuffer ib;
+    ZSTD_outBuffer ob;
+    size_t r;
+
+    /* frames may be concatenated, anything else ends the stream */
+    if (z->frame_end) {
+        if (*inlen < 4) {
+            return eof ? 1 : 0;
+        }
+        if (ldl_le(*in) != ZSTD_MAGICNUMBER) {
+            return 1;
+        }
+        z->frame_end = FALSE;
+    }
+
+    ib = (ZSTD_inBuffer){ *in, *inlen, 0 };
+    ob = (ZSTD_outBuffer){ *out, *outlen, 0 };
+    r = ZSTD_decompressStream(z->ds, &ob, &ib);
+    if (ZSTD_isError(r)) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                    "ZSTD_decompressStream() returned %s",
+                    ZSTD_getErrorName(r));
+        return -1;
+    }
+    advance(in, inlen, ib.pos);
+    *out += ob.pos;
+    *outlen -= ob.pos;
+    z->frame_end = r == 0;
+    return 0;
+}
+
+static void zstd_end(void *state)
+{
+    struct zstd_state *z = state;
+
+    ZSTD_freeDStream(z->ds);
+    unpack_free(z->a, z, sizeof(*z));
+}
+
+/*
+ * Decoding all the frames at once writes them straight to out, instead of
+ * through the window buffer of the stream decoder.
+ */
+static int zstd_decode_buffer(void *state, const uint8_t *in, size_t inlen,
+                              uint8_t *out, size_t *outlen, GError **error)
+{
+    struct zstd_state *z = state;
+    size_t frames = 0, n, r;
+
+    /* what follows the last frame is ignored, as by zstd_decode() */
+    do {
+        n = ZSTD_findFrameCompressedSize(in + frames, inlen - frames);
+        if (ZSTD_isError(n)) {
+            g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                        "ZSTD_findFrameCompressedSize() returned %s",
+                        ZSTD_getErrorName(n));
+            return -1;
+        }
+        frames += n;
+    } while (inlen - frames >= 4 && ldl_le(in + frames) == ZSTD_MAGICNUMBER);
+
+    r = ZSTD_decompressDCtx(z->ds, out, *outlen, in, frames);
+    if (ZSTD_isError(r)) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                    "ZSTD_decompressDCtx() returned %s", ZSTD_getErrorName(r));
+        return -1;
+    }
+    *outlen = r;
+    return 0;
+}
+
+/* Frames only record their size when the compressor knew it beforehand */
+static int64_t zstd_content_size(const uint8_t *buf, size_t len)
+{
+    unsigned long long size = ZSTD_getFrameContentSize(buf, len);
+
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+        size > INT64_MAX) {
+        return -1;
+    }
+    return size;
+}
+
+static const struct decoder_ops zstd_ops = {
+    .init = zstd_init,
+    .reset = zstd_reset,
+    .decode = zstd_decode,
+    .end = zstd_end,
+    .decode_buffer = zstd_decode_buffer,
+    .content_size = zstd_content_size,
+};
+#define ZSTD_OPS    (&zstd_ops)
+#else
+#define ZSTD_OPS    NULL
+#endif
+
+#ifdef HAVE_LZMA
+struct xz_state {
+    const struct unpack_allocator *a;
+    lzma_allocator  allocator;
+    lzma_stream     s;
+};
+
+static void *xz_alloc(void *opaque, size_t nmemb, size_t size)
+{
+    return sized_alloc_n(opaque, nmemb, size);
+}
+
+static void xz_free(void *opaque, void *addr)
+{
+    if (addr) {
+        sized_free(opaque, addr);
+    }
+}
+
+static lzma_ret lzma_start(lzma_stream *s, gboolean alone)
+{
+    return alone ? lzma_alone_decoder(s, UINT64_MAX) :
+                   lzma_stream_decoder(s, UINT64_MAX, 0);
+}
+
+static void *lzma_init_common(const struct unpack_allocator *a,
+                              gboolean alone, GError **error)
+{
+    struct xz_state *x = unpack_new0(a, struct xz_state);
+    lzma_ret r;
+
+    x->a = a;
+    x->allocator = (lzma_allocator){ xz_alloc, xz_free, (void *)a };
+    x->s = (lzma_stream)LZMA_STREAM_INIT;
+    x->s.allocator = &x->allocator;
+    r = lzma_start(&x->s, alone);
+    if (r != LZMA_OK) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_FAILED,
+                    "lzma decoder initialization returned %d", r);
+        unpack_free(a, x, sizeof(*x));
+        return NULL;
+    }
+    return x;
+}
+
+static void *xz_init(const struct unpack_allocator *a, GError **error)
+{
+    return lzma_init_common(a, FALSE, error);
+}
+
+static void *lzma_alone_init(const struct unpack_allocator *a,
+                             GError **error)
+{
+    return lzma_init_common(a, TRUE, error);
+}
+
+/* Starting a decoder of the same kind again reuses the memory of the last */
+static int xz_reset(void *state)
+{
+    struct xz_state *x = state;
+
+    return lzma_start(&x->s, FALSE) == LZMA_OK ? 0 : -1;
+}
+
+static int lzma_alone_reset(void *state)
+{
+    struct xz_state *x = state;
+
+    return lzma_start(&x->s, TRUE) == LZMA_OK ? 0 : -1;
+}
+
+static int lzma_decode(void *state, const uint8_t **in, size_t *inlen,
+                       uint8_t **out, size_t *outlen, gboolean eof,
+                       GError **error)
+{
+    struct xz_state *x = state;
+    lzma_stream *s = &x->s;
+    lzma_ret r;
+
+    s->next_in = *in;
+    s->avail_in = *inlen;
+    s->next_out = *out;
+    s->avail_out = *outlen;
+    r = lzma_code(s, eof ? LZMA_FINISH : LZMA_RUN);
+    advance(in, inlen, *inlen - s->avail_in);
+    *outlen -= s->next_out - *out;
+    *out = s->next_out;
+    if (r == LZMA_STREAM_END) {
+        return 1;
+    }
+    if (r != LZMA_OK && r != LZMA_BUF_ERROR) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                    "lzma_code() returned %d", r);
+        return -1;
+    }
+    return 0;
+}
+
+static void lzma_decoder_end(void *state)
+{
+    struct xz_state *x = state;
+
+    lzma_end(&x->s);
+    unpack_free(x->a, x, sizeof(*x));
+}
+
+static const struct decoder_ops xz_ops = {
+    .init = xz_init,
+    .reset = xz_reset,
+    .decode = lzma_decode,
+    .end = lzma_decoder_end,
+};
+
+/* The .lzma header has the size after the properties, all ones if unknown */
+static int64_t lzma_alone_content_size(const uint8_t *buf, size_t len)
+{
+    uint64_t size = 0;
+    int i;
+
+    if (len < 13) {
+        return -1;
+    }
+    for (i = 12; i >= 5; i--) {
+        size = (size << 8) | buf[i];
+    }
+    return size > INT64_MAX ? -1 : (int64_t)size;
+}
+
+static const struct decoder_ops lzma_ops = {
+    .init = lzma_alone_init,
+    .reset = lzma_alone_reset,
+    .decode = lzma_decode,
+    .end = lzma_decoder_end,
+    .content_size = lzma_alone_content_size,
+};
+#define XZ_OPS      (&xz_ops)
+#define LZMA_OPS    (&lzma_ops)
+#else
+#define XZ_OPS      NULL
+#define LZMA_OPS    NULL
+#endif
+
+#if defined(HAVE_LZ4) || defined(HAVE_LZO)
+/*
+ * Block based formats are decoded a whole block at a time: the compressed
+ * block is gathered in blk, decompressed to buf and handed out from there.
+ */
+struct block_state {
+    const struct unpack_allocator *a;
+    struct unpack_buf blk;
+    size_t      blk_size;       /* compressed size of the current block */
+    uint8_t     *buf;
+    size_t      buf_size;
+    size_t      buf_len;
+    size_t      buf_pos;
+};
+
+static void block_state_init(struct block_state *b,
+                             const struct unpack_allocator *a,
+                             size_t max_block)
+{
+    b->a = a;
+    b->buf = unpack_alloc(a, max_block);
+    b->buf_size = max_block;
+}
+
+/* Forget the block being decoded, keeping the buffers */
+static void block_state_reset(struct block_state *b)
+{
+    b->blk.len = 0;
+    b->blk_size = 0;
+    b->buf_len = 0;
+    b->buf_pos = 0;
+}
+
+static void block_state_clear(struct block_state *b)
+{
+    unpack_buf_clear(b->a, &b->blk);
+    unpack_free(b->a, b->buf, b->buf_size);
+}
+
+/* Hand out what is left of the current decompressed block */
+static void block_drain(struct block_state *b, uint8_t **out, size_t *outlen)
+{
+    size_t n = MIN(*outlen, b->buf_len - b->buf_pos);
+
+    memcpy(*out, b->buf + b->buf_pos, n);
+    b->buf_pos += n;
+    *out += n;
+    *outlen -= n;
+}
+
+/* Gather the compressed block, return TRUE once it is complete */
+static gboolean block_gather(struct block_state *b, const uint8_t **in,
+                             size_t *inlen)
+{
+    size_t n = MIN(*inlen, b->blk_size - b->blk.len);
+
+    unpack_buf_append(b->a, &b->blk, *in, n);
+    advance(in, inlen, n);
+    return b->blk.len == b->blk_size;
+}
+#endif
+
+#ifdef HAVE_LZ4
+/*
+ * The legacy LZ4 format used by the kernel: a magic number and a sequence of
+ * blocks, each one prefixed with its little endian compressed size.
+ */
+#define LZ4_LEGACY_MAGIC        0x184c2102
+#define LZ4_LEGACY_BLOCK_SIZE   (8 << 20)
+
+struct lz4_state {
+    struct block_state  b;
+    gboolean            magic_seen;
+};
+
+static void *lz4_init(const struct unpack_allocator *a, GError **error)
+{
+    struct lz4_state *l = unpack_new0(a, struct lz4_state);
+
+    (void)error;
+    block_state_init(&l->b, a, LZ4_LEGACY_BLOCK_SIZE);
+    return l;
+}
+
+static int lz4_reset(void *state)
+{
+    struct lz4_state *l = state;
+
+    block_state_reset(&l->b);
+    l->magic_seen = FALSE;
+    return 0;
+}
+
+static int lz4_decode(void *state, const uint8_t **in, size_t *inlen,
+                      uint8_t **out, size_t *outlen, gboolean eof,
+                      GError **error)
+{
+    struct lz4_state *l = state;
+    struct block_state *b = &l->b;
+    int r;
+
+    for (;;) {
+        block_drain(b, out, outlen);
+        if (b->buf_pos < b->buf_len) {
+            return 0;
+        }
+
+        if (b->blk_size == 0) {
+            if (*inlen < 4) {
+                return eof ? 1 : 0;
+            }
+            if (ldl_le(*in) == LZ4_LEGACY_MAGIC) {
+                l->magic_seen = TRUE;
+                advance(in, inlen, 4);
+                continue;
+            }
+            /*
+             * The kernel appends the decompressed size to the stream: the
+             * last four bytes of the input are that, not a block. Until the
+             * end of the input, four bytes could be either.
+             */
+            if (*inlen == 4) {
+                return eof ? 1 : 0;
+            }
+            if (!l->magic_seen || ldl_le(*in) == 0 ||
+                ldl_le(*in) > (uint32_t)LZ4_compressBound(LZ4_LEGACY_BLOCK_SIZE)) {
+                return 1;
+            }
+            b->blk_size = ldl_le(*in);
+            advance(in, inlen, 4);
+        }
+
+        if (!block_gather(b, in, inlen)) {
+            return 0;
+        }
+        r = LZ4_decompress_safe((const char *)b->blk.data, (char *)b->buf,
+                                b->blk_size, LZ4_LEGACY_BLOCK_SIZE);
+        if (r < 0) {
+            g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                        "LZ4_decompress_safe() returned %d", r);
+            return -1;
+        }
+        b->buf_len = r;
+        b->buf_pos = 0;
+        b->blk_size = 0;
+        b->blk.len = 0;
+    }
+}
+
+static void lz4_end(void *state)
+{
+    struct lz4_state *l = state;
+
+    block_state_clear(&l->b);
+    unpack_free(l->b.a, l, sizeof(*l));
+}
+
+static const struct decoder_ops lz4_ops = {
+    .init = lz4_init,
+    .reset = lz4_reset,
+    .decode = lz4_decode,
+    .end = lz4_end,
+};
+#define LZ4_OPS     (&lz4_ops)
+#else
+#define LZ4_OPS     NULL
+#endif
+
+#ifdef HAVE_LZO
+/*
+ * The lzop container used by the kernel, with blocks compressed by LZO1X.
+ */
+#define LZOP_MAGIC_LEN          9
+#define LZOP_MAX_BLOCK_SIZE     (64 << 20)
+
+#define F_ADLER32_D             0x00000001
+#define F_ADLER32_C             0x00000002
+#define F_H_EXTRA_FIELD         0x00000040
+#define F_CRC32_D               0x00000100
+#define F_CRC32_C               0x00000200
+#define F_H_FILTER              0x00000800
+
+struct lzo_state {
+    struct block_state  b;
+    gboolean            header_done;
+    uint32_t            flags;
+    uint32_t            dst_len;
+};
+
+static void *lzo_decoder_init(const struct unpack_allocator *a,
+                              GError **error)
+{
+    struct lzo_state *l;
+
+    if (lzo_init() != LZO_E_OK) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_FAILED,
+                    "lzo_init() failed");
+        return NULL;
+    }
+    l = unpack_new0(a, struct lzo_state);
+    block_state_init(&l->b, a, LZOP_MAX_BLOCK_SIZE);
+    return l;
+}
+
+static int lzo_reset(void *state)
+{
+    struct lzo_state *l = state;
+
+    block_state_reset(&l->b);
+    l->header_done = FALSE;
+    l->flags = 0;
+    l->dst_len = 0;
+    return 0;
+}
+
+/*
+ * Return the size of the lzop file header at p, 0 if more data is needed or
+ * -1 if it is not valid.
+ */
+static ssize_t lzop_header_len(struct lzo_state *l, const uint8_t *p,
+                               size_t len, GError **error)
+{
+    uint16_t version;
+    size_t i = LZOP_MAGIC_LEN;
+
+    if (len < i + 8) {
+        return 0;
+    }
+    if (memcmp(p, "\x89LZO\0\r\n\x1a\n", LZOP_MAGIC_LEN) != 0) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                    "Bad lzop data");
+        return -1;
+    }
+    version = (p[i] << 8) | p[i + 1];
+    i += 4;                         /* version, lib_version */
+    if (version >= 0x0940) {
+        i += 2;                     /* version_needed_to_extract */
+    }
+    i += 1;                         /* method */
+    if (version >= 0x0940) {
+        i += 1;                     /* level */
+    }
+    if (len < i + 4) {
+        return 0;
+    }
+    l->flags = ldl_be(p + i);
+    i += 4;
+    if (l->flags & F_H_FILTER) {
+        i += 4;
+    }
+    i += 8;                         /* mode, mtime_low */
+    if (version >= 0x0940) {
+        i += 4;                     /* mtime_high */
+    }
+    if (len < i + 1) {
+        return 0;
+    }
+    i += 1 + p[i] + 4;              /* name and header checksum */
+    if (l->flags & F_H_EXTRA_FIELD) {
+        if (len < i + 4) {
+            return 0;
+        }
+        i += 4 + ldl_be(p + i) + 4;
+    }
+    return len < i ? 0 : (ssize_t)i;
+}
+
+static int lzo_decode(void *state, const uint8_t **in, size_t *inlen,
+                      uint8_t **out, size_t *outlen, gboolean eof,
+                      GError **error)
+{
+    struct lzo_state *l = state;
+    struct block_state *b = &l->b;
+    lzo_uint dst_len;
+    ssize_t n;
+    size_t hdr;
+    int r;
+
+    if (!l->header_done) {
+        n = lzop_header_len(l, *in, *inlen, error);
+        if (n <= 0) {
+            return n;
+        }
+        advance(in, inlen, n);
+        l->header_done = TRUE;
+    }
+
+    for (;;) {
+        block_drain(b, out, outlen);
+        if (b->buf_pos < b->buf_len) {
+            return 0;
+        }
+
+        if (b->blk_size == 0) {
+            if (*inlen < 4) {
+                return eof ? 1 : 0;
+            }
+            /* a zero block size marks the end of the stream */
+            l->dst_len = ldl_be(*in);
+            if (l->dst_len == 0) {
+                return 1;
+            }
+            if (l->dst_len > LZOP_MAX_BLOCK_SIZE) {
+                g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                            "lzop block too large");
+                return -1;
+            }
+            hdr = 8 + !!(l->flags & F_ADLER32_D) * 4 +
+                  !!(l->flags & F_CRC32_D) * 4;
+            if (*inlen < hdr) {
+                return 0;
+            }
+            b->blk_size = ldl_be(*in + 4);
+            if (b->blk_size < l->dst_len) {
+                hdr += !!(l->flags & F_ADLER32_C) * 4 +
+                       !!(l->flags & F_CRC32_C) * 4;
+                if (*inlen < hdr) {
+                    b->blk_size = 0;
+                    return 0;
+                }
+            }
+            if (b->blk_size == 0 || b->blk_size > l->dst_len) {
+                g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                            "Bad lzop data");
+                return -1;
+            }
+            advance(in, inlen, hdr);
+        }
+
+        if (!block_gather(b, in, inlen)) {
+            return 0;
+        }
+        if (b->blk_size == l->dst_len) {
+            /* stored uncompressed */
+            memcpy(b->buf, b->blk.data, l->dst_len);
+        } else {
+            dst_len = l->dst_len;
+            r = lzo1x_decompress_safe(b->blk.data, b->blk_size, b->buf,
+                                      &dst_len, NULL);
+            if (r != LZO_E_OK || dst_len != l->dst_len) {
+                g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                            "lzo1x_decompress_safe() returned %d", r);
+                return -1;
+            }
+        }
+        b->buf_len = l->dst_len;
+        b->buf_pos = 0;
+        b->blk_size = 0;
+        b->blk.len = 0;
+    }
+}
+
+static void lzo_end(void *state)
+{
+    struct lzo_state *l = state;
+
+    block_state_clear(&l->b);
+    unpack_free(l->b.a, l, sizeof(*l));
+}
+
+static const struct decoder_ops lzo_ops = {
+    .init = lzo_decoder_init,
+    .reset = lzo_reset,
+    .decode = lzo_decode,
+    .end = lzo_end,
+};
+#define LZO_OPS     (&lzo_ops)
+#else
+#define LZO_OPS     NULL
+#endif
+
+#ifdef HAVE_BZIP2
+struct bzip2_state {
+    const struct unpack_allocator *a;
+    bz_stream   s;
+    gboolean    stream_end;
+};
+
+static void *bzip2_alloc(void *opaque, int nmemb, int size)
+{
+    return sized_alloc_n(opaque, nmemb, size);
+}
+
+static void bzip2_free(void *opaque, void *addr)
+{
+    if (addr) {
+        sized_free(opaque, addr);
+    }
+}
+
+static void *bzip2_init(const struct unpack_allocator *a, GError **error)
+{
+    struct bzip2_state *bz = unpack_new0(a, struct bzip2_state);
+    int r;
+
+    bz->a = a;
+    bz->s.bzalloc = bzip2_alloc;
+    bz->s.bzfree = bzip2_free;
+    bz->s.opaque = (void *)a;
+    r = BZ2_bzDecompressInit(&bz->s, 0, 0);
+    if (r != BZ_OK) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_FAILED,
+                    "BZ2_bzDecompressInit() returned %d", r);
+        unpack_free(a, bz, sizeof(*bz));
+        return NULL;
+    }
+    return bz;
+}
+
+static int bzip2_decode(void *state, const uint8_t **in, size_t *inlen,
+                        uint8_t **out, size_t *outlen, gboolean eof,
+                        GError **error)
+{
+    struct bzip2_state *bz = state;
+    unsigned int avail_in, avail_out;
+    int r;
+
+    /* streams may be concatenated, anything else ends the stream */
+    if (bz->stream_end) {
+        if (*inlen < 3) {
+            return eof ? 1 : 0;
+        }
+        if (memcmp(*in, "BZh", 3) != 0) {
+            return 1;
+        }
+        BZ2_bzDecompressEnd(&bz->s);
+        r = BZ2_bzDecompressInit(&bz->s, 0, 0);
+        if (r != BZ_OK) {
+            g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_FAILED,
+                        "BZ2_bzDecompressInit() returned %d", r);
+            return -1;
+        }
+        bz->stream_end = FALSE;
+    }
+
+    avail_in = MIN(*inlen, UINT_MAX);
+    avail_out = MIN(*outlen, UINT_MAX);
+    bz->s.next_in = (char *)*in;
+    bz->s.avail_in = avail_in;
+    bz->s.next_out = (char *)*out;
+    bz->s.avail_out = avail_out;
+    r = BZ2_bzDecompress(&bz->s);
+    if (r != BZ_OK && r != BZ_STREAM_END) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                    "BZ2_bzDecompress() returned %d", r);
+        return -1;
+    }
+    advance(in, inlen, avail_in - bz->s.avail_in);
+    *out += avail_out - bz->s.avail_out;
+    *outlen -= avail_out - bz->s.avail_out;
+    bz->stream_end = r == BZ_STREAM_END;
+    return 0;
+}
+
+static void bzip2_end(void *state)
+{
+    struct bzip2_state *bz = state;
+
+    BZ2_bzDecompressEnd(&bz->s);
+    unpack_free(bz->a, bz, sizeof(*bz));
+}
+
+/* libbz2 can not reset a decoder, bzip2 states are not reused */
+static const struct decoder_ops bzip2_ops = {
+    .init = bzip2_init,
+    .decode = bzip2_decode,
+    .end = bzip2_end,
+};
+#define BZIP2_OPS   (&bzip2_ops)
+#else
+#define BZIP2_OPS   NULL
+#endif
+
+/*
+ * The magic of each format is given once, both the table of formats and the
+ * dispatch on the first byte of a stream are built from it.
+ */
+#define GZIP_MAGIC      0x1f, 0x8b, 0x08
+#define ZSTD_MAGIC      0x28, 0xb5, 0x2f, 0xfd
+#define XZ_MAGIC        0xfd, '7', 'z', 'X', 'Z', 0x00
+#define LZMA_MAGIC      0x5d, 0x00, 0x00, 0x00
+#define LZ4_MAGIC       0x02, 0x21, 0x4c, 0x18
+#define LZO_MAGIC       0x89, 'L', 'Z', 'O', 0x00, '\r', '\n', 0x1a, '\n'
+#define BZIP2_MAGIC     'B', 'Z', 'h'
+
+#define CODEC(id_, name_, magic_, ops_) \
+    [id_] = { id_, name_, { magic_ }, sizeof((const uint8_t[]){ magic_ }), \
+              ops_ }
+
+const struct codec codecs[N_CODECS] = {
+    CODEC(CODEC_GZIP,   "gzip",     GZIP_MAGIC,     &gzip_ops),
+    CODEC(CODEC_ZSTD,   "zstd",     ZSTD_MAGIC,     ZSTD_OPS),
+    CODEC(CODEC_XZ,     "xz",       XZ_MAGIC,       XZ_OPS),
+    CODEC(CODEC_LZMA,   "lzma",     LZMA_MAGIC,     LZMA_OPS),
+    CODEC(CODEC_LZ4,    "lz4",      LZ4_MAGIC,      LZ4_OPS),
+    CODEC(CODEC_LZO,    "lzo",      LZO_MAGIC,      LZO_OPS),
+    CODEC(CODEC_BZIP2,  "bzip2",    BZIP2_MAGIC,    BZIP2_OPS),
+};
+
+#define MAGIC_FIRST(magic_)         MAGIC_FIRST_(magic_)
+#define MAGIC_FIRST_(first, ...)    (first)
+
+/*
+ * The id + 1 of the format whose magic starts with each byte, 0 for none.
+ * No two magics start with the same byte, -Woverride-init tells if a new
+ * one does.
+ */
+static const uint8_t codec_by_first_byte[256] = {
+    [MAGIC_FIRST(GZIP_MAGIC)]   = CODEC_GZIP + 1,
+    [MAGIC_FIRST(ZSTD_MAGIC)]   = CODEC_ZSTD + 1,
+    [MAGIC_FIRST(XZ_MAGIC)]     = CODEC_XZ + 1,
+    [MAGIC_FIRST(LZMA_MAGIC)]   = CODEC_LZMA + 1,
+    [MAGIC_FIRST(LZ4_MAGIC)]    = CODEC_LZ4 + 1,
+    [MAGIC_FIRST(LZO_MAGIC)]    = CODEC_LZO + 1,
+    [MAGIC_FIRST(BZIP2_MAGIC)]  = CODEC_BZIP2 + 1,
+};
+
+const struct codec *codec_detect(const uint8_t *buf, size_t len)
+{
+    const struct codec *codec;
+
+    if (len == 0 || !codec_by_first_byte[buf[0]]) {
+        return NULL;
+    }
+    codec = &codecs[codec_by_first_byte[buf[0]] - 1];
+    if (len < codec->magic_len ||
+        memcmp(buf, codec->magic, codec->magic_len) != 0) {
+        return NULL;
+    }
+    return codec;
+}
+
+/*
+ * Decoder states and output chunks of finished layers, for the next ones to
+ * reuse. There is room for a state of every codec, for images of mixed
+ * compressions, and for the chunks of a few nested layers.
+ */
+#define DECODER_CACHE_SIZE  8
+
+struct decoder_cache {
+    const struct unpack_allocator *a;
+    struct {
+        const struct decoder_ops *ops;
+        void    *state;
+    } states[DECODER_CACHE_SIZE];
+    int         nstates;
+    uint8_t     *chunks[DECODER_CACHE_SIZE];
+    int         nchunks;
+};
+
+struct decoder_cache *decoder_cache_new(const struct unpack_allocator *a)
+{
+    struct decoder_cache *cache = unpack_new0(a, struct decoder_cache);
+
+    cache->a = a;
+    return cache;
+}
+
+void decoder_cache_free(struct decoder_cache *cache)
+{
+    int i;
+
+    if (!cache) {
+        return;
+    }
+    for (i = 0; i < cache->nstates; i++) {
+        cache->states[i].ops->end(cache->states[i].state);
+    }
+    for (i = 0; i < cache->nchunks; i++) {
+        unpack_free(cache->a, cache->chunks[i], UNPACK_CHUNK_SIZE);
+    }
+    unpack_free(cache->a, cache, sizeof(*cache));
+}
+
+void *decoder_cache_get(struct decoder_cache *cache,
+                        const struct unpack_allocator *a,
+                        const struct decoder_ops *ops, GError **error)
+{
+    void *state;
+    int i;
+
+    for (i = 0; cache && i < cache->nstates; i++) {
+        if (cache->states[i].ops != ops) {
+            continue;
+        }
+        state = cache->states[i].state;
+        cache->states[i] = cache->states[--cache->nstates];
+        /* states are reset when reused, whatever they were left in */
+        if (ops->reset(state) == 0) {
+            return state;
+        }
+        ops->end(state);
+        break;
+    }
+    return ops->init(a, error);
+}
+
+void decoder_cache_put(struct decoder_cache *cache,
+                       const struct decoder_ops *ops, void *state)
+{
+    if (cache && ops->reset && cache->nstates < DECODER_CACHE_SIZE) {
+        cache->states[cache->nstates].ops = ops;
+        cache->states[cache->nstates].state = state;
+        cache->nstates++;
+        return;
+    }
+    ops->end(state);
+}
+
+uint8_t *decoder_cache_get_chunk(struct decoder_cache *cache,
+                                 const struct unpack_allocator *a)
+{
+    if (cache && cache->nchunks > 0) {
+        return cache->chunks[--cache->nchunks];
+    }
+    return unpack_alloc(a, UNPACK_CHUNK_SIZE);
+}
+
+void decoder_cache_put_chunk(struct decoder_cache *cache,
+                             const struct unpack_allocator *a, uint8_t *chunk)
+{
+    if (cache && cache->nchunks < DECODER_CACHE_SIZE) {
+        cache->chunks[cache->nchunks++] = chunk;
+        return;
+    }
+    unpack_free(a, chunk, UNPACK_CHUNK_SIZE);
+}
+
+/* A zboot compression type of up to 6 characters, as a little endian key */
+#define ZBOOT_TYPE(a, b, c, d, e, f) \
+    ((uint64_t)(a) | (uint64_t)(b) << 8 | (uint64_t)(c) << 16 | \
+     (uint64_t)(d) << 24 | (uint64_t)(e) << 32 | (uint64_t)(f) << 40)
+
+#define ZBOOT_TYPE_MAX  6
+
+const struct codec *codec_from_zboot_type(const char *type, size_t len)
+{
+    size_t i, n = strnlen(type, len);
+    uint64_t key = 0;
+
+    if (n > ZBOOT_TYPE_MAX) {
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        key |= (uint64_t)(uint8_t)type[i] << (8 * i);
+    }
+
+    switch (key) {
+    case ZBOOT_TYPE('g', 'z', 'i', 'p', 0, 0):
+        return &codecs[CODEC_GZIP];
+    case ZBOOT_TYPE('z', 's', 't', 'd', '2', '2'):
+    case ZBOOT_TYPE('z', 's', 't', 'd', 0, 0):
+        return &codecs[CODEC_ZSTD];
+    case ZBOOT_TYPE('x', 'z', 'k', 'e', 'r', 'n'):
+    case ZBOOT_TYPE('x', 'z', 0, 0, 0, 0):
+        return &codecs[CODEC_XZ];
+    case ZBOOT_TYPE('l', 'z', 'm', 'a', 0, 0):
+        return &codecs[CODEC_LZMA];
+    case ZBOOT_TYPE('l', 'z', '4', 0, 0, 0):
+        return &codecs[CODEC_LZ4];
+    case ZBOOT_TYPE('l', 'z', 'o', 0, 0, 0):
+        return &codecs[CODEC_LZO];
+    case ZBOOT_TYPE('b', 'z', 'i', 'p', '2', 0):
+        return &codecs[CODEC_BZIP2];
+    default:
+        return NULL;
+    }
+}
+
+int codec_decode_buffer(const struct codec *codec, struct decoder_cache *cache,
+                        const struct unpack_allocator *a, const uint8_t *in,
+                        size_t inlen, uint8_t *out, size_t *outlen,
+                        GError **error)
+{
+    const struct decoder_ops *ops = codec->ops;
+    size_t room = *outlen, last_in, last_room;
+    void *state;
+    int r;
+
+    state = decoder_cache_get(cache, a, ops, error);
+    if (!state) {
+        return -1;
+    }
+    if (ops->decode_buffer) {
+        r = ops->decode_buffer(state, in, inlen, out, outlen, error);
+        decoder_cache_put(cache, ops, state);
+        return r;
+    }
+
+    /* the stream decoder, with all of the input and output at once */
+    do {
+        last_in = inlen;
+        last_room = room;
+        r = ops->decode(state, &in, &inlen, &out, &room, TRUE, error);
+    } while (r == 0 && (inlen < last_in || room < last_room));
+    decoder_cache_put(cache, ops, state);
+
+    if (r == 0 && room > 0) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_CORRUPT,
+                    "%s out of data", codec->name);
+        return -1;
+    }
+    if (r == 0) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_FAILED,
+                    "%s stream does not fit in %zu bytes", codec->name,
+                    *outlen);
+        return -1;
+    }
+    if (r < 0) {
+        return -1;
+    }
+    *outlen -= room;
+    return 0;
+}
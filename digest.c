@@ -0,0 +1,232 @@
+/*
+ * Content digests of the payload and of the kernel, for --digest
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+#include "unzboot.h"
+
+#define DIGEST_MAX_LEN      32
+
+const char *const digest_names[N_DIGESTS] = {
+    [DIGEST_SHA256] = "sha256",
+    [DIGEST_BLAKE3] = "blake3",
+};
+
+/*
+ * SHA-256 is taken from libcrypto where it is found, for its implementations
+ * with the SHA extensions of x86 and arm64, and from GLib otherwise. BLAKE3
+ * needs libblake3, which picks the widest SIMD instructions of the CPU.
+ */
+struct digest {
+    enum digest_algo algo;
+#ifdef HAVE_OPENSSL
+    EVP_MD_CTX      *evp;
+#else
+    GChecksum       *checksum;
+#endif
+#ifdef HAVE_BLAKE3
+    blake3_hasher   blake3;
+#endif
+};
+
+gboolean digest_available(enum digest_algo algo)
+{
+    switch (algo) {
+    case DIGEST_BLAKE3:
+#ifdef HAVE_BLAKE3
+        return TRUE;
+#else
+        return FALSE;
+#endif
+    default:
+        return TRUE;
+    }
+}
+
+gboolean digest_parse(const char *list, guint *algos, GError **error)
+{
+    gchar **names = g_strsplit(list, ",", -1);
+    gboolean ok = TRUE;
+    int i, j;
+
+    *algos = 0;
+    for (i = 0; names[i] && ok; i++) {
+        for (j = 0; j < N_DIGESTS; j++) {
+            if (strcmp(names[i], digest_names[j]) == 0) {
+                break;
+            }
+        }
+        if (j == N_DIGESTS) {
+            g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_UNSUPPORTED,
+                        "unknown digest \"%s\"", names[i]);
+            ok = FALSE;
+        } else if (!digest_available(j)) {
+            g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_UNSUPPORTED,
+                        "%s digests are not supported by this build",
+                        names[i]);
+            ok = FALSE;
+        } else {
+            *algos |= 1 << j;
+        }
+    }
+    g_strfreev(names);
+    return ok;
+}
+
+struct digest *digest_new(enum digest_algo algo)
+{
+    struct digest *d = g_new0(struct digest, 1);
+
+    d->algo = algo;
+    switch (algo) {
+    case DIGEST_SHA256:
+#ifdef HAVE_OPENSSL
+        d->evp = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(d->evp, EVP_sha256(), NULL);
+#else
+        d->checksum = g_checksum_new(G_CHECKSUM_SHA256);
+#endif
+        break;
+    case DIGEST_BLAKE3:
+#ifdef HAVE_BLAKE3
+        blake3_hasher_init(&d->blake3);
+#endif
+        break;
+    default:
+        break;
+    }
+    return d;
+}
+
+void digest_update(struct digest *d, const uint8_t *buf, size_t len)
+{
+    switch (d->algo) {
+    case DIGEST_SHA256:
+#ifdef HAVE_OPENSSL
+        EVP_DigestUpdate(d->evp, buf, len);
+#else
+        g_checksum_update(d->checksum, buf, len);
+#endif
+        break;
+    case DIGEST_BLAKE3:
+#ifdef HAVE_BLAKE3
+        blake3_hasher_update(&d->blake3, buf, len);
+#endif
+        break;
+    default:
+        break;
+    }
+}
+
+void digest_free(struct digest *d)
+{
+#ifdef HAVE_OPENSSL
+    EVP_MD_CTX_free(d->evp);
+#else
+    if (d->checksum) {
+        g_checksum_free(d->checksum);
+    }
+#endif
+    g_free(d);
+}
+
+char *digest_finish(struct digest *d)
+{
+    uint8_t md[DIGEST_MAX_LEN];
+    size_t len = 0;
+    GString *hex;
+    size_t i;
+
+    switch (d->algo) {
+    case DIGEST_SHA256: {
+#ifdef HAVE_OPENSSL
+        unsigned int n = sizeof(md);
+
+        EVP_DigestFinal_ex(d->evp, md, &n);
+        len = n;
+#else
+        gsize n = sizeof(md);
+
+        g_checksum_get_digest(d->checksum, md, &n);
+        len = n;
+#endif
+        break;
+    }
+    case DIGEST_BLAKE3:
+#ifdef HAVE_BLAKE3
+        blake3_hasher_finalize(&d->blake3, md, BLAKE3_OUT_LEN);
+        len = BLAKE3_OUT_LEN;
+#endif
+        break;
+    default:
+        break;
+    }
+    digest_free(d);
+
+    hex = g_string_sized_new(len * 2);
+    for (i = 0; i < len; i++) {
+        g_string_append_printf(hex, "%02x", md[i]);
+    }
+    return g_string_free(hex, FALSE);
+}
+
+/* Hashes the kernel, as a branch of the output tee */
+struct digest_sink {
+    struct sink     sink;
+    struct unpack_ctx *ctx;
+    struct digest   *digest;
+};
+
+static int digest_sink_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct digest_sink *s = (struct digest_sink *)sink;
+
+    digest_update(s->digest, buf, len);
+    return 0;
+}
+
+static int digest_sink_finish(struct sink *sink)
+{
+    struct digest_sink *s = (struct digest_sink *)sink;
+    enum digest_algo algo = s->digest->algo;
+
+    g_free(s->ctx->kernel_digest[algo]);
+    s->ctx->kernel_digest[algo] = digest_finish(s->digest);
+    g_free(s);
+    return 0;
+}
+
+static void digest_sink_abort(struct sink *sink)
+{
+    struct digest_sink *s = (struct digest_sink *)sink;
+
+    digest_free(s->digest);
+    g_free(s);
+}
+
+struct sink *digest_sink_new(struct unpack_ctx *ctx, enum digest_algo algo)
+{
+    struct digest_sink *s = g_new0(struct digest_sink, 1);
+
+    s->ctx = ctx;
+    s->digest = digest_new(algo);
+    s->sink.write = digest_sink_write;
+    s->sink.finish = digest_sink_finish;
+    s->sink.abort = digest_sink_abort;
+    return &s->sink;
+}
@@ -0,0 +1,662 @@
+/*
+ * Encoders, to write the kernel compressed again in another format
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "unzboot.h"
+
+/*
+ * gzip and lz4 are compressed a block at a time by a pool of threads, and
+ * the blocks written out in order, like pigz does. zstd has worker threads
+ * of its own.
+ *
+ * A gzip block is a raw deflate stream of its own, primed with the end of
+ * the block before it as dictionary and ended with a sync flush but for the
+ * last one, so that the blocks make up a single deflate stream.
+ */
+#define GZIP_BLOCK_SIZE     (128 << 10)
+#define GZIP_DICT_SIZE      (32 << 10)
+
+/* The blocks of the legacy format used by the kernel, as lz4 -l writes them */
+#define LZ4_LEGACY_MAGIC        0x184c2102
+#define LZ4_LEGACY_BLOCK_SIZE   (8 << 20)
+
+/* Below this level, lz4 blocks are compressed with the fast compressor */
+#define LZ4_HC_MIN_LEVEL    3
+
+/* Blocks being compressed or waiting to be written, for each thread */
+#define ENCODE_BLOCKS_PER_THREAD    2
+
+struct encode_sink;
+struct encode_block;
+
+/* A format blocks are compressed to */
+struct block_encoder {
+    size_t  block_size;
+    /* the dictionary carried from each block to the next, 0 if none */
+    size_t  dict_size;
+    /* write what comes before the first block and after the last one */
+    int     (*header)(struct encode_sink *e);
+    int     (*trailer)(struct encode_sink *e);
+    /* compress a block, in a thread of the pool */
+    gboolean (*compress)(struct encode_sink *e, struct encode_block *b);
+};
+
+struct encode_block {
+    uint8_t     *in;
+    size_t      in_len;
+    uint8_t     *dict;
+    size_t      dict_len;
+    gboolean    last;
+    uint8_t     *out;
+    size_t      out_len;
+    uint32_t    crc;
+    /* set by the thread that compressed it, under the lock */
+    gboolean    done;
+    gboolean    failed;
+};
+
+struct encode_sink {
+    struct sink sink;
+    struct unpack_ctx *ctx;
+    struct sink *out;
+    const struct codec *codec;
+    int         level;
+
+    /* block encoders */
+    const struct block_encoder *enc;
+    GThreadPool *pool;
+    GMutex      lock;
+    GCond       cond;
+    /* the blocks handed to the pool, in order */
+    GQueue      blocks;
+    guint       max_blocks;
+    struct encode_block *cur;
+    uint32_t    crc;
+    uint64_t    in_bytes;
+
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx   *cctx;
+    uint8_t     *zbuf;
+    size_t      zbuf_size;
+#endif
+};
+
+static void encode_block_free(struct encode_block *b)
+{
+    g_free(b->in);
+    g_free(b->dict);
+    g_free(b->out);
+    g_free(b);
+}
+
+static struct encode_block *encode_block_new(struct encode_sink *e)
+{
+    struct encode_block *b = g_new0(struct encode_block, 1);
+
+    b->in = g_malloc(e->enc->block_size);
+    return b;
+}
+
+static void stl_le(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/*
+ * gzip
+ */
+static int gzip_header(struct encode_sink *e)
+{
+    /* deflate, no name nor time, from Unix */
+    static const uint8_t header[10] = { 0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0,
+                                        0x03 };
+
+    return e->out->write(e->out, header, sizeof(header));
+}
+
+static int gzip_trailer(struct encode_sink *e)
+{
+    uint8_t trailer[8];
+
+    stl_le(trailer, e->crc);
+    stl_le(trailer + 4, e->in_bytes);
+    return e->out->write(e->out, trailer, sizeof(trailer));
+}
+
+static gboolean gzip_compress(struct encode_sink *e, struct encode_block *b)
+{
+    z_stream s = { 0 };
+    size_t size;
+    int r;
+
+    if (deflateInit2(&s, e->level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return FALSE;
+    }
+    if (b->dict_len > 0) {
+        deflateSetDictionary(&s, b->dict, b->dict_len);
+    }
+    /* room for the empty stored block of the sync flush too */
+    size = deflateBound(&s, b->in_len) + 16;
+    b->out = g_malloc(size);
+    s.next_in = b->in;
+    s.avail_in = b->in_len;
+    s.next_out = b->out;
+    s.avail_out = size;
+    /*
+     * The flush is only complete once deflate leaves some of the output
+     * unused: until then, it is given more room and called again.
+     */
+    for (;;) {
+        r = deflate(&s, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (r == Z_STREAM_END || r == Z_STREAM_ERROR || s.avail_out > 0) {
+            break;
+        }
+        b->out = g_realloc(b->out, size * 2);
+        s.next_out = b->out + size;
+        s.avail_out = size;
+        size *= 2;
+    }
+    b->out_len = size - s.avail_out;
+    deflateEnd(&s);
+    b->crc = crc32(0, b->in, b->in_len);
+    return s.avail_in == 0 && (b->last ? r == Z_STREAM_END :
+                               r == Z_OK && s.avail_out > 0);
+}
+
+static const struct block_encoder gzip_encoder = {
+    .block_size = GZIP_BLOCK_SIZE,
+    .dict_size = GZIP_DICT_SIZE,
+    .header = gzip_header,
+    .trailer = gzip_trailer,
+    .compress = gzip_compress,
+};
+
+/*
+ * lz4, in the legacy format the kernel decompresses: the magic, then every
+ * block with its compressed size before it
+ */
+#ifdef HAVE_LZ4
+static int lz4_header(struct encode_sink *e)
+{
+    uint8_t magic[4];
+
+    stl_le(magic, LZ4_LEGACY_MAGIC);
+    return e->out->write(e->out, magic, sizeof(magic));
+}
+
+static int lz4_trailer(struct encode_sink *e)
+{
+    (void)e;
+    return 0;
+}
+
+static gboolean lz4_compress(struct encode_sink *e, struct encode_block *b)
+{
+    int size = LZ4_compressBound(b->in_len), n;
+
+    if (b->in_len == 0) {
+        return TRUE;
+    }
+    b->out = g_malloc(size + 4);
+    if (e->level < LZ4_HC_MIN_LEVEL) {
+        n = LZ4_compress_default((const char *)b->in, (char *)b->out + 4,
+                                 b->in_len, size);
+    } else {
+        n = LZ4_compress_HC((const char *)b->in, (char *)b->out + 4,
+                            b->in_len, size, e->level);
+    }
+    stl_le(b->out, n);
+    b->out_len = n + 4;
+    return n > 0;
+}
+
+static const struct block_encoder lz4_encoder = {
+    .block_size = LZ4_LEGACY_BLOCK_SIZE,
+    .header = lz4_header,
+    .trailer = lz4_trailer,
+    .compress = lz4_compress,
+};
+#endif
+
+static void encode_block_thread(gpointer data, gpointer user_data)
+{
+    struct encode_sink *e = user_data;
+    struct encode_block *b = data;
+    gboolean ok;
+
+    ok = e->enc->compress(e, b);
+
+    g_mutex_lock(&e->lock);
+    b->failed = !ok;
+    b->done = TRUE;
+    g_cond_broadcast(&e->cond);
+    g_mutex_unlock(&e->lock);
+}
+
+/*
+ * Write the blocks done at the head of the queue, after waiting for the
+ * first one if wait is set. Returns -1 if a block could not be compressed
+ * or written.
+ */
+static int encode_flush(struct encode_sink *e, gboolean wait)
+{
+    struct encode_block *b;
+    struct unpack_cost start;
+    int ret = 0;
+
+    for (;;) {
+        g_mutex_lock(&e->lock);
+        b = g_queue_peek_head(&e->blocks);
+        if (b && !b->done && wait) {
+            unpack_cost_begin(&start);
+            while (!b->done) {
+                g_cond_wait(&e->cond, &e->lock);
+            }
+            unpack_phase_end(e->ctx, UNPACK_PHASE_WRITE, &start);
+        }
+        if (!b || !b->done) {
+            g_mutex_unlock(&e->lock);
+            return 0;
+        }
+        g_queue_pop_head(&e->blocks);
+        g_mutex_unlock(&e->lock);
+        wait = FALSE;
+
+        if (b->failed) {
+            unpack_error(e->ctx, UNPACK_ERROR_FAILED,
+                         "%s: cannot compress the kernel with %s",
+                         e->ctx->input_file, e->codec->name);
+            ret = -1;
+        } else if (b->out_len > 0) {
+            ret = e->out->write(e->out, b->out, b->out_len);
+        }
+        e->crc = crc32_combine(e->crc, b->crc, b->in_len);
+        encode_block_free(b);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+}
+
+/* Hand the block being filled to the pool, keeping its end as dictionary */
+static int encode_submit(struct encode_sink *e, gboolean last)
+{
+    struct encode_block *b = e->cur;
+    size_t dict_len;
+
+    b->last = last;
+    e->cur = NULL;
+    if (!last) {
+        e->cur = encode_block_new(e);
+        dict_len = MIN(b->in_len, e->enc->dict_size);
+        if (dict_len > 0) {
+            e->cur->dict = g_malloc(dict_len);
+            memcpy(e->cur->dict, b->in + b->in_len - dict_len, dict_len);
+            e->cur->dict_len = dict_len;
+        }
+    }
+
+    g_mutex_lock(&e->lock);
+    g_queue_push_tail(&e->blocks, b);
+    g_mutex_unlock(&e->lock);
+    g_thread_pool_push(e->pool, b, NULL);
+
+    /* bound the memory taken by the blocks in flight */
+    return encode_flush(e, g_queue_get_length(&e->blocks) >= e->max_blocks);
+}
+
+static int encode_blocks_write(struct encode_sink *e, const uint8_t *buf,
+                               size_t len)
+{
+    struct encode_block *b;
+    size_t n;
+
+    while (len > 0) {
+        b = e->cur;
+        n = MIN(len, e->enc->block_size - b->in_len);
+        memcpy(b->in + b->in_len, buf, n);
+        b->in_len += n;
+        e->in_bytes += n;
+        buf += n;
+        len -= n;
+        if (b->in_len == e->enc->block_size && encode_submit(e, FALSE) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Wait for every block in flight, and throw them away */
+static void encode_blocks_drain(struct encode_sink *e)
+{
+    struct encode_block *b;
+
+    g_mutex_lock(&e->lock);
+    while ((b = g_queue_pop_head(&e->blocks))) {
+        while (!b->done) {
+            g_cond_wait(&e->cond, &e->lock);
+        }
+        encode_block_free(b);
+    }
+    g_mutex_unlock(&e->lock);
+}
+
+/*
+ * zstd
+ */
+#ifdef HAVE_ZSTD
+static int zstd_stream(struct encode_sink *e, const uint8_t *buf, size_t len,
+                       ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer in = { buf, len, 0 };
+    ZSTD_outBuffer out;
+    size_t r;
+
+    do {
+        out = (ZSTD_outBuffer){ e->zbuf, e->zbuf_size, 0 };
+        r = ZSTD_compressStream2(e->cctx, &out, &in, mode);
+        if (ZSTD_isError(r)) {
+            unpack_error(e->ctx, UNPACK_ERROR_FAILED,
+                         "%s: ZSTD_compressStream2() returned %s",
+                         e->ctx->input_file, ZSTD_getErrorName(r));
+            return -1;
+        }
+        if (out.pos > 0 && e->out->write(e->out, e->zbuf, out.pos) < 0) {
+            return -1;
+        }
+    } while (mode == ZSTD_e_end ? r != 0 : in.pos < in.size);
+    return 0;
+}
+
+static int zstd_setup(struct encode_sink *e)
+{
+    e->cctx = ZSTD_createCCtx();
+    if (!e->cctx ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(e->cctx,
+                                            ZSTD_c_compressionLevel,
+                                            e->level)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(e->cctx, ZSTD_c_checksumFlag,
+                                            1))) {
+        unpack_error(e->ctx, UNPACK_ERROR_FAILED,
+                     "%s: cannot set up the zstd compressor",
+                     e->ctx->input_file);
+        return -1;
+    }
+    /* a libzstd built without threads compresses in this one */
+    ZSTD_CCtx_setParameter(e->cctx, ZSTD_c_nbWorkers,
+                           g_get_num_processors());
+    e->zbuf_size = ZSTD_CStreamOutSize();
+    e->zbuf = g_malloc(e->zbuf_size);
+    return 0;
+}
+#endif
+
+static void encode_sink_free(struct encode_sink *e)
+{
+    if (e->pool) {
+        encode_blocks_drain(e);
+        g_thread_pool_free(e->pool, FALSE, TRUE);
+    }
+    if (e->cur) {
+        encode_block_free(e->cur);
+    }
+    g_mutex_clear(&e->lock);
+    g_cond_clear(&e->cond);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(e->cctx);
+    g_free(e->zbuf);
+#endif
+    g_free(e);
+}
+
+static int encode_sink_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct encode_sink *e = (struct encode_sink *)sink;
+
+#ifdef HAVE_ZSTD
+    if (e->cctx) {
+        return zstd_stream(e, buf, len, ZSTD_e_continue);
+    }
+#endif
+    return encode_blocks_write(e, buf, len);
+}
+
+static void encode_sink_abort(struct sink *sink)
+{
+    struct encode_sink *e = (struct encode_sink *)sink;
+
+    e->out->abort(e->out);
+    encode_sink_free(e);
+}
+
+static int encode_sink_finish(struct sink *sink)
+{
+    struct encode_sink *e = (struct encode_sink *)sink;
+    int ret;
+
+#ifdef HAVE_ZSTD
+    if (e->cctx) {
+        ret = zstd_stream(e, NULL, 0, ZSTD_e_end);
+    } else
+#endif
+    {
+        ret = encode_submit(e, TRUE);
+        while (ret == 0 && !g_queue_is_empty(&e->blocks)) {
+            ret = encode_flush(e, TRUE);
+        }
+        if (ret == 0) {
+            ret = e->enc->trailer(e);
+        }
+    }
+    if (ret < 0) {
+        encode_sink_abort(sink);
+        return -1;
+    }
+    ret = e->out->finish(e->out);
+    encode_sink_free(e);
+    return ret;
+}
+
+/* The levels of a format, and the one used when none is given */
+struct encode_levels {
+    int     min;
+    int     max;
+    int     def;
+};
+
+static gboolean encode_levels(const struct codec *codec,
+                              struct encode_levels *l)
+{
+    switch (codec->id) {
+    case CODEC_GZIP:
+        *l = (struct encode_levels){ 1, 9, 6 };
+        return TRUE;
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        *l = (struct encode_levels){ 1, ZSTD_maxCLevel(), ZSTD_CLEVEL_DEFAULT };
+        return TRUE;
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        *l = (struct encode_levels){ 1, LZ4HC_CLEVEL_MAX, 1 };
+        return TRUE;
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+gboolean encode_check(const struct codec *codec, int level, GError **error)
+{
+    struct encode_levels l;
+
+    if (!encode_levels(codec, &l)) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_UNSUPPORTED,
+                    "compressing with %s is not supported", codec->name);
+        return FALSE;
+    }
+    if (level != 0 && (level < l.min || level > l.max)) {
+        g_set_error(error, UNPACK_ERROR, UNPACK_ERROR_UNSUPPORTED,
+                    "%s compression levels go from %d to %d", codec->name,
+                    l.min, l.max);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+struct sink *encode_sink_new(struct unpack_ctx *ctx, const struct codec *codec,
+                             int level, struct sink *out)
+{
+    struct encode_sink *e;
+    struct encode_levels l = { 0 };
+    GError *error = NULL;
+    guint threads;
+
+    if (!encode_check(codec, level, &error)) {
+        unpack_error(ctx, error->code, "%s: %s", ctx->input_file,
+                     error->message);
+        g_error_free(error);
+        out->abort(out);
+        return NULL;
+    }
+    encode_levels(codec, &l);
+
+    e = g_new0(struct encode_sink, 1);
+    e->ctx = ctx;
+    e->out = out;
+    e->codec = codec;
+    e->level = level ? level : l.def;
+    g_mutex_init(&e->lock);
+    g_cond_init(&e->cond);
+    e->sink.write = encode_sink_write;
+    e->sink.finish = encode_sink_finish;
+    e->sink.abort = encode_sink_abort;
+
+#ifdef HAVE_ZSTD
+    if (codec->id == CODEC_ZSTD) {
+        if (zstd_setup(e) < 0) {
+            encode_sink_abort(&e->sink);
+            return NULL;
+        }
+        return &e->sink;
+    }
+#endif
+#ifdef HAVE_LZ4
+    e->enc = codec->id == CODEC_LZ4 ? &lz4_encoder : &gzip_encoder;
+#else
+    e->enc = &gzip_encoder;
+#endif
+    threads = g_get_num_processors();
+    e->max_blocks = threads * ENCODE_BLOCKS_PER_THREAD;
+    e->pool = g_thread_pool_new(encode_block_thread, e, threads, FALSE, NULL);
+    e->cur = encode_block_new(e);
+    e->crc = crc32(0, NULL, 0);
+    if (e->enc->header(e) < 0) {
+        encode_sink_abort(&e->sink);
+        return NULL;
+    }
+    return &e->sink;
+}
+
+const struct codec *encode_codec_for_path(const char *path)
+{
+    static const struct {
+        const char      *suffix;
+        enum codec_id   id;
+    } suffixes[] = {
+        { ".gz",    CODEC_GZIP },
+        { ".zst",   CODEC_ZSTD },
+        { ".lz4",   CODEC_LZ4 },
+    };
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS(suffixes); i++) {
+        if (g_str_has_suffix(path, suffixes[i].suffix)) {
+            return &codecs[suffixes[i].id];
+        }
+    }
+    return NULL;
+}
+
+/* The kernel written to out, compressed with codec if it is not NULL */
+static struct sink *kernel_sink_new(struct unpack_ctx *ctx, struct sink *out,
+                                    const struct codec *codec, int level)
+{
+    if (!out || !codec) {
+        return out;
+    }
+    return encode_sink_new(ctx, codec, level, out);
+}
+
+/*
+ * The branches of the output: the kernel written to path, to each of the
+ * tee files and to a digest sink for each digest
+ */
+struct output_branches {
+    const char          *path;
+    char                **tee_files;
+    int                 ntee;
+    enum digest_algo    digests[N_DIGESTS];
+};
+
+static struct sink *output_open(struct unpack_ctx *ctx, int i, gpointer data)
+{
+    struct output_branches *o = data;
+    struct sink *out;
+    const char *path;
+
+    if (i == 0) {
+        out = ctx->output_fd >= 0 ?
+            fd_sink_new(ctx, ctx->output_fd, o->path) :
+            file_sink_new(ctx, o->path);
+        return kernel_sink_new(ctx, out, ctx->output_codec,
+                               ctx->output_level);
+    }
+    if (i <= o->ntee) {
+        path = o->tee_files[i - 1];
+        return kernel_sink_new(ctx, file_sink_new(ctx, path),
+                               encode_codec_for_path(path), 0);
+    }
+    return digest_sink_new(ctx, o->digests[i - 1 - o->ntee]);
+}
+
+struct sink *output_sink_new(struct unpack_ctx *ctx, const char *path)
+{
+    struct output_branches o = {
+        .path = path,
+        .tee_files = ctx->tee_files,
+        .ntee = ctx->tee_files ? g_strv_length(ctx->tee_files) : 0,
+    };
+    int i, n = 1 + o.ntee;
+
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (ctx->digests & (1 << i)) {
+            o.digests[n++ - 1 - o.ntee] = i;
+        }
+    }
+    if (n == 1) {
+        return output_open(ctx, 0, &o);
+    }
+    return tee_sink_new(ctx, n, output_open, &o);
+}
@@ -0,0 +1,261 @@
+/*
+ * libunzboot-gio: extract kernel images asynchronously, the GIO way
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <unistd.h>
+
+#include "libunzboot-gio.h"
+
+G_DEFINE_QUARK(unzboot-error-quark, unzboot_error)
+
+/*
+ * An extraction, the data of its task. The worker thread writes the kernel
+ * and the progress made, the main context reads the progress.
+ */
+struct extract_job {
+    GTask       *task;
+    char        *path;
+    enum unzboot_extract_flags flags;
+    /* where the kernel goes: fd, or bytes if it is -1 */
+    int         fd;
+    GByteArray  *bytes;
+    guint64     written;
+    /* why writing to fd failed */
+    GError      *error;
+
+    unzboot_progress_fn progress;
+    gpointer    progress_data;
+    GMutex      lock;
+    guint64     done;
+    guint64     total;
+    /* a progress source is attached and has not run yet */
+    gboolean    progress_pending;
+};
+
+static void extract_job_free(gpointer data)
+{
+    struct extract_job *job = data;
+
+    g_free(job->path);
+    if (job->bytes) {
+        g_byte_array_free(job->bytes, TRUE);
+    }
+    g_clear_error(&job->error);
+    g_mutex_clear(&job->lock);
+    g_free(job);
+}
+
+/*
+ * The decoders of a worker thread, kept for the next images it extracts,
+ * and freed with the thread.
+ */
+static GPrivate worker_unzboot = G_PRIVATE_INIT((GDestroyNotify)unzboot_free);
+
+static unzboot *worker_context(void)
+{
+    unzboot *u = g_private_get(&worker_unzboot);
+
+    if (!u) {
+        u = unzboot_new();
+        g_private_set(&worker_unzboot, u);
+    }
+    return u;
+}
+
+static gboolean progress_dispatch(gpointer data)
+{
+    GTask *task = data;
+    struct extract_job *job = g_task_get_task_data(task);
+    guint64 done, total;
+
+    g_mutex_lock(&job->lock);
+    done = job->done;
+    total = job->total;
+    job->progress_pending = FALSE;
+    g_mutex_unlock(&job->lock);
+
+    if (!g_task_get_completed(task)) {
+        job->progress(done, total, job->progress_data);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Count len more bytes done, and let the main context know unless it has
+ * yet to hear about the previous ones: it then reads the count of both.
+ */
+static void report_progress(struct extract_job *job, size_t len)
+{
+    gboolean post;
+    GSource *source;
+
+    g_mutex_lock(&job->lock);
+    job->done += len;
+    post = job->progress && !job->progress_pending;
+    if (post) {
+        job->progress_pending = TRUE;
+    }
+    g_mutex_unlock(&job->lock);
+
+    if (post) {
+        source = g_idle_source_new();
+        g_source_set_callback(source, progress_dispatch,
+                              g_object_ref(job->task), g_object_unref);
+        g_source_attach(source, g_task_get_context(job->task));
+        g_source_unref(source);
+    }
+}
+
+static int write_fd(struct extract_job *job, const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(job->fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            g_set_error(&job->error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "%s: unable to write the kernel: %s", job->path,
+                        g_strerror(errno));
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int extract_write(void *opaque, const void *buf, size_t len)
+{
+    struct extract_job *job = opaque;
+
+    /* a cancelled extraction stops at its next chunk */
+    if (g_cancellable_is_cancelled(g_task_get_cancellable(job->task))) {
+        return -1;
+    }
+    if (job->fd < 0) {
+        g_byte_array_append(job->bytes, buf, len);
+    } else if (write_fd(job, buf, len) < 0) {
+        return -1;
+    }
+    job->written += len;
+    report_progress(job, len);
+    return 0;
+}
+
+static void extract_thread(GTask *task, gpointer source_object,
+                           gpointer task_data, GCancellable *cancellable)
+{
+    struct extract_job *job = task_data;
+    unzboot *u = worker_context();
+    struct unzboot_info info;
+    int ret;
+
+    (void)source_object;
+    if (g_task_return_error_if_cancelled(task)) {
+        return;
+    }
+
+    unzboot_set_recursive(u, job->flags & UNZBOOT_EXTRACT_RECURSIVE, 0);
+    ret = unzboot_open_file(u, job->path);
+    if (ret == UNZBOOT_OK && unzboot_inspect(u, &info) == UNZBOOT_OK) {
+        job->total = info.kernel_size;
+    }
+    if (job->fd < 0) {
+        job->bytes = g_byte_array_sized_new(job->total <= G_MAXUINT ?
+                                            job->total : 0);
+    }
+    if (ret == UNZBOOT_OK) {
+        ret = unzboot_extract_to_callback(u, extract_write, job);
+    }
+
+    if (g_cancellable_is_cancelled(cancellable)) {
+        g_task_return_error_if_cancelled(task);
+    } else if (job->error) {
+        g_task_return_error(task, g_steal_pointer(&job->error));
+    } else if (ret != UNZBOOT_OK) {
+        g_task_return_new_error(task, UNZBOOT_ERROR, ret, "%s",
+                                unzboot_error_message(u));
+    } else if (job->fd < 0) {
+        g_task_return_pointer(task, g_byte_array_free_to_bytes(job->bytes),
+                              (GDestroyNotify)g_bytes_unref);
+        job->bytes = NULL;
+    } else {
+        g_task_return_int(task, job->written);
+    }
+    unzboot_close(u);
+}
+
+static void extract_async(const char *path, int fd,
+                          enum unzboot_extract_flags flags,
+                          GCancellable *cancellable,
+                          unzboot_progress_fn progress,
+                          gpointer progress_data,
+                          GAsyncReadyCallback callback, gpointer user_data)
+{
+    struct extract_job *job = g_new0(struct extract_job, 1);
+    GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+
+    job->task = task;
+    job->path = g_strdup(path);
+    job->flags = flags;
+    job->fd = fd;
+    job->progress = progress;
+    job->progress_data = progress_data;
+    g_mutex_init(&job->lock);
+
+    g_task_set_task_data(task, job, extract_job_free);
+    g_task_run_in_thread(task, extract_thread);
+    g_object_unref(task);
+}
+
+void unzboot_extract_bytes_async(const char *path,
+                                 enum unzboot_extract_flags flags,
+                                 GCancellable *cancellable,
+                                 unzboot_progress_fn progress,
+                                 gpointer progress_data,
+                                 GAsyncReadyCallback callback,
+                                 gpointer user_data)
+{
+    g_return_if_fail(path != NULL);
+
+    extract_async(path, -1, flags, cancellable, progress, progress_data,
+                  callback, user_data);
+}
+
+GBytes *unzboot_extract_bytes_finish(GAsyncResult *result, GError **error)
+{
+    g_return_val_if_fail(g_task_is_valid(result, NULL), NULL);
+
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+void unzboot_extract_fd_async(const char *path, int fd,
+                              enum unzboot_extract_flags flags,
+                              GCancellable *cancellable,
+                              unzboot_progress_fn progress,
+                              gpointer progress_data,
+                              GAsyncReadyCallback callback,
+                              gpointer user_data)
+{
+    g_return_if_fail(path != NULL);
+    g_return_if_fail(fd >= 0);
+
+    extract_async(path, fd, flags, cancellable, progress, progress_data,
+                  callback, user_data);
+}
+
+gssize unzboot_extract_fd_finish(GAsyncResult *result, GError **error)
+{
+    g_return_val_if_fail(g_task_is_valid(result, NULL), -1);
+
+    return g_task_propagate_int(G_TASK(result), error);
+}
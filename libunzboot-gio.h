@@ -0,0 +1,80 @@
+/*
+ * libunzboot-gio: extract kernel images asynchronously, the GIO way
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef LIBUNZBOOT_GIO_H
+#define LIBUNZBOOT_GIO_H
+
+#include <gio/gio.h>
+
+#include "libunzboot.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Errors of the asynchronous calls, with an unzboot_status as code, other
+ * than G_IO_ERROR_CANCELLED when they are cancelled
+ */
+#define UNZBOOT_ERROR unzboot_error_quark()
+
+UNZBOOT_API GQuark unzboot_error_quark(void);
+
+enum unzboot_extract_flags {
+    UNZBOOT_EXTRACT_NONE = 0,
+    /* keep unpacking nested formats, as unzboot_set_recursive() does */
+    UNZBOOT_EXTRACT_RECURSIVE = 1 << 0,
+};
+
+/*
+ * How much of the kernel has been extracted so far. total is its size if
+ * known beforehand, as with gzip, 0 otherwise.
+ */
+typedef void (*unzboot_progress_fn)(guint64 done, guint64 total,
+                                    gpointer user_data);
+
+/*
+ * Extract the kernel of the image at path into memory, on a thread of the
+ * GIO worker pool, so as not to block the calling thread. Each worker keeps
+ * its own decoders from one image to the next.
+ *
+ * progress, if not NULL, and callback are called in the thread-default main
+ * context of the caller. progress gets the latest count whenever the main
+ * context gets to it, however fast the kernel is extracted, and is never
+ * called after callback, so progress_data only needs to live until then.
+ */
+UNZBOOT_API void unzboot_extract_bytes_async(const char *path,
+                                             enum unzboot_extract_flags flags,
+                                             GCancellable *cancellable,
+                                             unzboot_progress_fn progress,
+                                             gpointer progress_data,
+                                             GAsyncReadyCallback callback,
+                                             gpointer user_data);
+
+/* The kernel, or NULL with error set */
+UNZBOOT_API GBytes *unzboot_extract_bytes_finish(GAsyncResult *result,
+                                                 GError **error);
+
+/*
+ * The same, writing the kernel to fd, which is left open, from its current
+ * offset. It can be a pipe or a socket. If the extraction fails, whatever
+ * was written so far is left in it.
+ */
+UNZBOOT_API void unzboot_extract_fd_async(const char *path, int fd,
+                                          enum unzboot_extract_flags flags,
+                                          GCancellable *cancellable,
+                                          unzboot_progress_fn progress,
+                                          gpointer progress_data,
+                                          GAsyncReadyCallback callback,
+                                          gpointer user_data);
+
+/* The size of the kernel written, or -1 with error set */
+UNZBOOT_API gssize unzboot_extract_fd_finish(GAsyncResult *result,
+                                             GError **error);
+
+G_END_DECLS
+
+#endif /* LIBUNZBOOT_GIO_H */
@@ -0,0 +1,892 @@
+/*
+ * libunzboot: extract the kernel image of Linux EFI zboot images
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libunzboot.h"
+#include "pe.h"
+#include "unzboot.h"
+
+/* What is read of the kernel header, up to and including its magic */
+#define KERNEL_HEADER_SIZE      64
+
+/* Offset of the image size in ARM64 and RISC-V kernel headers */
+#define KERNEL_IMAGE_SIZE_OFFSET    16
+
+/* What is unpacked of the image by each unzboot_stream_next() call */
+#define STREAM_SLICE_SIZE       (64 << 10)
+
+/* What is gathered of the kernel before filling in pages of its mapping */
+#define MAP_STAGE_SIZE          (256 << 10)
+
+/* Faults in user space only, which needs no privileges, since Linux 5.11 */
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY     1
+#endif
+
+/*
+ * Gather what a slice of the image decodes to, for unzboot_stream_next().
+ */
+struct stream_sink {
+    struct sink sink;
+    const struct unpack_allocator *alloc;
+    /* kept from one stream to the next */
+    struct unpack_buf buf;
+};
+
+/*
+ * Fill in the mapping of unzboot_map_begin() from a thread, as the kernel is
+ * decoded. With userfaultfd, whole pages are put in place with UFFDIO_COPY,
+ * which wakes up whoever faulted on them.
+ */
+struct map_sink {
+    struct sink sink;
+    struct unpack_ctx ctx;
+    uint8_t     *addr;
+    /* of the kernel, and of the mapping in whole pages */
+    size_t      size;
+    size_t      len;
+    size_t      page_size;
+    /* the userfaultfd the mapping is registered with, or -1 */
+    int         uffd;
+    /* of the kernel filled in so far */
+    size_t      offset;
+    /* page aligned, what is decoded but not filled in yet */
+    uint8_t     *stage;
+    size_t      staged;
+    GThread     *thread;
+    /* set by unzboot_map_end() to abort the decode */
+    gint        stop;
+    gboolean    failed;
+};
+
+struct unzboot {
+    gboolean    recursive;
+    int         max_depth;
+    /* for error messages, the file name or "image" */
+    char        *name;
+    GMappedFile *mapped;
+    const uint8_t *image;
+    /* the .linux section of a UKI, or the whole image */
+    const uint8_t *kernel;
+    size_t      kernel_len;
+    gboolean    uki;
+    char        *error;
+    /* NULL for GLib's, or &allocator */
+    const struct unpack_allocator *alloc;
+    struct unpack_allocator allocator;
+    /* decoders kept from one extraction to the next */
+    struct decoder_cache *cache;
+
+    /* the kernel being streamed, from stream_offset in it */
+    gboolean    streaming;
+    struct unpack_ctx stream_ctx;
+    struct sink *stream_head;
+    size_t      stream_offset;
+    int         stream_status;
+    struct stream_sink stream;
+
+    /* the kernel being mapped */
+    gboolean    mapping;
+    struct map_sink map;
+};
+
+static void set_error(unzboot *u, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+static void set_error(unzboot *u, const char *format, ...)
+{
+    va_list ap;
+
+    g_free(u->error);
+    va_start(ap, format);
+    u->error = g_strdup_vprintf(format, ap);
+    va_end(ap);
+}
+
+unzboot *unzboot_new(void)
+{
+    unzboot *u = g_new0(unzboot, 1);
+
+    u->max_depth = UNPACK_DEFAULT_MAX_DEPTH;
+    u->cache = decoder_cache_new(NULL);
+    return u;
+}
+
+void unzboot_free(unzboot *u)
+{
+    if (!u) {
+        return;
+    }
+    unzboot_close(u);
+    decoder_cache_free(u->cache);
+    unpack_buf_clear(u->alloc, &u->stream.buf);
+    g_free(u->error);
+    g_free(u);
+}
+
+void unzboot_set_recursive(unzboot *u, int recursive, int max_depth)
+{
+    u->recursive = recursive;
+    u->max_depth = max_depth > 0 ? max_depth : UNPACK_DEFAULT_MAX_DEPTH;
+}
+
+void unzboot_set_allocator(unzboot *u,
+                           const struct unzboot_allocator *allocator)
+{
+    /* nothing may be left that the previous allocator has to free */
+    unzboot_stream_end(u);
+    unzboot_map_end(u);
+    unpack_buf_clear(u->alloc, &u->stream.buf);
+    decoder_cache_free(u->cache);
+
+    if (allocator) {
+        u->allocator = (struct unpack_allocator) {
+            .alloc = allocator->alloc,
+            .free = allocator->free,
+            .opaque = allocator->opaque,
+        };
+        u->alloc = &u->allocator;
+    } else {
+        u->alloc = NULL;
+    }
+    u->cache = decoder_cache_new(u->alloc);
+}
+
+void unzboot_close(unzboot *u)
+{
+    unzboot_stream_end(u);
+    unzboot_map_end(u);
+    if (u->mapped) {
+        g_mapped_file_unref(u->mapped);
+    }
+    g_free(u->name);
+    u->mapped = NULL;
+    u->name = NULL;
+    u->image = u->kernel = NULL;
+    u->kernel_len = 0;
+    u->uki = FALSE;
+}
+
+/* Look for the kernel in the image just opened */
+static int unzboot_open_image(unzboot *u, const uint8_t *image, size_t size)
+{
+    const struct pe_section *linux_section;
+    struct pe_section *sections;
+    int count;
+
+    u->image = u->kernel = image;
+    u->kernel_len = size;
+
+    /* zboot images are PE/COFF images too, but without a .linux section */
+    count = pe_parse_sections(image, size, &sections);
+    if (count < 0) {
+        return UNZBOOT_OK;
+    }
+    linux_section = pe_find_section(sections, count, ".linux");
+    if (linux_section) {
+        u->kernel = linux_section->data;
+        u->kernel_len = linux_section->size;
+        u->uki = TRUE;
+    }
+    g_free(sections);
+    return UNZBOOT_OK;
+}
+
+int unzboot_open_memory(unzboot *u, const void *image, size_t size)
+{
+    unzboot_close(u);
+    if (!image && size) {
+        set_error(u, "no image given");
+        return UNZBOOT_ERROR_INVALID;
+    }
+    u->name = g_strdup("image");
+    return unzboot_open_image(u, image, size);
+}
+
+static int unzboot_open_mapped(unzboot *u, GMappedFile *mapped)
+{
+    u->mapped = mapped;
+    return unzboot_open_image(u,
+                              (const uint8_t *)g_mapped_file_get_contents(mapped),
+                              g_mapped_file_get_length(mapped));
+}
+
+int unzboot_open_file(unzboot *u, const char *path)
+{
+    GMappedFile *mapped;
+    GError *error = NULL;
+
+    unzboot_close(u);
+    mapped = g_mapped_file_new(path, FALSE, &error);
+    if (!mapped) {
+        set_error(u, "%s", error->message);
+        g_error_free(error);
+        return UNZBOOT_ERROR_IO;
+    }
+    u->name = g_strdup(path);
+    return unzboot_open_mapped(u, mapped);
+}
+
+int unzboot_open_fd(unzboot *u, int fd)
+{
+    GMappedFile *mapped;
+    GError *error = NULL;
+
+    unzboot_close(u);
+    mapped = g_mapped_file_new_from_fd(fd, FALSE, &error);
+    if (!mapped) {
+        set_error(u, "%s", error->message);
+        g_error_free(error);
+        return UNZBOOT_ERROR_IO;
+    }
+    u->name = g_strdup_printf("fd %d", fd);
+    return unzboot_open_mapped(u, mapped);
+}
+
+static void unzboot_ctx_init(unzboot *u, struct unpack_ctx *ctx)
+{
+    unpack_ctx_init(ctx, "libunzboot", u->name);
+    ctx->recursive = u->recursive;
+    ctx->max_depth = u->max_depth;
+    ctx->quiet = TRUE;
+    ctx->cache = u->cache;
+    ctx->alloc = u->alloc;
+}
+
+static int status_from_error(const GError *error)
+{
+    if (!error || error->domain != UNPACK_ERROR) {
+        return UNZBOOT_ERROR_FAILED;
+    }
+    switch (error->code) {
+    case UNPACK_ERROR_CORRUPT:
+        return UNZBOOT_ERROR_CORRUPT;
+    case UNPACK_ERROR_UNSUPPORTED:
+        return UNZBOOT_ERROR_UNSUPPORTED;
+    case UNPACK_ERROR_NOT_FOUND:
+        return UNZBOOT_ERROR_NOT_FOUND;
+    case UNPACK_ERROR_IO:
+        return UNZBOOT_ERROR_IO;
+    default:
+        return UNZBOOT_ERROR_FAILED;
+    }
+}
+
+/* Keep the message of what went wrong with ctx and return its status */
+static int unzboot_fail(unzboot *u, const struct unpack_ctx *ctx,
+                        const char *what)
+{
+    set_error(u, "%s", ctx->error ? ctx->error->message : what);
+    return status_from_error(ctx->error);
+}
+
+/* Unpack the kernel to out and turn the outcome into a status */
+static int unzboot_run(unzboot *u, struct unpack_ctx *ctx, struct sink *out)
+{
+    if (!out) {
+        /* sinks that can not be created have reported why */
+        return unzboot_fail(u, ctx, "no output");
+    }
+    if (unpack_image(ctx, u->kernel, u->kernel_len, out, TRUE) < 0) {
+        return unzboot_fail(u, ctx, "cannot unpack the image");
+    }
+    return UNZBOOT_OK;
+}
+
+static gboolean unzboot_check_open(unzboot *u)
+{
+    if (!u->image) {
+        set_error(u, "no image open");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Collect the header of the kernel, then stop the pipeline.
+ */
+struct header_sink {
+    struct sink sink;
+    uint8_t     buf[KERNEL_HEADER_SIZE];
+    size_t      len;
+};
+
+static int header_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct header_sink *h = (struct header_sink *)sink;
+    size_t n = MIN(len, KERNEL_HEADER_SIZE - h->len);
+
+    memcpy(h->buf + h->len, buf, n);
+    h->len += n;
+    return h->len == KERNEL_HEADER_SIZE ? -1 : 0;
+}
+
+static int header_finish(struct sink *sink)
+{
+    (void)sink;
+    return 0;
+}
+
+static void header_abort(struct sink *sink)
+{
+    (void)sink;
+}
+
+static uint64_t le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+int unzboot_inspect(unzboot *u, struct unzboot_info *info)
+{
+    struct header_sink h = {
+        .sink = { header_write, header_finish, header_abort },
+    };
+    const struct linux_efi_zboot_header *zboot;
+    const struct codec *codec = NULL;
+    struct unpack_ctx ctx;
+    guint i;
+
+    if (!info || !unzboot_check_open(u)) {
+        return UNZBOOT_ERROR_INVALID;
+    }
+    memset(info, 0, sizeof(*info));
+
+    unzboot_ctx_init(u, &ctx);
+    /* a whole header stops the pipeline, on purpose */
+    if (unpack_image(&ctx, u->kernel, u->kernel_len, &h.sink, TRUE) < 0 &&
+        h.len < KERNEL_HEADER_SIZE) {
+        int ret = status_from_error(ctx.error);
+
+        set_error(u, "%s", ctx.error ? ctx.error->message :
+                           "cannot unpack the image");
+        unpack_ctx_clear(&ctx);
+        return ret;
+    }
+
+    for (i = 0; i < ctx.layers->len; i++) {
+        const struct unpack_layer *l;
+
+        l = &g_array_index(ctx.layers, struct unpack_layer, i);
+        if (!info->container) {
+            info->container = l->format;
+        }
+        if (!codec && l->codec) {
+            codec = l->codec;
+            info->compression = codec->name;
+        }
+        /* the innermost layer is the kernel */
+        info->arch = l->format;
+    }
+    if (info->container && (strcmp(info->container, "arm64") == 0 ||
+                            strcmp(info->container, "riscv") == 0)) {
+        info->container = "kernel";
+        info->kernel_size = u->kernel_len;
+    }
+    if (u->uki) {
+        info->container = "uki";
+    }
+
+    zboot = (const struct linux_efi_zboot_header *)u->kernel;
+    if (ctx.layers->len > 0 &&
+        strcmp(g_array_index(ctx.layers, struct unpack_layer, 0).format,
+               "zboot") == 0) {
+        int64_t n = unpack_zboot_kernel_size(u->kernel, u->kernel_len);
+
+        info->payload_offset = GUINT32_FROM_LE(zboot->payload_offset);
+        info->payload_size = GUINT32_FROM_LE(zboot->payload_size);
+        if (n >= 0) {
+            info->kernel_size = n;
+        }
+    }
+    if (h.len >= KERNEL_IMAGE_SIZE_OFFSET + 8) {
+        info->image_size = le64(h.buf + KERNEL_IMAGE_SIZE_OFFSET);
+    }
+
+    unpack_ctx_clear(&ctx);
+    return UNZBOOT_OK;
+}
+
+/*
+ * Copy the output to the caller's buffer, counting what does not fit.
+ */
+struct buffer_sink {
+    struct sink sink;
+    uint8_t     *buf;
+    size_t      size;
+    size_t      len;
+};
+
+static int buffer_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct buffer_sink *b = (struct buffer_sink *)sink;
+
+    if (b->len < b->size) {
+        memcpy(b->buf + b->len, buf, MIN(len, b->size - b->len));
+    }
+    b->len += len;
+    return 0;
+}
+
+int unzboot_extract_to_buffer(unzboot *u, void *buf, size_t size, size_t *len)
+{
+    struct buffer_sink b = {
+        .sink = { buffer_write, header_finish, header_abort },
+        .buf = buf,
+        .size = buf ? size : 0,
+    };
+    struct unpack_ctx ctx;
+    ssize_t n = -1;
+    int ret = UNZBOOT_OK;
+
+    if (!len || !unzboot_check_open(u)) {
+        return UNZBOOT_ERROR_INVALID;
+    }
+    unzboot_ctx_init(u, &ctx);
+    if (buf) {
+        n = unpack_zboot_to_buffer(&ctx, u->kernel, u->kernel_len, buf, size);
+    }
+    if (n >= 0) {
+        b.len = n;
+    } else {
+        ret = unzboot_run(u, &ctx, &b.sink);
+    }
+    unpack_ctx_clear(&ctx);
+
+    *len = b.len;
+    if (ret == UNZBOOT_OK && b.len > b.size) {
+        set_error(u, "%s: the kernel takes %zu bytes, %zu more than given",
+                  u->name, b.len, b.len - b.size);
+        ret = UNZBOOT_ERROR_NO_SPACE;
+    }
+    return ret;
+}
+
+/*
+ * Hand the output over to the caller's callback.
+ */
+struct callback_sink {
+    struct sink sink;
+    unzboot_write_fn write;
+    void        *opaque;
+    gboolean    failed;
+};
+
+static int callback_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct callback_sink *c = (struct callback_sink *)sink;
+
+    if (c->write(c->opaque, buf, len) != 0) {
+        c->failed = TRUE;
+        return -1;
+    }
+    return 0;
+}
+
+int unzboot_extract_to_callback(unzboot *u, unzboot_write_fn write,
+                                void *opaque)
+{
+    struct callback_sink c = {
+        .sink = { callback_write, header_finish, header_abort },
+        .write = write,
+        .opaque = opaque,
+    };
+    struct unpack_ctx ctx;
+    int ret;
+
+    if (!write || !unzboot_check_open(u)) {
+        return UNZBOOT_ERROR_INVALID;
+    }
+    unzboot_ctx_init(u, &ctx);
+    ret = unzboot_run(u, &ctx, &c.sink);
+    unpack_ctx_clear(&ctx);
+
+    if (c.failed) {
+        set_error(u, "%s: the write callback failed", u->name);
+        ret = UNZBOOT_ERROR_CALLBACK;
+    }
+    return ret;
+}
+
+int unzboot_extract_to_file(unzboot *u, const char *path)
+{
+    struct unpack_ctx ctx;
+    int ret;
+
+    if (!path || !unzboot_check_open(u)) {
+        return UNZBOOT_ERROR_INVALID;
+    }
+    unzboot_ctx_init(u, &ctx);
+    ret = unzboot_run(u, &ctx, file_sink_new(&ctx, path));
+    unpack_ctx_clear(&ctx);
+    return ret;
+}
+
+static int stream_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct stream_sink *s = (struct stream_sink *)sink;
+
+    unpack_buf_append(s->alloc, &s->buf, buf, len);
+    return 0;
+}
+
+int unzboot_stream_begin(unzboot *u)
+{
+    if (!unzboot_check_open(u)) {
+        return UNZBOOT_ERROR_INVALID;
+    }
+    unzboot_stream_end(u);
+
+    u->stream.sink = (struct sink) {
+        .write = stream_write,
+        .finish = header_finish,
+        .abort = header_abort,
+    };
+    u->stream.alloc = u->alloc;
+    unzboot_ctx_init(u, &u->stream_ctx);
+    u->streaming = TRUE;
+    u->stream_status = UNZBOOT_OK;
+    u->stream_head = unpack_image_new(&u->stream_ctx, u->kernel, u->kernel_len,
+                                      &u->stream.sink, TRUE, &u->stream_offset);
+    if (!u->stream_head) {
+        u->stream_status = unzboot_fail(u, &u->stream_ctx,
+                                        "cannot unpack the image");
+    }
+    return u->stream_status;
+}
+
+int unzboot_stream_next(unzboot *u, const void **chunk, size_t *len)
+{
+    struct sink *head = u->stream_head;
+    size_t n;
+
+    if (!u->streaming || !chunk || !len) {
+        set_error(u, "no kernel is being streamed");
+        return UNZBOOT_ERROR_INVALID;
+    }
+    u->stream.buf.len = 0;
+
+    /* slices of the image can decode to nothing, while headers are read */
+    while (u->stream.buf.len == 0 && head) {
+        n = MIN(u->kernel_len - u->stream_offset, STREAM_SLICE_SIZE);
+        if (n == 0) {
+            u->stream_head = NULL;
+            if (head->finish(head) < 0) {
+                u->stream_status = unzboot_fail(u, &u->stream_ctx,
+                                                "cannot unpack the image");
+            }
+        } else if (head->write(head, u->kernel + u->stream_offset, n) < 0) {
+            u->stream_head = NULL;
+            head->abort(head);
+            u->stream_status = unzboot_fail(u, &u->stream_ctx,
+                                            "cannot unpack the image");
+        }
+        u->stream_offset += n;
+        head = u->stream_head;
+    }
+    if (u->stream_status < 0) {
+        return u->stream_status;
+    }
+    *chunk = u->stream.buf.data;
+    *len = u->stream.buf.len;
+    return *len > 0;
+}
+
+void unzboot_stream_end(unzboot *u)
+{
+    if (!u->streaming) {
+        return;
+    }
+    if (u->stream_head) {
+        u->stream_head->abort(u->stream_head);
+        u->stream_head = NULL;
+    }
+    unpack_ctx_clear(&u->stream_ctx);
+    u->streaming = FALSE;
+}
+
+static int map_fill(struct map_sink *m, const uint8_t *buf, size_t len)
+{
+    struct uffdio_copy copy;
+    size_t done = 0;
+
+    while (done < len) {
+        copy = (struct uffdio_copy) {
+            .dst = (uintptr_t)(m->addr + m->offset + done),
+            .src = (uintptr_t)(buf + done),
+            .len = len - done,
+        };
+        /* EAGAIN is a partial copy, when the mapping is being changed */
+        if (ioctl(m->uffd, UFFDIO_COPY, &copy) < 0 && errno != EAGAIN) {
+            unpack_error(&m->ctx, UNPACK_ERROR_IO, "%s: cannot fill in the "
+                         "mapping of the kernel: %s", m->ctx.input_file,
+                         strerror(errno));
+            return -1;
+        }
+        if (copy.copy > 0) {
+            done += copy.copy;
+        }
+    }
+    m->offset += len;
+    return 0;
+}
+
+static int map_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct map_sink *m = (struct map_sink *)sink;
+    size_t n, whole;
+
+    if (g_atomic_int_get(&m->stop)) {
+        return -1;
+    }
+    if (len > m->size - m->offset - m->staged) {
+        unpack_error(&m->ctx, UNPACK_ERROR_CORRUPT, "%s: the kernel is "
+                     "larger than its compressed stream says",
+                     m->ctx.input_file);
+        return -1;
+    }
+    if (m->uffd < 0) {
+        memcpy(m->addr + m->offset, buf, len);
+        m->offset += len;
+        return 0;
+    }
+
+    while (len > 0) {
+        n = MIN(len, MAP_STAGE_SIZE - m->staged);
+        memcpy(m->stage + m->staged, buf, n);
+        m->staged += n;
+        buf += n;
+        len -= n;
+
+        whole = m->staged & ~(m->page_size - 1);
+        if (whole > 0) {
+            if (map_fill(m, m->stage, whole) < 0) {
+                return -1;
+            }
+            m->staged -= whole;
+            memmove(m->stage, m->stage + whole, m->staged);
+        }
+    }
+    return 0;
+}
+
+static int map_finish(struct sink *sink)
+{
+    struct map_sink *m = (struct map_sink *)sink;
+
+    if (m->offset + m->staged != m->size) {
+        unpack_error(&m->ctx, UNPACK_ERROR_CORRUPT, "%s: the kernel is "
+                     "smaller than its compressed stream says",
+                     m->ctx.input_file);
+        return -1;
+    }
+    if (m->uffd < 0 || m->staged == 0) {
+        return 0;
+    }
+    /* the end of the last page */
+    memset(m->stage + m->staged, 0, m->page_size - m->staged);
+    return map_fill(m, m->stage, m->page_size);
+}
+
+static gpointer map_thread(gpointer data)
+{
+    unzboot *u = data;
+    struct map_sink *m = &u->map;
+    struct uffdio_range rest;
+
+    if (unpack_image(&m->ctx, u->kernel, u->kernel_len, &m->sink, TRUE) < 0) {
+        m->failed = TRUE;
+    }
+    if (m->uffd < 0) {
+        mprotect(m->addr, m->len, PROT_READ);
+        return NULL;
+    }
+
+    /*
+     * What could not be decoded reads as zeros, rather than leaving whoever
+     * faults on it waiting forever. Closing the userfaultfd then turns the
+     * mapping into a plain one.
+     */
+    if (m->offset < m->len) {
+        struct uffdio_zeropage zero = {
+            .range = {
+                .start = (uintptr_t)(m->addr + m->offset),
+                .len = m->len - m->offset,
+            },
+        };
+
+        rest = zero.range;
+        while (ioctl(m->uffd, UFFDIO_ZEROPAGE, &zero) < 0 &&
+               errno == EAGAIN) {
+            if (zero.zeropage > 0) {
+                rest.start += zero.zeropage;
+                rest.len -= zero.zeropage;
+            }
+            zero.range = rest;
+        }
+    }
+    close(m->uffd);
+    m->uffd = -1;
+    return NULL;
+}
+
+int unzboot_map_begin(unzboot *u, const void **addr, size_t *len)
+{
+    struct map_sink *m = &u->map;
+    struct uffdio_api api = { .api = UFFD_API };
+    struct uffdio_register reg;
+    struct unzboot_info info;
+    int ret;
+
+    if (!addr || !len || !unzboot_check_open(u)) {
+        return UNZBOOT_ERROR_INVALID;
+    }
+    unzboot_stream_end(u);
+    unzboot_map_end(u);
+
+    ret = unzboot_inspect(u, &info);
+    if (ret < 0) {
+        return ret;
+    }
+    if (info.kernel_size == 0) {
+        set_error(u, "%s: the size of the kernel is not known before "
+                  "extracting it", u->name);
+        return UNZBOOT_ERROR_UNSUPPORTED;
+    }
+
+    memset(m, 0, sizeof(*m));
+    m->page_size = sysconf(_SC_PAGESIZE);
+    m->size = info.kernel_size;
+    m->len = (m->size + m->page_size - 1) & ~(m->page_size - 1);
+    m->addr = mmap(NULL, m->len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m->addr == MAP_FAILED) {
+        set_error(u, "%s: cannot map %zu bytes for the kernel: %s", u->name,
+                  m->size, strerror(errno));
+        return UNZBOOT_ERROR_FAILED;
+    }
+
+    /* without userfaultfd, the whole kernel is there before returning */
+    m->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+    reg = (struct uffdio_register) {
+        .range = { .start = (uintptr_t)m->addr, .len = m->len },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (m->uffd >= 0 && ioctl(m->uffd, UFFDIO_API, &api) == 0 &&
+        ioctl(m->uffd, UFFDIO_REGISTER, &reg) == 0) {
+        m->stage = mmap(NULL, MAP_STAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (m->uffd >= 0 && (!m->stage || m->stage == MAP_FAILED)) {
+        close(m->uffd);
+        m->uffd = -1;
+        m->stage = NULL;
+    }
+    if (m->uffd >= 0) {
+        mprotect(m->addr, m->len, PROT_READ);
+    }
+
+    m->sink = (struct sink) {
+        .write = map_write,
+        .finish = map_finish,
+        .abort = header_abort,
+    };
+    unzboot_ctx_init(u, &m->ctx);
+    u->mapping = TRUE;
+    if (m->uffd >= 0) {
+        m->thread = g_thread_new("unzboot-map", map_thread, u);
+    } else {
+        map_thread(u);
+    }
+
+    *addr = m->addr;
+    *len = m->size;
+    return UNZBOOT_OK;
+}
+
+int unzboot_map_wait(unzboot *u)
+{
+    struct map_sink *m = &u->map;
+
+    if (!u->mapping) {
+        set_error(u, "no kernel is mapped");
+        return UNZBOOT_ERROR_INVALID;
+    }
+    if (m->thread) {
+        g_thread_join(m->thread);
+        m->thread = NULL;
+    }
+    if (m->failed) {
+        return unzboot_fail(u, &m->ctx, "cannot unpack the image");
+    }
+    return UNZBOOT_OK;
+}
+
+void unzboot_map_end(unzboot *u)
+{
+    struct map_sink *m = &u->map;
+
+    if (!u->mapping) {
+        return;
+    }
+    g_atomic_int_set(&m->stop, 1);
+    if (m->thread) {
+        g_thread_join(m->thread);
+        m->thread = NULL;
+    }
+    munmap(m->addr, m->len);
+    if (m->stage) {
+        munmap(m->stage, MAP_STAGE_SIZE);
+    }
+    unpack_ctx_clear(&m->ctx);
+    u->mapping = FALSE;
+}
+
+const char *unzboot_error_message(const unzboot *u)
+{
+    return u->error ? u->error : "";
+}
+
+const char *unzboot_strerror(int status)
+{
+    switch (status) {
+    case UNZBOOT_OK:
+        return "Success";
+    case UNZBOOT_ERROR_INVALID:
+        return "Invalid argument";
+    case UNZBOOT_ERROR_IO:
+        return "Input/output error";
+    case UNZBOOT_ERROR_CORRUPT:
+        return "Corrupt image";
+    case UNZBOOT_ERROR_UNSUPPORTED:
+        return "Unsupported format";
+    case UNZBOOT_ERROR_NOT_FOUND:
+        return "No kernel image found";
+    case UNZBOOT_ERROR_NO_SPACE:
+        return "Buffer too small";
+    case UNZBOOT_ERROR_CALLBACK:
+        return "Write callback failed";
+    default:
+        return "Failed";
+    }
+}
@@ -0,0 +1,194 @@
+/*
+ * libunzboot: extract the kernel image of Linux EFI zboot images
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef LIBUNZBOOT_H
+#define LIBUNZBOOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UNZBOOT_API __attribute__((visibility("default")))
+
+/*
+ * Every function that can fail returns UNZBOOT_OK or one of these negative
+ * codes, unzboot_error_message() tells more about the last one.
+ */
+enum unzboot_status {
+    UNZBOOT_OK = 0,
+    UNZBOOT_ERROR_FAILED = -1,
+    /* a bad argument, or no image open */
+    UNZBOOT_ERROR_INVALID = -2,
+    UNZBOOT_ERROR_IO = -3,
+    UNZBOOT_ERROR_CORRUPT = -4,
+    /* a format or compression whose support is not built in */
+    UNZBOOT_ERROR_UNSUPPORTED = -5,
+    /* no kernel image in the input */
+    UNZBOOT_ERROR_NOT_FOUND = -6,
+    /* the kernel does not fit the buffer given */
+    UNZBOOT_ERROR_NO_SPACE = -7,
+    /* the write callback failed */
+    UNZBOOT_ERROR_CALLBACK = -8,
+};
+
+/*
+ * A context, with the image open in it and the options to extract it. The
+ * decoders of an extraction are kept in the context for the next ones, so
+ * a context can be reused for many images for next to no setup cost.
+ *
+ * Contexts share no state: each one can be used from a different thread at
+ * the same time, but a context from a single thread at a time. Nothing is
+ * printed, errors are only returned.
+ */
+typedef struct unzboot unzboot;
+
+UNZBOOT_API unzboot *unzboot_new(void);
+UNZBOOT_API void unzboot_free(unzboot *u);
+
+/*
+ * Keep unpacking nested formats, like an Image.gz in a tar archive, until
+ * a kernel image is found, at most max_depth of them. Off by default.
+ */
+UNZBOOT_API void unzboot_set_recursive(unzboot *u, int recursive,
+                                       int max_depth);
+
+/*
+ * Where the memory of extractions comes from: decoders, what the libraries
+ * behind them allocate and output chunks. alloc() returns size bytes aligned
+ * to align; the process is aborted if it returns NULL. free() is given back
+ * every block with the size and alignment it was asked for, an arena that is
+ * only released all at once can leave it empty.
+ *
+ * The allocator is copied, opaque must outlive the context or the next call.
+ * NULL goes back to GLib's. The decoders kept in the context are freed with
+ * the allocator they came from.
+ */
+struct unzboot_allocator {
+    void    *(*alloc)(void *opaque, size_t size, size_t align);
+    void    (*free)(void *opaque, void *ptr, size_t size, size_t align);
+    void    *opaque;
+};
+
+UNZBOOT_API void unzboot_set_allocator(unzboot *u,
+                                       const struct unzboot_allocator *allocator);
+
+/*
+ * Open the image to extract, closing the one open before. An image in
+ * memory is not copied, it must be left alone until it is closed. Files are
+ * mapped. The kernel of a Unified Kernel Image is taken from its .linux
+ * section.
+ */
+UNZBOOT_API int unzboot_open_memory(unzboot *u, const void *image,
+                                    size_t size);
+UNZBOOT_API int unzboot_open_file(unzboot *u, const char *path);
+UNZBOOT_API int unzboot_open_fd(unzboot *u, int fd);
+UNZBOOT_API void unzboot_close(unzboot *u);
+
+/* What an image is made of, as found by unzboot_inspect() */
+struct unzboot_info {
+    /* "zboot", "uki", "kernel", "scan" or the outermost compression */
+    const char  *container;
+    /* of the kernel, like "gzip" or "zstd", NULL if it is not compressed */
+    const char  *compression;
+    /* "arm64" or "riscv" */
+    const char  *arch;
+    /* of the compressed payload in a zboot image, 0 in other images */
+    uint64_t    payload_offset;
+    uint64_t    payload_size;
+    /*
+     * of the kernel once extracted if known beforehand: zboot images record
+     * it, and a bare kernel is its own size
+     */
+    uint64_t    kernel_size;
+    /* the memory the kernel takes once loaded, from its header, or 0 */
+    uint64_t    image_size;
+};
+
+/* Find out what the open image is made of, decoding just its beginning */
+UNZBOOT_API int unzboot_inspect(unzboot *u, struct unzboot_info *info);
+
+/*
+ * Extract the kernel into buf and store its size in *len. If it does not
+ * fit, UNZBOOT_ERROR_NO_SPACE is returned and *len is the size it needs.
+ * The payload of zboot images is decoded straight into buf.
+ */
+UNZBOOT_API int unzboot_extract_to_buffer(unzboot *u, void *buf, size_t size,
+                                          size_t *len);
+
+/*
+ * Extract the kernel through a callback, called with every chunk of it in
+ * order. It returns 0 to go on and anything else to stop.
+ */
+typedef int (*unzboot_write_fn)(void *opaque, const void *buf, size_t len);
+
+UNZBOOT_API int unzboot_extract_to_callback(unzboot *u,
+                                            unzboot_write_fn write,
+                                            void *opaque);
+
+/*
+ * Extract the kernel to a file, which is only replaced once complete, with
+ * holes for the blocks of zeros.
+ */
+UNZBOOT_API int unzboot_extract_to_file(unzboot *u, const char *path);
+
+/*
+ * Extract the kernel a piece at a time, as the caller asks for it rather
+ * than as the image is decoded: each unzboot_stream_next() call unpacks a
+ * little more of the image, and points *chunk to the next piece of the
+ * kernel, valid until the next call with the context. It returns 1 with a
+ * piece, 0 once the whole kernel has been returned, or an error status.
+ *
+ * unzboot_stream_end() stops streaming before the end, closing the image
+ * does too.
+ */
+UNZBOOT_API int unzboot_stream_begin(unzboot *u);
+UNZBOOT_API int unzboot_stream_next(unzboot *u, const void **chunk,
+                                    size_t *len);
+UNZBOOT_API void unzboot_stream_end(unzboot *u);
+
+/*
+ * Map the kernel without waiting for it to be extracted: *addr points to
+ * *len bytes of read-only memory that a thread fills in from the beginning
+ * of the kernel on, as it decodes it. Reading a page that is not there yet
+ * waits for it through userfaultfd, so the start of the kernel can be used
+ * as soon as it is decoded rather than once all of it is.
+ *
+ * The size of the kernel has to be known beforehand, see kernel_size in
+ * struct unzboot_info, or UNZBOOT_ERROR_UNSUPPORTED is returned. The
+ * userfaultfd only handles faults from user space, which needs no
+ * privileges: system calls given pages that are not there yet fail with
+ * EFAULT, unzboot_map_wait() first. Without userfaultfd, the whole kernel
+ * is extracted before returning.
+ *
+ * unzboot_map_wait() waits until all of the kernel is there and returns how
+ * decoding it went; if it failed, what was not decoded reads as zeros. The
+ * context can not be used for anything else until then.
+ * unzboot_map_end() unmaps the kernel, stopping the decoding if it is not
+ * done, closing the image does too.
+ */
+UNZBOOT_API int unzboot_map_begin(unzboot *u, const void **addr, size_t *len);
+UNZBOOT_API int unzboot_map_wait(unzboot *u);
+UNZBOOT_API void unzboot_map_end(unzboot *u);
+
+/*
+ * The message of the last error of a context, "" if there was none, valid
+ * until the next call with the context
+ */
+UNZBOOT_API const char *unzboot_error_message(const unzboot *u);
+
+/* A description of a status code */
+UNZBOOT_API const char *unzboot_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBUNZBOOT_H */
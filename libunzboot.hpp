@@ -0,0 +1,397 @@
+/*
+ * libunzboot: C++20 interface
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef LIBUNZBOOT_HPP
+#define LIBUNZBOOT_HPP
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "libunzboot.h"
+
+namespace libunzboot {
+
+/* A failed call, with its unzboot_status */
+class error : public std::runtime_error {
+public:
+    error(int status, const char *message)
+        : std::runtime_error(*message ? message : unzboot_strerror(status)),
+          status_(status)
+    {
+    }
+
+    int status() const noexcept { return status_; }
+
+private:
+    int status_;
+};
+
+/*
+ * A coroutine yielding values lazily, as std::generator does in C++23.
+ * Each value is valid until the iterator is incremented.
+ */
+template <typename T>
+class generator {
+public:
+    struct promise_type {
+        const T *value = nullptr;
+        std::exception_ptr exception;
+
+        generator get_return_object() noexcept
+        {
+            return generator(handle::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const T &v) noexcept
+        {
+            value = std::addressof(v);
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept
+        {
+            exception = std::current_exception();
+        }
+        /* values are only yielded, nothing is awaited */
+        template <typename U>
+        std::suspend_never await_transform(U &&) = delete;
+    };
+
+    using handle = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    public:
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(handle h) noexcept : h_(h) {}
+
+        const T &operator*() const noexcept { return *h_.promise().value; }
+        iterator &operator++()
+        {
+            resume(h_);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const noexcept
+        {
+            return !h_ || h_.done();
+        }
+
+    private:
+        handle h_;
+    };
+
+    generator(generator &&other) noexcept
+        : h_(std::exchange(other.h_, nullptr))
+    {
+    }
+    generator &operator=(generator &&other) noexcept
+    {
+        if (this != &other) {
+            destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    ~generator() { destroy(); }
+
+    iterator begin()
+    {
+        resume(h_);
+        return iterator(h_);
+    }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+private:
+    explicit generator(handle h) noexcept : h_(h) {}
+
+    static void resume(handle h)
+    {
+        h.resume();
+        if (h.promise().exception) {
+            std::rethrow_exception(std::exchange(h.promise().exception,
+                                                 nullptr));
+        }
+    }
+
+    void destroy() noexcept
+    {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    handle h_;
+};
+
+/*
+ * An extracted kernel, in an anonymous mapping of its own: it is written
+ * there as it is decoded and never copied after that, moving the image
+ * moves the mapping.
+ */
+class image {
+public:
+    image() noexcept = default;
+    image(const image &) = delete;
+    image &operator=(const image &) = delete;
+    image(image &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)),
+          capacity_(std::exchange(other.capacity_, 0))
+    {
+    }
+    image &operator=(image &&other) noexcept
+    {
+        if (this != &other) {
+            unmap();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+            capacity_ = std::exchange(other.capacity_, 0);
+        }
+        return *this;
+    }
+    ~image() { unmap(); }
+
+    const std::byte *data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    std::span<const std::byte> bytes() const noexcept
+    {
+        return { data_, size_ };
+    }
+
+private:
+    friend class context;
+
+    /* Make room for n bytes in all, growing the mapping in place if it can */
+    void reserve(std::size_t n)
+    {
+        void *p;
+
+        if (n <= capacity_) {
+            return;
+        }
+        if (data_) {
+            p = mremap(data_, capacity_, n, MREMAP_MAYMOVE);
+        } else {
+            p = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        data_ = static_cast<std::byte *>(p);
+        capacity_ = n;
+    }
+
+    void append(const void *buf, std::size_t len)
+    {
+        if (size_ + len > capacity_) {
+            reserve(std::max(size_ + len, capacity_ * 2));
+        }
+        std::memcpy(data_ + size_, buf, len);
+        size_ += len;
+    }
+
+    void unmap() noexcept
+    {
+        if (data_) {
+            munmap(data_, capacity_);
+        }
+        data_ = nullptr;
+        size_ = capacity_ = 0;
+    }
+
+    std::byte *data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = 0;
+};
+
+/*
+ * A libunzboot context, see libunzboot.h: failures are thrown as
+ * libunzboot::error instead of returned.
+ */
+class context {
+public:
+    context() : u_(unzboot_new()) {}
+
+    void set_recursive(bool recursive, int max_depth = 0) noexcept
+    {
+        unzboot_set_recursive(u_.get(), recursive, max_depth);
+    }
+
+    /*
+     * Take the memory of extractions from resource, which must outlive the
+     * context or the next call, e.g. a monotonic_buffer_resource reused for
+     * each image. nullptr goes back to the default allocator of the library.
+     */
+    void set_memory_resource(std::pmr::memory_resource *resource) noexcept
+    {
+        unzboot_allocator a{};
+
+        if (!resource) {
+            unzboot_set_allocator(u_.get(), nullptr);
+            return;
+        }
+        a.alloc = [](void *opaque, std::size_t size,
+                     std::size_t align) noexcept -> void * {
+            try {
+                return static_cast<std::pmr::memory_resource *>(opaque)
+                    ->allocate(size, align);
+            } catch (...) {
+                return nullptr;
+            }
+        };
+        a.free = [](void *opaque, void *ptr, std::size_t size,
+                    std::size_t align) noexcept {
+            static_cast<std::pmr::memory_resource *>(opaque)
+                ->deallocate(ptr, size, align);
+        };
+        a.opaque = resource;
+        unzboot_set_allocator(u_.get(), &a);
+    }
+
+    /* The image is not copied, it must outlive the calls that use it */
+    void open(std::span<const std::byte> image)
+    {
+        check(unzboot_open_memory(u_.get(), image.data(), image.size()));
+    }
+    void open(const std::string &path)
+    {
+        check(unzboot_open_file(u_.get(), path.c_str()));
+    }
+    void open_fd(int fd) { check(unzboot_open_fd(u_.get(), fd)); }
+    void close() noexcept { unzboot_close(u_.get()); }
+
+    unzboot_info inspect()
+    {
+        unzboot_info info{};
+
+        check(unzboot_inspect(u_.get(), &info));
+        return info;
+    }
+
+    /* Extract the kernel into an image of its own */
+    image extract()
+    {
+        unzboot_info info = inspect();
+        image kernel;
+        std::size_t len;
+
+        if (info.kernel_size) {
+            kernel.reserve(info.kernel_size);
+            int ret = unzboot_extract_to_buffer(u_.get(), kernel.data_,
+                                                kernel.capacity_, &len);
+            /* the size of gzip streams is modulo 4 GiB */
+            if (ret == UNZBOOT_ERROR_NO_SPACE) {
+                kernel.reserve(len);
+                ret = unzboot_extract_to_buffer(u_.get(), kernel.data_,
+                                                kernel.capacity_, &len);
+            }
+            check(ret);
+            kernel.size_ = len;
+            return kernel;
+        }
+        /* the loaded kernel is larger than its Image, a good first guess */
+        kernel.reserve(info.image_size ? info.image_size : default_capacity);
+        for (std::span<const std::byte> chunk : chunks()) {
+            kernel.append(chunk.data(), chunk.size());
+        }
+        return kernel;
+    }
+
+    /*
+     * Extract the kernel into buf, an arena of the caller, and return its
+     * size. If it does not fit, the error is UNZBOOT_ERROR_NO_SPACE.
+     */
+    std::size_t extract_to(std::span<std::byte> buf)
+    {
+        std::size_t len;
+
+        check(unzboot_extract_to_buffer(u_.get(), buf.data(), buf.size(),
+                                        &len));
+        return len;
+    }
+
+    /*
+     * Yield the kernel a chunk at a time, only decoding the image as far as
+     * the chunks asked for need. A chunk is valid until the next one is
+     * asked for, and the context must outlive the generator.
+     */
+    generator<std::span<const std::byte>> chunks()
+    {
+        const void *chunk;
+        std::size_t len;
+        int ret;
+
+        /* a generator dropped before the end stops the stream */
+        struct stream_end {
+            unzboot *u;
+            ~stream_end() { unzboot_stream_end(u); }
+        } end{u_.get()};
+
+        check(unzboot_stream_begin(u_.get()));
+        while ((ret = unzboot_stream_next(u_.get(), &chunk, &len)) > 0) {
+            co_yield std::span<const std::byte>(
+                static_cast<const std::byte *>(chunk), len);
+        }
+        check(ret);
+    }
+
+    /*
+     * Map the kernel, filled in as it is decoded, see unzboot_map_begin().
+     * It stays mapped until unmap(), the image is closed or the context
+     * destroyed; map_wait() before using the context for anything else.
+     */
+    std::span<const std::byte> map()
+    {
+        const void *addr;
+        std::size_t len;
+
+        check(unzboot_map_begin(u_.get(), &addr, &len));
+        return {static_cast<const std::byte *>(addr), len};
+    }
+    void map_wait() { check(unzboot_map_wait(u_.get())); }
+    void unmap() noexcept { unzboot_map_end(u_.get()); }
+
+private:
+    static constexpr std::size_t default_capacity = 64 << 20;
+
+    struct deleter {
+        void operator()(unzboot *u) const noexcept { unzboot_free(u); }
+    };
+
+    void check(int status) const
+    {
+        if (status < 0) {
+            throw error(status, unzboot_error_message(u_.get()));
+        }
+    }
+
+    std::unique_ptr<unzboot, deleter> u_;
+};
+
+} // namespace libunzboot
+
+#endif /* LIBUNZBOOT_HPP */
@@ -0,0 +1,403 @@
+/*
+ * Build EFI zboot images around kernel Images, for unzboot pack
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pe.h"
+#include "unzboot.h"
+
+/*
+ * The layout of the images built, which is fixed but for the size of the
+ * payload: the zboot header doubling as MS-DOS stub, the PE headers, a
+ * .text section with the entry point and a .data section with the payload.
+ */
+#define PACK_PE_OFFSET          0x40
+#define PACK_FILE_ALIGN         0x200
+#define PACK_SECTION_ALIGN      0x1000
+#define PACK_TEXT_OFFSET        PACK_FILE_ALIGN
+#define PACK_PAYLOAD_OFFSET     (2 * PACK_FILE_ALIGN)
+#define PACK_TEXT_RVA           PACK_SECTION_ALIGN
+#define PACK_DATA_RVA           (2 * PACK_SECTION_ALIGN)
+
+#define PACK_ALIGN(x, a)        (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* PE32+ optional header, with as many data directories as the kernel's */
+#define PE_OPT_MAGIC_PE32PLUS   0x20b
+#define PE_OPT_DATA_DIRS        6
+#define PE_OPT_HEADER_SIZE      (112 + PE_OPT_DATA_DIRS * 8)
+#define PE_SUBSYSTEM_EFI_APPLICATION    10
+
+/* executable, without line numbers or debugging symbols */
+#define PE_IMAGE_CHARACTERISTICS        0x0206
+#define PE_SCN_TEXT             0x60000020      /* code, read, execute */
+#define PE_SCN_DATA             0xc0000040      /* initialized, read, write */
+
+/*
+ * The architectures a zboot image can be built for, told apart by the magic
+ * of their Image header.
+ *
+ * There is no EFI decompressor to put in the image, that is the kernel's
+ * own: the entry point returns EFI_UNSUPPORTED, so that firmware loading it
+ * fails cleanly. The image is meant for loaders that extract the payload
+ * themselves, like QEMU, U-Boot or unzboot.
+ */
+struct pack_arch {
+    const char  *name;
+    const char  *magic;
+    uint16_t    machine;
+    uint32_t    entry[4];
+};
+
+static const struct pack_arch pack_archs[] = {
+    {
+        "arm64", "ARM\x64", 0xaa64,
+        /* mov x0, #3; movk x0, #0x8000, lsl #48; ret; nop */
+        { 0xd2800060, 0xf2f00000, 0xd65f03c0, 0xd503201f },
+    },
+    {
+        "riscv", "RSC\x05", 0x5064,
+        /* li a0, -1; slli a0, a0, 63; ori a0, a0, 3; ret */
+        { 0xfff00513, 0x03f51513, 0x00356513, 0x00008067 },
+    },
+};
+
+/* A sink gathering the payload after the room left for the headers */
+struct pack_sink {
+    struct sink         sink;
+    struct unpack_buf   buf;
+};
+
+/* A sink checking that what it is written is the kernel packed */
+struct pack_check {
+    struct sink         sink;
+    struct unpack_ctx   *ctx;
+    const uint8_t       *kernel;
+    size_t              size;
+    size_t              offset;
+};
+
+static gchar *compress_arg;
+static gint level;
+static gchar **filenames;
+
+static GOptionEntry entries[] = {
+    { "compress", 0, 0, G_OPTION_ARG_STRING, &compress_arg,
+      "Compress the kernel with zstd, gzip or lz4, on all the processors "
+      "(default: gzip)", "FORMAT" },
+    { "level", 0, 0, G_OPTION_ARG_INT, &level,
+      "Compression level, the default of the format if not given", "N" },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames,
+      NULL, NULL },
+    G_OPTION_ENTRY_NULL
+};
+
+static void stw_le(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void stl_le(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int pack_sink_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct pack_sink *p = (struct pack_sink *)sink;
+
+    unpack_buf_append(NULL, &p->buf, buf, len);
+    return 0;
+}
+
+/* The payload stays in the buffer, which is cleared by the caller */
+static int pack_sink_finish(struct sink *sink)
+{
+    (void)sink;
+    return 0;
+}
+
+static void pack_sink_abort(struct sink *sink)
+{
+    (void)sink;
+}
+
+static int pack_check_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct pack_check *c = (struct pack_check *)sink;
+
+    if (len > c->size - c->offset || memcmp(c->kernel + c->offset, buf, len)) {
+        unpack_error(c->ctx, UNPACK_ERROR_CORRUPT,
+                     "%s: does not unpack to the kernel packed, at offset %zu",
+                     c->ctx->input_file, c->offset);
+        return -1;
+    }
+    c->offset += len;
+    return 0;
+}
+
+static int pack_check_finish(struct sink *sink)
+{
+    struct pack_check *c = (struct pack_check *)sink;
+
+    if (c->offset != c->size) {
+        unpack_error(c->ctx, UNPACK_ERROR_CORRUPT,
+                     "%s: unpacks to %zu bytes instead of %zu",
+                     c->ctx->input_file, c->offset, c->size);
+        return -1;
+    }
+    return 0;
+}
+
+static void pack_check_abort(struct sink *sink)
+{
+    (void)sink;
+}
+
+static const struct pack_arch *pack_find_arch(const uint8_t *kernel,
+                                              size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS(pack_archs); i++) {
+        if (size > ARM64_MAGIC_OFFSET + 4 &&
+            memcmp(kernel + ARM64_MAGIC_OFFSET, pack_archs[i].magic, 4) == 0) {
+            return &pack_archs[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Fill in the headers of the image in buf, whose payload of plsize bytes
+ * starts at PACK_PAYLOAD_OFFSET and is padded to the file alignment.
+ */
+static void pack_headers(uint8_t *buf, const struct pack_arch *arch,
+                         const struct codec *codec, uint32_t plsize,
+                         uint32_t plraw)
+{
+    struct linux_efi_zboot_header *header;
+    uint8_t *coff, *opt, *shdr;
+    const char *type;
+    int i;
+
+    /* the names the kernel gives the compression types */
+    type = codec->id == CODEC_ZSTD ? "zstd22" : codec->name;
+
+    header = (struct linux_efi_zboot_header *)buf;
+    memcpy(header->msdos_magic, EFI_PE_MSDOS_MAGIC, 2);
+    memcpy(header->zimg, "zimg", 4);
+    stl_le((uint8_t *)&header->payload_offset, PACK_PAYLOAD_OFFSET);
+    stl_le((uint8_t *)&header->payload_size, plsize);
+    memcpy(header->compression_type, type, strlen(type));
+    memcpy(header->linux_magic, EFI_PE_LINUX_MAGIC, 4);
+    stl_le((uint8_t *)&header->pe_header_offset, PACK_PE_OFFSET);
+
+    memcpy(buf + PACK_PE_OFFSET, PE_SIGNATURE, 4);
+    coff = buf + PACK_PE_OFFSET + 4;
+    stw_le(coff, arch->machine);
+    stw_le(coff + 2, 2);
+    stw_le(coff + 16, PE_OPT_HEADER_SIZE);
+    stw_le(coff + 18, PE_IMAGE_CHARACTERISTICS);
+
+    opt = coff + PE_COFF_HEADER_SIZE;
+    stw_le(opt, PE_OPT_MAGIC_PE32PLUS);
+    stl_le(opt + 4, PACK_FILE_ALIGN);                   /* SizeOfCode */
+    stl_le(opt + 8, plraw);                             /* ...InitializedData */
+    stl_le(opt + 16, PACK_TEXT_RVA);                    /* AddressOfEntryPoint */
+    stl_le(opt + 20, PACK_TEXT_RVA);                    /* BaseOfCode */
+    stl_le(opt + 32, PACK_SECTION_ALIGN);
+    stl_le(opt + 36, PACK_FILE_ALIGN);
+    stl_le(opt + 56, PACK_DATA_RVA +                    /* SizeOfImage */
+           PACK_ALIGN(plsize, PACK_SECTION_ALIGN));
+    stl_le(opt + 60, PACK_TEXT_OFFSET);                 /* SizeOfHeaders */
+    stw_le(opt + 68, PE_SUBSYSTEM_EFI_APPLICATION);
+    stl_le(opt + 108, PE_OPT_DATA_DIRS);
+
+    shdr = opt + PE_OPT_HEADER_SIZE;
+    memcpy(shdr, ".text", 5);
+    stl_le(shdr + 8, sizeof(arch->entry));
+    stl_le(shdr + 12, PACK_TEXT_RVA);
+    stl_le(shdr + 16, PACK_FILE_ALIGN);
+    stl_le(shdr + 20, PACK_TEXT_OFFSET);
+    stl_le(shdr + 36, PE_SCN_TEXT);
+
+    shdr += PE_SECTION_HEADER_SIZE;
+    memcpy(shdr, ".data", 5);
+    stl_le(shdr + 8, plsize);
+    stl_le(shdr + 12, PACK_DATA_RVA);
+    stl_le(shdr + 16, plraw);
+    stl_le(shdr + 20, PACK_PAYLOAD_OFFSET);
+    stl_le(shdr + 36, PE_SCN_DATA);
+
+    for (i = 0; i < (int)G_N_ELEMENTS(arch->entry); i++) {
+        stl_le(buf + PACK_TEXT_OFFSET + i * 4, arch->entry[i]);
+    }
+}
+
+/*
+ * Build the zboot image of kernel in p->buf, compressing it with codec on
+ * all the processors.
+ */
+static int pack_build(struct unpack_ctx *ctx, const uint8_t *kernel,
+                      size_t size, const struct pack_arch *arch,
+                      const struct codec *codec, struct pack_sink *p)
+{
+    static const uint8_t zeros[PACK_PAYLOAD_OFFSET];
+    struct sink *out;
+    uint8_t isize[4];
+    size_t plsize, plraw;
+
+    p->sink.write = pack_sink_write;
+    p->sink.finish = pack_sink_finish;
+    p->sink.abort = pack_sink_abort;
+    unpack_buf_append(NULL, &p->buf, zeros, sizeof(zeros));
+
+    out = encode_sink_new(ctx, codec, level, &p->sink);
+    if (!out || sink_write_all(out, kernel, size) < 0) {
+        return -1;
+    }
+    /*
+     * As the kernel does, the size of the kernel is appended to the streams
+     * that do not end with it already like gzip does.
+     */
+    if (codec->id != CODEC_GZIP) {
+        stl_le(isize, size);
+        unpack_buf_append(NULL, &p->buf, isize, sizeof(isize));
+    }
+
+    plsize = p->buf.len - PACK_PAYLOAD_OFFSET;
+    plraw = PACK_ALIGN(plsize, PACK_FILE_ALIGN);
+    if (plraw > G_MAXINT - PACK_SECTION_ALIGN * 3) {
+        unpack_error(ctx, UNPACK_ERROR_UNSUPPORTED,
+                     "%s: too large for a zboot image", ctx->input_file);
+        return -1;
+    }
+    unpack_buf_append(NULL, &p->buf, zeros, plraw - plsize);
+    pack_headers(p->buf.data, arch, codec, plsize, plraw);
+    return 0;
+}
+
+/* Unpack the image built the way it is extracted, and compare the result */
+static int pack_check(struct unpack_ctx *ctx, const uint8_t *image,
+                      size_t image_size, const uint8_t *kernel, size_t size)
+{
+    struct pack_check c = {
+        .sink = {
+            .write = pack_check_write,
+            .finish = pack_check_finish,
+            .abort = pack_check_abort,
+        },
+        .ctx = ctx,
+        .kernel = kernel,
+        .size = size,
+    };
+
+    return unpack_image(ctx, image, image_size, &c.sink, TRUE);
+}
+
+int pack_zboot(int argc, char *argv[])
+{
+    GOptionContext *context;
+    const struct pack_arch *arch;
+    const struct codec *codec = &codecs[CODEC_GZIP];
+    struct pack_sink p = { 0 };
+    struct unpack_ctx ctx, check;
+    const char *prog = argv[0];
+    GError *error = NULL;
+    gchar *kernel = NULL;
+    struct sink *out;
+    gsize size;
+    int i, ret = -1;
+
+    context = g_option_context_new("pack <kernel Image> <output file>");
+    g_option_context_set_summary(context, "Build an EFI zboot image around "
+                                 "a kernel Image, and check that it unpacks "
+                                 "to the same Image.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s: %s\n", prog, error->message);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free(context);
+
+    /* the subcommand name is left with the file names */
+    if (!filenames || g_strv_length(filenames) != 3) {
+        fprintf(stderr, "Usage: %s pack [OPTION...] <kernel Image> "
+                "<output file>\n", prog);
+        exit(EXIT_FAILURE);
+    }
+
+    if (compress_arg) {
+        for (i = 0, codec = NULL; i < N_CODECS && !codec; i++) {
+            if (strcmp(codecs[i].name, compress_arg) == 0) {
+                codec = &codecs[i];
+            }
+        }
+        if (!codec) {
+            fprintf(stderr, "%s: unknown compression format \"%s\"\n", prog,
+                    compress_arg);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!encode_check(codec, level, &error)) {
+        fprintf(stderr, "%s: %s\n", prog, error->message);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!g_file_get_contents(filenames[1], &kernel, &size, &error)) {
+        fprintf(stderr, "%s: %s\n", prog, error->message);
+        exit(EXIT_FAILURE);
+    }
+    arch = pack_find_arch((const uint8_t *)kernel, size);
+    if (!arch) {
+        fprintf(stderr, "%s: %s: not an ARM64 or RISC-V kernel Image\n", prog,
+                filenames[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    unpack_ctx_init(&ctx, prog, filenames[1]);
+    unpack_ctx_init(&check, prog, filenames[2]);
+    check.quiet = TRUE;
+
+    if (pack_build(&ctx, (const uint8_t *)kernel, size, arch, codec, &p) < 0) {
+        fprintf(stderr, "%s: cannot compress %s\n", prog, filenames[1]);
+        goto out;
+    }
+    /* Nothing is written unless it gives the same kernel back */
+    if (pack_check(&check, p.buf.data, p.buf.len,
+                   (const uint8_t *)kernel, size) < 0) {
+        fprintf(stderr, "%s: %s\n", prog, check.error ? check.error->message :
+                "the image built cannot be unpacked");
+        goto out;
+    }
+
+    out = file_sink_new(&ctx, filenames[2]);
+    ret = out ? sink_write_all(out, p.buf.data, p.buf.len) : -1;
+    if (ret < 0) {
+        fprintf(stderr, "%s: cannot write %s\n", prog, filenames[2]);
+        goto out;
+    }
+    printf("%s: %s kernel of %zu bytes, packed with %s in %zu bytes\n",
+           filenames[2], arch->name, size, codec->name, p.buf.len);
+
+out:
+    unpack_buf_clear(NULL, &p.buf);
+    unpack_ctx_clear(&check);
+    unpack_ctx_clear(&ctx);
+    g_free(kernel);
+    g_free(compress_arg);
+    g_strfreev(filenames);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
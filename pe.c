@@ -0,0 +1,95 @@
+/*
+ * Minimal PE/COFF section table parser
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "pe.h"
+
+static inline uint16_t lduw_le(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t ldl_le(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int pe_parse_sections(const uint8_t *image, size_t size,
+                      struct pe_section **sections)
+{
+    const uint8_t *coff, *shdr;
+    struct pe_section *s;
+    size_t pe_offset, table_offset;
+    int i, nsections, count;
+
+    if (size < PE_MSDOS_LFANEW_OFFSET + 4 || memcmp(image, "MZ", 2) != 0) {
+        return -1;
+    }
+
+    pe_offset = ldl_le(image + PE_MSDOS_LFANEW_OFFSET);
+    if (pe_offset > size - 4 - PE_COFF_HEADER_SIZE ||
+        memcmp(image + pe_offset, PE_SIGNATURE, 4) != 0) {
+        return -1;
+    }
+
+    coff = image + pe_offset + 4;
+    nsections = lduw_le(coff + 2);
+    table_offset = pe_offset + 4 + PE_COFF_HEADER_SIZE + lduw_le(coff + 16);
+    if (table_offset > size ||
+        (size - table_offset) / PE_SECTION_HEADER_SIZE < (size_t)nsections) {
+        return -1;
+    }
+
+    s = g_new0(struct pe_section, nsections);
+    count = 0;
+    for (i = 0; i < nsections; i++) {
+        uint32_t vsize, rawsize, rawoff;
+
+        shdr = image + table_offset + i * PE_SECTION_HEADER_SIZE;
+        vsize = ldl_le(shdr + 8);
+        rawsize = ldl_le(shdr + 16);
+        rawoff = ldl_le(shdr + 20);
+
+        /* sections without file backing (e.g. .bss) carry nothing to extract */
+        if (rawsize == 0) {
+            continue;
+        }
+        if (rawoff > size || rawsize > size - rawoff) {
+            g_free(s);
+            return -1;
+        }
+
+        memcpy(s[count].name, shdr, PE_SECTION_NAME_LEN);
+        s[count].name[PE_SECTION_NAME_LEN] = '\0';
+        s[count].data = image + rawoff;
+        /*
+         * SizeOfRawData is rounded up to the file alignment, VirtualSize is
+         * the actual size of the payload when it is the smaller of the two.
+         */
+        s[count].size = (vsize && vsize < rawsize) ? vsize : rawsize;
+        count++;
+    }
+
+    *sections = s;
+    return count;
+}
+
+const struct pe_section *pe_find_section(const struct pe_section *sections,
+                                         int count, const char *name)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (strcmp(sections[i].name, name) == 0) {
+            return &sections[i];
+        }
+    }
+    return NULL;
+}
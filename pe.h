@@ -0,0 +1,56 @@
+/*
+ * Minimal PE/COFF section table parser
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PE_H
+#define PE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Offset of the PE header offset in the MS-DOS stub */
+#define PE_MSDOS_LFANEW_OFFSET      0x3c
+
+/* The PE/COFF image signature, "PE\0\0" */
+#define PE_SIGNATURE                "PE\0\0"
+
+/* Size of a COFF file header, following the PE signature */
+#define PE_COFF_HEADER_SIZE         20
+
+/* Size of a single entry of the section table */
+#define PE_SECTION_HEADER_SIZE      40
+
+/* Section names are at most 8 bytes and not necessarily NUL terminated */
+#define PE_SECTION_NAME_LEN         8
+
+/*
+ * A section of a PE/COFF image, as a view into the mapped image: the data
+ * pointer references the caller's buffer and nothing is copied.
+ */
+struct pe_section {
+    char            name[PE_SECTION_NAME_LEN + 1];
+    const uint8_t   *data;
+    size_t          size;
+};
+
+/*
+ * Parse the section table of the PE/COFF image at *image.
+ *
+ * On success, return the number of sections and store a newly allocated
+ * array of them in *sections, to be released with g_free(). Return -1 if
+ * the image is not a PE/COFF image or its section table is corrupt.
+ */
+int pe_parse_sections(const uint8_t *image, size_t size,
+                      struct pe_section **sections);
+
+/*
+ * Find the section called name in an array returned by pe_parse_sections().
+ */
+const struct pe_section *pe_find_section(const struct pe_section *sections,
+                                         int count, const char *name);
+
+#endif /* PE_H */
@@ -0,0 +1,154 @@
+/*
+ * Hardware performance counters, for --perf-counters
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "unzboot.h"
+
+static const uint64_t perf_configs[UNPACK_N_EVENTS] = {
+    [UNPACK_EVENT_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [UNPACK_EVENT_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [UNPACK_EVENT_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    /* the last level cache on most CPUs */
+    [UNPACK_EVENT_LLC_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+};
+
+/*
+ * The events of a thread are counted as a group, so that they are scheduled
+ * together and read with a single read(). When there are more events than
+ * counters the group is multiplexed and the counts are scaled.
+ */
+struct perf_group {
+    int     leader;
+    int     fds[UNPACK_N_EVENTS];
+    /* position of each event in what is read, -1 if it is not counted */
+    int     index[UNPACK_N_EVENTS];
+    int     nevents;
+};
+
+struct perf_read_format {
+    uint64_t    nr;
+    uint64_t    time_enabled;
+    uint64_t    time_running;
+    uint64_t    values[UNPACK_N_EVENTS];
+};
+
+static _Thread_local struct perf_group *perf_group;
+
+static guint perf_available;
+
+static int perf_event_open(uint64_t config, int group_fd,
+                           gboolean exclude_kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group_fd < 0;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+                   PERF_FLAG_FD_CLOEXEC);
+}
+
+gboolean perf_thread_open(void)
+{
+    struct perf_group *g;
+    gboolean exclude_kernel = FALSE;
+    int i, fd;
+
+    if (perf_group) {
+        return TRUE;
+    }
+
+    g = g_new0(struct perf_group, 1);
+    g->leader = -1;
+    for (i = 0; i < UNPACK_N_EVENTS; i++) {
+        g->index[i] = -1;
+        fd = perf_event_open(perf_configs[i], g->leader, exclude_kernel);
+        /*
+         * With perf_event_paranoid set to 2 only user space can be counted,
+         * the time spent in the kernel writing the output is then left out.
+         */
+        if (fd < 0 && (errno == EACCES || errno == EPERM) && !exclude_kernel) {
+            exclude_kernel = TRUE;
+            fd = perf_event_open(perf_configs[i], g->leader, exclude_kernel);
+        }
+        if (fd < 0) {
+            /* not supported by this CPU, or not allowed at all */
+            continue;
+        }
+        if (g->leader < 0) {
+            g->leader = fd;
+        }
+        g->fds[g->nevents] = fd;
+        g->index[i] = g->nevents++;
+        g_atomic_int_or(&perf_available, 1u << i);
+    }
+
+    if (g->nevents == 0) {
+        g_free(g);
+        return FALSE;
+    }
+    ioctl(g->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    perf_group = g;
+    return TRUE;
+}
+
+void perf_thread_close(void)
+{
+    struct perf_group *g = perf_group;
+    int i;
+
+    if (!g) {
+        return;
+    }
+    for (i = 0; i < g->nevents; i++) {
+        close(g->fds[i]);
+    }
+    g_free(g);
+    perf_group = NULL;
+}
+
+void perf_read(uint64_t events[UNPACK_N_EVENTS])
+{
+    struct perf_group *g = perf_group;
+    struct perf_read_format r;
+    int i;
+
+    memset(events, 0, UNPACK_N_EVENTS * sizeof(*events));
+    if (!g || read(g->leader, &r, sizeof(r)) <= 0 || r.time_running == 0) {
+        return;
+    }
+    for (i = 0; i < UNPACK_N_EVENTS; i++) {
+        if (g->index[i] < 0) {
+            continue;
+        }
+        events[i] = r.values[g->index[i]];
+        if (r.time_running < r.time_enabled) {
+            events[i] = (double)events[i] * r.time_enabled / r.time_running;
+        }
+    }
+}
+
+gboolean perf_event_available(enum unpack_event event)
+{
+    return (g_atomic_int_get(&perf_available) & (1u << event)) != 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * USDT probes, for bpftrace and perf
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include "config.h"
+
+/*
+ * Statically defined tracepoints of the "unzboot" provider. Each one is a
+ * single nop until a tracer attaches to it, and nothing at all when built
+ * without the usdt option.
+ *
+ *   load(path, size)                       the input file has been opened
+ *   header(format, depth)                  a layer has been found
+ *   zboot_header(type, offset, size)       a zboot header has been parsed
+ *   inflate_start(format, in_bytes)        a call to a decoder
+ *   inflate_end(format, consumed, produced)
+ *   verify(crc, isize, ok)                 a gzip trailer has been checked
+ *   write_done(path, bytes)                an output file is complete
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define UNZBOOT_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(unzboot, name, a1, a2)
+#define UNZBOOT_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(unzboot, name, a1, a2, a3)
+#else
+#define UNZBOOT_PROBE2(name, a1, a2) \
+    do { } while (0)
+#define UNZBOOT_PROBE3(name, a1, a2, a3) \
+    do { } while (0)
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,118 @@
+/*
+ * Signature scanner for compressed kernels
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "unzboot.h"
+
+/*
+ * The image is scanned in blocks of SCAN_VECTOR_SIZE bytes using the generic
+ * vector extensions of GCC and clang, which are lowered to SSE2, NEON or
+ * whatever the target offers. A block is only looked at byte by byte when it
+ * contains the first two bytes of one of the magic numbers.
+ */
+#define SCAN_VECTOR_SIZE    16
+
+typedef uint8_t scan_vec __attribute__((vector_size(SCAN_VECTOR_SIZE)));
+
+static inline scan_vec scan_load(const uint8_t *p)
+{
+    scan_vec v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline gboolean scan_any(scan_vec v)
+{
+    uint64_t w[SCAN_VECTOR_SIZE / 8];
+    uint64_t acc = 0;
+    size_t i;
+
+    memcpy(w, &v, sizeof(w));
+    for (i = 0; i < G_N_ELEMENTS(w); i++) {
+        acc |= w[i];
+    }
+    return acc != 0;
+}
+
+static void scan_match(GArray *cands, const struct codec **scanned,
+                       size_t nscanned, const uint8_t *buf, size_t len,
+                       size_t offset)
+{
+    size_t i;
+
+    for (i = 0; i < nscanned; i++) {
+        const struct codec *codec = scanned[i];
+        struct scan_candidate cand = { codec, offset };
+
+        if (len - offset >= codec->magic_len &&
+            memcmp(buf + offset, codec->magic, codec->magic_len) == 0) {
+            g_array_append_val(cands, cand);
+        }
+    }
+}
+
+static gint scan_candidate_cmp(gconstpointer a, gconstpointer b)
+{
+    const struct scan_candidate *ca = a, *cb = b;
+
+    /* formats are listed from the most to the least likely one */
+    if (ca->codec != cb->codec) {
+        return ca->codec < cb->codec ? -1 : 1;
+    }
+    if (ca->offset != cb->offset) {
+        return ca->offset < cb->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+GArray *scan_signatures(const uint8_t *buf, size_t len)
+{
+    GArray *cands = g_array_new(FALSE, FALSE, sizeof(struct scan_candidate));
+    const struct codec *scanned[16];
+    scan_vec first[G_N_ELEMENTS(scanned)], second[G_N_ELEMENTS(scanned)];
+    size_t i, j, nscanned = 0;
+
+    /* only formats that can be decoded are worth looking for */
+    for (i = 0; i < N_CODECS && nscanned < G_N_ELEMENTS(scanned); i++) {
+        if (codecs[i].ops) {
+            scanned[nscanned] = &codecs[i];
+            for (j = 0; j < SCAN_VECTOR_SIZE; j++) {
+                first[nscanned][j] = codecs[i].magic[0];
+                second[nscanned][j] = codecs[i].magic[1];
+            }
+            nscanned++;
+        }
+    }
+
+    for (i = 0; len > SCAN_VECTOR_SIZE && i < len - SCAN_VECTOR_SIZE;
+         i += SCAN_VECTOR_SIZE) {
+        scan_vec b0 = scan_load(buf + i), b1 = scan_load(buf + i + 1);
+        scan_vec hit = { 0 };
+
+        for (j = 0; j < nscanned; j++) {
+            hit |= (scan_vec)((b0 == first[j]) & (b1 == second[j]));
+        }
+        if (!scan_any(hit)) {
+            continue;
+        }
+        for (j = 0; j < SCAN_VECTOR_SIZE; j++) {
+            if (hit[j]) {
+                scan_match(cands, scanned, nscanned, buf, len, i + j);
+            }
+        }
+    }
+    for (; i < len; i++) {
+        scan_match(cands, scanned, nscanned, buf, len, i);
+    }
+
+    g_array_sort(cands, scan_candidate_cmp);
+    return cands;
+}
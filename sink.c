@@ -0,0 +1,855 @@
+/*
+ * Output sinks
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "unzboot.h"
+
+/*
+ * Whole blocks of zeros are not written but left as holes. This is the
+ * block size of most filesystems, holes can not be any smaller.
+ */
+#define SPARSE_BLOCK_SIZE   4096
+
+/* Zero blocks are told apart SPARSE_VECTOR_SIZE bytes at a time */
+#define SPARSE_VECTOR_SIZE  16
+
+typedef uint8_t sparse_vec __attribute__((vector_size(SPARSE_VECTOR_SIZE)));
+
+/*
+ * Like g_file_set_contents(), the output is written to a temporary file that
+ * only replaces the destination once it is complete.
+ *
+ * If the temporary file can not be created, or the destination is not a
+ * regular file, the destination is written in place instead. Holes are then
+ * punched over the zero blocks, as the old contents may be anything. Pipes,
+ * terminals and devices are written in order, without seeking or holes.
+ *
+ * Symbolic links, like /dev/stdout redirected to a file, are written through
+ * rather than replaced.
+ */
+struct file_sink {
+    struct sink sink;
+    struct unpack_ctx *ctx;
+    char        *path;
+    char        *tmp_path;
+    int         fd;
+    gboolean    in_place;
+    gboolean    sparse;
+    /* not a regular file, that can not be written at an offset */
+    gboolean    stream;
+    /* of the output written so far, and of its last non-zero block */
+    uint64_t    offset;
+    uint64_t    data_end;
+    /* what has been written of the next block, when it is not whole yet */
+    uint8_t     *block;
+    size_t      block_len;
+};
+
+static gboolean is_zero_block(const uint8_t *buf)
+{
+    sparse_vec acc = { 0 }, v;
+    uint64_t w[SPARSE_VECTOR_SIZE / 8];
+    size_t i, j;
+
+    for (i = 0; i < SPARSE_BLOCK_SIZE; i += 16 * SPARSE_VECTOR_SIZE) {
+        for (j = 0; j < 16 * SPARSE_VECTOR_SIZE; j += SPARSE_VECTOR_SIZE) {
+            memcpy(&v, buf + i + j, sizeof(v));
+            acc |= v;
+        }
+        memcpy(w, &acc, sizeof(w));
+        if (w[0] | w[1]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int file_write_data(struct file_sink *f, const uint8_t *buf, size_t len)
+{
+    struct unpack_cost start;
+    int ret = 0;
+
+    unpack_cost_begin(&start);
+    while (len > 0) {
+        ssize_t n = f->stream ? write(f->fd, buf, len) :
+                                pwrite(f->fd, buf, len, f->offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            unpack_error(f->ctx, UNPACK_ERROR_IO, "%s: cannot write output "
+                         "file: %s", f->path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        buf += n;
+        len -= n;
+        f->offset += n;
+        f->data_end = f->offset;
+    }
+    unpack_phase_end(f->ctx, UNPACK_PHASE_WRITE, &start);
+    return ret;
+}
+
+static int file_skip_zeros(struct file_sink *f, const uint8_t *zeros,
+                           size_t len)
+{
+    if (f->in_place &&
+        fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  f->offset, len) < 0) {
+        /* no holes on this filesystem, the old data must be overwritten */
+        return file_write_data(f, zeros, len);
+    }
+    f->offset += len;
+    f->ctx->sparse_bytes += len;
+    return 0;
+}
+
+static int file_write_blocks(struct file_sink *f, const uint8_t *buf,
+                             size_t len, gboolean zero)
+{
+    return zero ? file_skip_zeros(f, buf, len) : file_write_data(f, buf, len);
+}
+
+static int file_sink_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct file_sink *f = (struct file_sink *)sink;
+    gboolean zero;
+    size_t n;
+
+    if (!f->sparse) {
+        return file_write_data(f, buf, len);
+    }
+
+    while (len > 0) {
+        /*
+         * Chunks do not necessarily end on a block boundary, the rest of a
+         * block is gathered before telling whether it is all zeros.
+         */
+        if (f->block_len > 0 || len < SPARSE_BLOCK_SIZE) {
+            n = MIN(len, SPARSE_BLOCK_SIZE - f->block_len);
+            memcpy(f->block + f->block_len, buf, n);
+            f->block_len += n;
+            buf += n;
+            len -= n;
+            if (f->block_len == SPARSE_BLOCK_SIZE) {
+                f->block_len = 0;
+                if (file_write_blocks(f, f->block, SPARSE_BLOCK_SIZE,
+                                      is_zero_block(f->block)) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        /* a run of whole blocks, either all zeros or all with some data */
+        zero = is_zero_block(buf);
+        n = SPARSE_BLOCK_SIZE;
+        while (len - n >= SPARSE_BLOCK_SIZE &&
+               is_zero_block(buf + n) == zero) {
+            n += SPARSE_BLOCK_SIZE;
+        }
+        if (file_write_blocks(f, buf, n, zero) < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Copy without going through user space: share the extents of the input if
+ * the filesystem supports reflinks, or let the kernel copy them otherwise.
+ * If neither is possible between these two files, fall back to read/write.
+ */
+static int file_sink_copy_from(struct sink *sink, int fd, uint64_t size)
+{
+    struct file_sink *f = (struct file_sink *)sink;
+    loff_t off_in = 0, off_out = 0;
+    struct unpack_cost start;
+    uint8_t *buf;
+    ssize_t n;
+
+    unpack_cost_begin(&start);
+    /* the whole input is cloned, it may go on beyond size */
+    if (!f->in_place && ioctl(f->fd, FICLONE, fd) == 0 &&
+        ftruncate(f->fd, size) == 0) {
+        f->offset = f->data_end = size;
+        unpack_phase_end(f->ctx, UNPACK_PHASE_WRITE, &start);
+        return 0;
+    }
+
+    while (!f->stream && (uint64_t)off_in < size) {
+        n = copy_file_range(fd, &off_in, f->fd, &off_out,
+                            MIN(size - off_in, SSIZE_MAX), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+                      errno == EOPNOTSUPP || errno == EINVAL)) {
+            break;
+        }
+        if (n <= 0) {
+            unpack_error(f->ctx, UNPACK_ERROR_IO, "%s: cannot write output "
+                         "file: %s", f->path,
+                         n < 0 ? strerror(errno) : "input file truncated");
+            unpack_phase_end(f->ctx, UNPACK_PHASE_WRITE, &start);
+            return -1;
+        }
+    }
+    f->offset = f->data_end = off_out;
+    unpack_phase_end(f->ctx, UNPACK_PHASE_WRITE, &start);
+
+    buf = g_malloc(UNPACK_CHUNK_SIZE);
+    while ((uint64_t)off_in < size) {
+        n = pread(fd, buf, MIN(size - off_in, UNPACK_CHUNK_SIZE), off_in);
+        if (n <= 0 || file_sink_write(sink, buf, n) < 0) {
+            g_free(buf);
+            return -1;
+        }
+        off_in += n;
+    }
+    g_free(buf);
+    return 0;
+}
+
+/* An output file complete under tmp_path, to be renamed to path */
+struct staged_output {
+    char        *tmp_path;
+    char        *path;
+};
+
+static void file_sink_free(struct file_sink *f)
+{
+    g_free(f->path);
+    g_free(f->tmp_path);
+    g_free(f->block);
+    g_free(f);
+}
+
+static void file_sink_abort(struct sink *sink)
+{
+    struct file_sink *f = (struct file_sink *)sink;
+
+    close(f->fd);
+    if (!f->in_place) {
+        unlink(f->tmp_path);
+    }
+    file_sink_free(f);
+}
+
+static int file_sink_finish(struct sink *sink)
+{
+    struct file_sink *f = (struct file_sink *)sink;
+    struct unpack_ctx *ctx = f->ctx;
+    struct unpack_cost start;
+
+    if (f->sparse && file_write_data(f, f->block, f->block_len) < 0) {
+        file_sink_abort(sink);
+        return -1;
+    }
+
+    unpack_cost_begin(&start);
+    /*
+     * Trailing holes do not extend the file by themselves, and in place the
+     * old contents may go beyond the new end of the file.
+     */
+    if (((f->in_place && !f->stream) ||
+         (f->sparse && f->offset > f->data_end)) &&
+        ftruncate(f->fd, f->offset) < 0) {
+        unpack_error(ctx, UNPACK_ERROR_IO, "%s: cannot write output file: %s",
+                     f->path, strerror(errno));
+        file_sink_abort(sink);
+        unpack_phase_end(ctx, UNPACK_PHASE_WRITE, &start);
+        return -1;
+    }
+
+    if (close(f->fd) < 0 ||
+        (!f->in_place && !ctx->staged_outputs &&
+         rename(f->tmp_path, f->path) < 0)) {
+        unpack_error(ctx, UNPACK_ERROR_IO, "%s: cannot write output file: %s",
+                     f->path, strerror(errno));
+        if (!f->in_place) {
+            unlink(f->tmp_path);
+        }
+        file_sink_free(f);
+        unpack_phase_end(ctx, UNPACK_PHASE_WRITE, &start);
+        return -1;
+    }
+    if (!f->in_place && ctx->staged_outputs) {
+        struct staged_output s = {
+            .tmp_path = g_steal_pointer(&f->tmp_path),
+            .path = g_strdup(f->path),
+        };
+
+        g_array_append_val(ctx->staged_outputs, s);
+    }
+    ctx->out_bytes += f->offset;
+    UNZBOOT_PROBE2(write_done, f->path, f->offset);
+    file_sink_free(f);
+    unpack_phase_end(ctx, UNPACK_PHASE_WRITE, &start);
+    return 0;
+}
+
+/* Discards the output, only counting it */
+struct null_sink {
+    struct sink sink;
+    struct unpack_ctx *ctx;
+    uint64_t    len;
+};
+
+static int null_sink_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct null_sink *n = (struct null_sink *)sink;
+
+    (void)buf;
+    n->len += len;
+    return 0;
+}
+
+static int null_sink_finish(struct sink *sink)
+{
+    struct null_sink *n = (struct null_sink *)sink;
+
+    n->ctx->out_bytes += n->len;
+    g_free(n);
+    return 0;
+}
+
+static void null_sink_abort(struct sink *sink)
+{
+    g_free(sink);
+}
+
+struct sink *null_sink_new(struct unpack_ctx *ctx)
+{
+    struct null_sink *n = g_new0(struct null_sink, 1);
+
+    n->ctx = ctx;
+    n->sink.write = null_sink_write;
+    n->sink.finish = null_sink_finish;
+    n->sink.abort = null_sink_abort;
+    return &n->sink;
+}
+
+static struct sink *file_sink_ready(struct file_sink *f)
+{
+    if (f->sparse) {
+        f->block = g_malloc(SPARSE_BLOCK_SIZE);
+    }
+
+    f->sink.write = file_sink_write;
+    f->sink.finish = file_sink_finish;
+    f->sink.abort = file_sink_abort;
+    f->sink.copy_from = file_sink_copy_from;
+    return &f->sink;
+}
+
+static struct sink *file_sink_open(struct unpack_ctx *ctx, const char *path)
+{
+    struct file_sink *f = g_new0(struct file_sink, 1);
+    struct stat st;
+    gboolean exists;
+    char *target;
+
+    f->ctx = ctx;
+    f->sparse = ctx->sparse;
+    exists = stat(path, &st) == 0;
+    target = exists && S_ISREG(st.st_mode) ? realpath(path, NULL) : NULL;
+    f->path = g_strdup(target ? target : path);
+    free(target);
+
+    if (!exists || S_ISREG(st.st_mode)) {
+        f->tmp_path = g_strdup_printf("%s.XXXXXX", f->path);
+        f->fd = g_mkstemp_full(f->tmp_path, O_WRONLY | O_CLOEXEC, 0666);
+    } else {
+        /* devices, pipes and such are not to be replaced */
+        f->fd = -1;
+        errno = EACCES;
+        f->sparse = FALSE;
+        f->stream = TRUE;
+    }
+    if (f->fd < 0 && exists && (errno == EACCES || errno == EPERM)) {
+        f->in_place = TRUE;
+        f->fd = open(f->path, O_WRONLY | O_CLOEXEC);
+    }
+    if (f->fd < 0) {
+        unpack_error(ctx, UNPACK_ERROR_IO, "%s: cannot write output file: %s",
+                     path, strerror(errno));
+        file_sink_free(f);
+        return NULL;
+    }
+    return file_sink_ready(f);
+}
+
+struct sink *fd_sink_new(struct unpack_ctx *ctx, int fd, const char *name)
+{
+    struct file_sink *f = g_new0(struct file_sink, 1);
+    struct stat st;
+
+    f->ctx = ctx;
+    f->path = g_strdup(name);
+    f->in_place = TRUE;
+    f->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (f->fd >= 0 && fstat(f->fd, &st) < 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    if (f->fd < 0) {
+        unpack_error(ctx, UNPACK_ERROR_IO, "%s: cannot write output: %s",
+                     name, strerror(errno));
+        file_sink_free(f);
+        return NULL;
+    }
+    f->stream = !S_ISREG(st.st_mode);
+    f->sparse = ctx->sparse && !f->stream;
+    return file_sink_ready(f);
+}
+
+/*
+ * For --if-changed: the existing output is read and compared with what would
+ * be written over it. Only when they differ is the output file written,
+ * starting with what they had in common, taken from the existing one. If
+ * they do not, it is neither written nor renamed and its page cache, times
+ * and backups stay valid.
+ */
+struct changed_sink {
+    struct sink sink;
+    struct unpack_ctx *ctx;
+    char        *path;
+    /* the existing output, and how much of it is the same so far */
+    int         fd;
+    uint64_t    size;
+    uint64_t    offset;
+    uint8_t     *buf;
+    /* the output being written, once they differ */
+    struct sink *out;
+};
+
+static void changed_sink_free(struct changed_sink *c)
+{
+    close(c->fd);
+    g_free(c->path);
+    g_free(c->buf);
+    g_free(c);
+}
+
+static int changed_sink_diverge(struct changed_sink *c)
+{
+    struct file_sink *f;
+
+    c->out = file_sink_open(c->ctx, c->path);
+    if (!c->out) {
+        return -1;
+    }
+    f = (struct file_sink *)c->out;
+    if (f->in_place) {
+        /* what is the same is already there */
+        f->offset = f->data_end = c->offset;
+        return 0;
+    }
+    return file_sink_copy_from(c->out, c->fd, c->offset);
+}
+
+static int changed_sink_write(struct sink *sink, const uint8_t *buf,
+                              size_t len)
+{
+    struct changed_sink *c = (struct changed_sink *)sink;
+    struct unpack_cost start;
+    ssize_t n = 0;
+
+    unpack_cost_begin(&start);
+    while (!c->out && len > 0) {
+        if (c->offset < c->size) {
+            n = pread(c->fd, c->buf, MIN(MIN(len, UNPACK_CHUNK_SIZE),
+                                         c->size - c->offset), c->offset);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        /* unreadable is as good as different, it is all written then */
+        if (n <= 0 || memcmp(c->buf, buf, n) != 0) {
+            break;
+        }
+        c->offset += n;
+        buf += n;
+        len -= n;
+        n = 0;
+    }
+    unpack_phase_end(c->ctx, UNPACK_PHASE_WRITE, &start);
+
+    if (len == 0) {
+        return 0;
+    }
+    if (!c->out && changed_sink_diverge(c) < 0) {
+        return -1;
+    }
+    return c->out->write(c->out, buf, len);
+}
+
+static void changed_sink_abort(struct sink *sink)
+{
+    struct changed_sink *c = (struct changed_sink *)sink;
+
+    if (c->out) {
+        c->out->abort(c->out);
+    }
+    changed_sink_free(c);
+}
+
+static int changed_sink_finish(struct sink *sink)
+{
+    struct changed_sink *c = (struct changed_sink *)sink;
+    struct sink *out;
+
+    if (!c->out && c->offset == c->size) {
+        c->ctx->unchanged_bytes += c->size;
+        c->ctx->out_bytes += c->size;
+        changed_sink_free(c);
+        return 0;
+    }
+    /* the existing output goes on beyond the end of the new one */
+    if (!c->out && changed_sink_diverge(c) < 0) {
+        changed_sink_abort(sink);
+        return -1;
+    }
+    out = c->out;
+    changed_sink_free(c);
+    return out->finish(out);
+}
+
+struct sink *file_sink_new(struct unpack_ctx *ctx, const char *path)
+{
+    struct changed_sink *c;
+    struct stat st;
+    int fd;
+
+    if (!ctx->if_changed) {
+        return file_sink_open(ctx, path);
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return file_sink_open(ctx, path);
+    }
+
+    c = g_new0(struct changed_sink, 1);
+    c->ctx = ctx;
+    c->path = g_strdup(path);
+    c->fd = fd;
+    c->size = st.st_size;
+    c->buf = g_malloc(UNPACK_CHUNK_SIZE);
+    c->sink.write = changed_sink_write;
+    c->sink.finish = changed_sink_finish;
+    c->sink.abort = changed_sink_abort;
+    return &c->sink;
+}
+
+/*
+ * Writes the stream to several branches. Branches other than the first one
+ * are written by threads of their own from copies of the chunks, shared by
+ * all of them, of which at most TEE_MAX_CHUNKS are in flight.
+ */
+#define TEE_MAX_CHUNKS      8
+
+enum tee_state {
+    TEE_RUNNING,
+    TEE_FINISH,
+    TEE_ABORT,
+};
+
+struct tee_chunk {
+    int         refs;
+    size_t      len;
+    uint8_t     data[];
+};
+
+struct tee_branch {
+    struct tee_sink *tee;
+    struct sink *sink;
+    struct unpack_ctx ctx;
+    GThread     *thread;
+    GQueue      chunks;
+    int         ret;
+};
+
+struct tee_sink {
+    struct sink sink;
+    struct unpack_ctx *ctx;
+    struct sink *first;
+    struct tee_branch *branches;
+    int         nbranches;
+    GMutex      lock;
+    GCond       cond;
+    int         in_flight;
+    enum tee_state state;
+    /* a branch could not be written */
+    gboolean    failed;
+};
+
+static gpointer tee_branch_thread(gpointer data)
+{
+    struct tee_branch *b = data;
+    struct tee_sink *t = b->tee;
+    struct tee_chunk *c;
+    gboolean failed = FALSE;
+    enum tee_state state;
+
+    trace_thread_name("tee");
+    if (b->ctx.perf_counters) {
+        perf_thread_open();
+    }
+
+    g_mutex_lock(&t->lock);
+    for (;;) {
+        while (g_queue_is_empty(&b->chunks) && t->state == TEE_RUNNING) {
+            g_cond_wait(&t->cond, &t->lock);
+        }
+        c = g_queue_pop_head(&b->chunks);
+        if (!c) {
+            break;
+        }
+        /* the chunks left when aborting are only let go of */
+        if (!failed && t->state != TEE_ABORT) {
+            g_mutex_unlock(&t->lock);
+            failed = b->sink->write(b->sink, c->data, c->len) < 0;
+            g_mutex_lock(&t->lock);
+            t->failed |= failed;
+        }
+        if (--c->refs == 0) {
+            g_free(c);
+            t->in_flight--;
+        }
+        g_cond_broadcast(&t->cond);
+    }
+    state = t->state;
+    g_mutex_unlock(&t->lock);
+
+    if (state == TEE_FINISH && !failed) {
+        b->ret = b->sink->finish(b->sink);
+    } else {
+        b->sink->abort(b->sink);
+        b->ret = -1;
+    }
+    perf_thread_close();
+    return NULL;
+}
+
+static int tee_sink_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct tee_sink *t = (struct tee_sink *)sink;
+    struct tee_chunk *c;
+    struct unpack_cost start;
+    int i;
+
+    c = g_malloc(sizeof(*c) + len);
+    memcpy(c->data, buf, len);
+    c->len = len;
+    c->refs = t->nbranches;
+
+    g_mutex_lock(&t->lock);
+    if (t->in_flight >= TEE_MAX_CHUNKS && !t->failed) {
+        unpack_cost_begin(&start);
+        while (t->in_flight >= TEE_MAX_CHUNKS && !t->failed) {
+            g_cond_wait(&t->cond, &t->lock);
+        }
+        unpack_phase_end(t->ctx, UNPACK_PHASE_WRITE, &start);
+    }
+    if (t->failed) {
+        g_mutex_unlock(&t->lock);
+        g_free(c);
+        return -1;
+    }
+    for (i = 0; i < t->nbranches; i++) {
+        g_queue_push_tail(&t->branches[i].chunks, c);
+    }
+    t->in_flight++;
+    g_cond_broadcast(&t->cond);
+    g_mutex_unlock(&t->lock);
+
+    return t->first->write(t->first, buf, len);
+}
+
+/*
+ * Let the branches finish or abort, wait for them and free the tee. The
+ * outputs the branches staged are moved to staged.
+ */
+static int tee_sink_end(struct tee_sink *t, enum tee_state state,
+                        GArray *staged)
+{
+    struct tee_branch *b;
+    int i, ret = 0;
+
+    g_mutex_lock(&t->lock);
+    t->state = state;
+    g_cond_broadcast(&t->cond);
+    g_mutex_unlock(&t->lock);
+
+    for (i = 0; i < t->nbranches; i++) {
+        b = &t->branches[i];
+        g_thread_join(b->thread);
+        if (b->ret < 0) {
+            ret = -1;
+        }
+        g_array_append_vals(staged, b->ctx.staged_outputs->data,
+                            b->ctx.staged_outputs->len);
+        g_array_free(b->ctx.staged_outputs, TRUE);
+        unpack_ctx_merge(t->ctx, &b->ctx, 0);
+        unpack_ctx_clear(&b->ctx);
+    }
+    if (t->failed) {
+        ret = -1;
+    }
+    g_mutex_clear(&t->lock);
+    g_cond_clear(&t->cond);
+    g_free(t->branches);
+    g_free(t);
+    return ret;
+}
+
+/*
+ * Rename the staged outputs into place one after the other, or remove them
+ * all if ret is negative or a rename fails.
+ */
+static int tee_commit(struct unpack_ctx *ctx, GArray *staged, int ret)
+{
+    struct staged_output *s;
+    guint i;
+
+    for (i = 0; i < staged->len; i++) {
+        s = &g_array_index(staged, struct staged_output, i);
+        if (ret == 0 && rename(s->tmp_path, s->path) < 0) {
+            unpack_error(ctx, UNPACK_ERROR_IO,
+                         "%s: cannot write output file: %s", s->path,
+                         strerror(errno));
+            ret = -1;
+        }
+        if (ret < 0) {
+            unlink(s->tmp_path);
+        }
+        g_free(s->tmp_path);
+        g_free(s->path);
+    }
+    g_array_free(staged, TRUE);
+    return ret;
+}
+
+/*
+ * Every output is complete before any of them is renamed into place: the
+ * branches are joined first, then the first branch is finished, staging its
+ * output too unless a branch failed.
+ */
+static int tee_sink_finish(struct sink *sink)
+{
+    struct tee_sink *t = (struct tee_sink *)sink;
+    struct unpack_ctx *ctx = t->ctx;
+    struct sink *first = t->first;
+    GArray *staged = g_array_new(FALSE, FALSE, sizeof(struct staged_output));
+    int ret;
+
+    ret = tee_sink_end(t, TEE_FINISH, staged);
+    if (ret < 0) {
+        first->abort(first);
+    } else {
+        ctx->staged_outputs = staged;
+        ret = first->finish(first);
+        ctx->staged_outputs = NULL;
+    }
+    return tee_commit(ctx, staged, ret);
+}
+
+static void tee_sink_abort(struct sink *sink)
+{
+    struct tee_sink *t = (struct tee_sink *)sink;
+    struct unpack_ctx *ctx = t->ctx;
+    GArray *staged = g_array_new(FALSE, FALSE, sizeof(struct staged_output));
+
+    t->first->abort(t->first);
+    tee_sink_end(t, TEE_ABORT, staged);
+    tee_commit(ctx, staged, -1);
+}
+
+struct sink *tee_sink_new(struct unpack_ctx *ctx, int n, tee_open_fn open,
+                          gpointer data)
+{
+    struct tee_sink *t;
+    struct tee_branch *b;
+    gboolean ok;
+    int i, j;
+
+    t = g_new0(struct tee_sink, 1);
+    t->ctx = ctx;
+    t->nbranches = n - 1;
+    t->branches = g_new0(struct tee_branch, t->nbranches);
+    g_mutex_init(&t->lock);
+    g_cond_init(&t->cond);
+
+    t->first = open(ctx, 0, data);
+    ok = t->first != NULL;
+    for (i = 0; ok && i < t->nbranches; i++) {
+        b = &t->branches[i];
+        b->tee = t;
+        g_queue_init(&b->chunks);
+        unpack_ctx_init(&b->ctx, ctx->prog, ctx->input_file);
+        b->ctx.staged_outputs = g_array_new(FALSE, FALSE,
+                                            sizeof(struct staged_output));
+        b->ctx.quiet = ctx->quiet;
+        b->ctx.sparse = ctx->sparse;
+        b->ctx.if_changed = ctx->if_changed;
+        b->ctx.perf_counters = ctx->perf_counters;
+        b->ctx.output_codec = ctx->output_codec;
+        b->ctx.output_level = ctx->output_level;
+        b->sink = open(&b->ctx, i + 1, data);
+        ok = b->sink != NULL;
+    }
+
+    if (!ok) {
+        if (t->first) {
+            t->first->abort(t->first);
+        }
+        /* i is the number of branches tried */
+        for (j = 0; j < i; j++) {
+            if (t->branches[j].sink) {
+                t->branches[j].sink->abort(t->branches[j].sink);
+            }
+            g_array_free(t->branches[j].ctx.staged_outputs, TRUE);
+            unpack_ctx_merge(ctx, &t->branches[j].ctx, 0);
+            unpack_ctx_clear(&t->branches[j].ctx);
+        }
+        g_mutex_clear(&t->lock);
+        g_cond_clear(&t->cond);
+        g_free(t->branches);
+        g_free(t);
+        return NULL;
+    }
+
+    for (i = 0; i < t->nbranches; i++) {
+        t->branches[i].thread = g_thread_new("tee", tee_branch_thread,
+                                             &t->branches[i]);
+    }
+    t->sink.write = tee_sink_write;
+    t->sink.finish = tee_sink_finish;
+    t->sink.abort = tee_sink_abort;
+    return &t->sink;
+}
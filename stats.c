@@ -0,0 +1,285 @@
+/*
+ * Run statistics, for --stats
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "unzboot.h"
+
+static const char *const phase_names[UNPACK_N_PHASES] = {
+    [UNPACK_PHASE_LOAD] = "load",
+    [UNPACK_PHASE_HEADER] = "header",
+    [UNPACK_PHASE_INFLATE] = "inflate",
+    [UNPACK_PHASE_VERIFY] = "verify",
+    [UNPACK_PHASE_WRITE] = "write",
+};
+
+static const char *const event_names[UNPACK_N_EVENTS] = {
+    [UNPACK_EVENT_CYCLES] = "cycles",
+    [UNPACK_EVENT_INSTRUCTIONS] = "instructions",
+    [UNPACK_EVENT_BRANCH_MISSES] = "branch_misses",
+    [UNPACK_EVENT_LLC_MISSES] = "llc_misses",
+};
+
+const char *unpack_phase_name(enum unpack_phase phase)
+{
+    return phase_names[phase];
+}
+
+static double ns_to_ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+static double timeval_to_ms(const struct timeval *tv)
+{
+    return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+void json_append_string(GString *s, const char *str)
+{
+    const unsigned char *p;
+
+    g_string_append_c(s, '"');
+    for (p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            g_string_append_c(s, '\\');
+            g_string_append_c(s, *p);
+        } else if (*p < 0x20) {
+            g_string_append_printf(s, "\\u%04x", *p);
+        } else {
+            g_string_append_c(s, *p);
+        }
+    }
+    g_string_append_c(s, '"');
+}
+
+/* Instructions per cycle of a phase, or a negative value if unknown */
+static double phase_ipc(const struct unpack_cost *cost)
+{
+    if (!perf_event_available(UNPACK_EVENT_CYCLES) ||
+        !perf_event_available(UNPACK_EVENT_INSTRUCTIONS) ||
+        cost->events[UNPACK_EVENT_CYCLES] == 0) {
+        return -1;
+    }
+    return (double)cost->events[UNPACK_EVENT_INSTRUCTIONS] /
+           cost->events[UNPACK_EVENT_CYCLES];
+}
+
+static double per_byte(uint64_t count, uint64_t bytes)
+{
+    return bytes ? (double)count / bytes : 0;
+}
+
+static void json_append_perf(GString *s, const struct unpack_ctx *ctx)
+{
+    int i, j;
+
+    g_string_append(s, ",\"perf\":{");
+    for (i = 0; i < UNPACK_N_PHASES; i++) {
+        const struct unpack_cost *cost = &ctx->phase[i];
+        double ipc = phase_ipc(cost);
+
+        g_string_append_printf(s, "%s\"%s\":{", i ? "," : "",
+                               phase_names[i]);
+        for (j = 0; j < UNPACK_N_EVENTS; j++) {
+            if (perf_event_available(j)) {
+                g_string_append_printf(s, "\"%s\":%" G_GUINT64_FORMAT ",",
+                                       event_names[j], cost->events[j]);
+            } else {
+                g_string_append_printf(s, "\"%s\":null,", event_names[j]);
+            }
+        }
+        if (ipc >= 0) {
+            g_string_append_printf(s, "\"ipc\":%.3f", ipc);
+        } else {
+            g_string_append(s, "\"ipc\":null");
+        }
+        for (j = UNPACK_EVENT_BRANCH_MISSES; j <= UNPACK_EVENT_LLC_MISSES; j++) {
+            if (perf_event_available(j)) {
+                g_string_append_printf(s, ",\"%s_per_byte\":%.6f",
+                                       event_names[j],
+                                       per_byte(cost->events[j],
+                                                ctx->out_bytes));
+            } else {
+                g_string_append_printf(s, ",\"%s_per_byte\":null",
+                                       event_names[j]);
+            }
+        }
+        g_string_append_c(s, '}');
+    }
+    g_string_append_c(s, '}');
+}
+
+/* The digests computed of something, an empty object if there was none */
+static void json_append_digests(GString *s, const char *what,
+                                char *const digests[N_DIGESTS])
+{
+    const char *sep = "";
+    int i;
+
+    g_string_append_printf(s, ",\"%s_digests\":{", what);
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (digests[i]) {
+            g_string_append_printf(s, "%s\"%s\":\"%s\"", sep,
+                                   digest_names[i], digests[i]);
+            sep = ",";
+        }
+    }
+    g_string_append_c(s, '}');
+}
+
+void unpack_print_digests(const struct unpack_ctx *ctx, FILE *fp)
+{
+    int i;
+
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (ctx->payload_digest[i]) {
+            fprintf(fp, "%s: %s of the payload %s\n", ctx->prog,
+                    digest_names[i], ctx->payload_digest[i]);
+        }
+    }
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (ctx->kernel_digest[i]) {
+            fprintf(fp, "%s: %s of the kernel  %s\n", ctx->prog,
+                    digest_names[i], ctx->kernel_digest[i]);
+        }
+    }
+}
+
+static void print_perf(const struct unpack_ctx *ctx, FILE *fp)
+{
+    int i, j;
+
+    for (i = 0; i < UNPACK_N_PHASES; i++) {
+        const struct unpack_cost *cost = &ctx->phase[i];
+        double ipc = phase_ipc(cost);
+
+        fprintf(fp, "%s: phase %-8s", ctx->prog, phase_names[i]);
+        for (j = 0; j < UNPACK_N_EVENTS; j++) {
+            if (perf_event_available(j)) {
+                fprintf(fp, " %s %" G_GUINT64_FORMAT, event_names[j],
+                        cost->events[j]);
+            }
+        }
+        if (ipc >= 0) {
+            fprintf(fp, " ipc %.2f", ipc);
+        }
+        for (j = UNPACK_EVENT_BRANCH_MISSES; j <= UNPACK_EVENT_LLC_MISSES; j++) {
+            if (perf_event_available(j)) {
+                fprintf(fp, " %s/byte %.4f", event_names[j],
+                        per_byte(cost->events[j], ctx->out_bytes));
+            }
+        }
+        fputc('\n', fp);
+    }
+}
+
+static void print_json(const struct unpack_ctx *ctx, FILE *fp,
+                       uint64_t in_bytes, uint64_t wall_ns, double mbps,
+                       const struct rusage *ru, const struct zalloc_stats *z)
+{
+    GString *s = g_string_new("{\"input\":");
+    guint i;
+
+    json_append_string(s, ctx->input_file);
+    g_string_append_printf(s, ",\"bytes_in\":%" G_GUINT64_FORMAT
+                           ",\"bytes_out\":%" G_GUINT64_FORMAT
+                           ",\"sparse_bytes\":%" G_GUINT64_FORMAT
+                           ",\"unchanged_bytes\":%" G_GUINT64_FORMAT
+                           ",\"wall_ms\":%.3f,\"mb_per_s\":%.1f",
+                           in_bytes, ctx->out_bytes, ctx->sparse_bytes,
+                           ctx->unchanged_bytes,
+                           ns_to_ms(wall_ns), mbps);
+
+    g_string_append(s, ",\"phases_ms\":{");
+    for (i = 0; i < UNPACK_N_PHASES; i++) {
+        g_string_append_printf(s, "%s\"%s\":%.3f", i ? "," : "",
+                               phase_names[i], ns_to_ms(ctx->phase[i].ns));
+    }
+
+    g_string_append(s, "},\"layers\":[");
+    for (i = 0; i < ctx->layers->len; i++) {
+        const struct unpack_layer *l;
+
+        l = &g_array_index(ctx->layers, struct unpack_layer, i);
+        g_string_append_printf(s, "%s{\"format\":", i ? "," : "");
+        json_append_string(s, l->format);
+        g_string_append_printf(s, ",\"depth\":%d,\"bytes_in\":%"
+                               G_GUINT64_FORMAT ",\"bytes_out\":%"
+                               G_GUINT64_FORMAT "}",
+                               l->depth, l->in_bytes, l->out_bytes);
+    }
+
+    g_string_append_printf(s, "],\"rusage\":{\"max_rss_kb\":%ld,"
+                           "\"minor_faults\":%ld,\"major_faults\":%ld,"
+                           "\"user_ms\":%.3f,\"system_ms\":%.3f}",
+                           ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt,
+                           timeval_to_ms(&ru->ru_utime),
+                           timeval_to_ms(&ru->ru_stime));
+    g_string_append_printf(s, ",\"zalloc\":{\"allocs\":%" G_GUINT64_FORMAT
+                           ",\"frees\":%" G_GUINT64_FORMAT
+                           ",\"bytes\":%" G_GUINT64_FORMAT
+                           ",\"peak_bytes\":%" G_GUINT64_FORMAT "}",
+                           z->allocs, z->frees, z->bytes, z->peak_bytes);
+    if (ctx->perf_counters) {
+        json_append_perf(s, ctx);
+    }
+    if (ctx->digests) {
+        json_append_digests(s, "payload", ctx->payload_digest);
+        json_append_digests(s, "kernel", ctx->kernel_digest);
+    }
+    g_string_append_c(s, '}');
+
+    fprintf(fp, "%s\n", s->str);
+    g_string_free(s, TRUE);
+}
+
+static void print_text(const struct unpack_ctx *ctx, FILE *fp,
+                       uint64_t wall_ns, double mbps,
+                       const struct rusage *ru, const struct zalloc_stats *z)
+{
+    guint i;
+
+    unpack_ctx_print_layers(ctx, fp);
+    unpack_print_digests(ctx, fp);
+    for (i = 0; i < UNPACK_N_PHASES; i++) {
+        fprintf(fp, "%s: phase %-8s %10.3f ms\n", ctx->prog, phase_names[i],
+                ns_to_ms(ctx->phase[i].ns));
+    }
+    if (ctx->perf_counters) {
+        print_perf(ctx, fp);
+    }
+    fprintf(fp, "%s: total %.3f ms, %.1f MB/s\n", ctx->prog,
+            ns_to_ms(wall_ns), mbps);
+    fprintf(fp, "%s: peak RSS %ld KiB, %ld minor and %ld major page faults\n",
+            ctx->prog, ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt);
+    fprintf(fp, "%s: zlib allocated %" G_GUINT64_FORMAT " bytes in %"
+            G_GUINT64_FORMAT " blocks, %" G_GUINT64_FORMAT " bytes at most\n",
+            ctx->prog, z->bytes, z->allocs, z->peak_bytes);
+}
+
+void unpack_stats_print(const struct unpack_ctx *ctx, FILE *fp,
+                        gboolean json, uint64_t in_bytes, uint64_t wall_ns)
+{
+    struct zalloc_stats z;
+    struct rusage ru;
+    double mbps;
+
+    getrusage(RUSAGE_SELF, &ru);
+    codec_get_zalloc_stats(&z);
+    /* of output, which is what the time is spent on producing */
+    mbps = wall_ns ? ctx->out_bytes * 1e3 / wall_ns : 0;
+
+    if (json) {
+        print_json(ctx, fp, in_bytes, wall_ns, mbps, &ru, &z);
+    } else {
+        print_text(ctx, fp, wall_ns, mbps, &ru, &z);
+    }
+}
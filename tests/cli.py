@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+#
+# Tests of the unzboot command
+#
+# Copyright (c) 2023 Enric Balletbo i Serra
+#
+# SPDX-License-Identifier: MIT
+
+"""Run one test of the unzboot command, named by the first argument, on an
+image. Exits with 0 if it passes, and 1 with what went wrong otherwise."""
+
+import argparse
+import gzip
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+
+
+def extract(unzboot, image, output, *options):
+    subprocess.run([unzboot, *options, image, output], check=True,
+                   stdout=subprocess.DEVNULL)
+
+
+def read_file(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def test_pipe(args, tmp):
+    """The kernel written to a pipe, which can not seek, is the one written
+    to a file. The pipe is passed as a descriptor of its own, /dev/fd/N, so
+    that what unzboot prints does not end up in it."""
+    path = os.path.join(tmp, 'Image')
+    extract(args.unzboot, args.image, path)
+    expected = read_file(path)
+
+    r, w = os.pipe()
+    chunks = []
+    reader = threading.Thread(
+        target=lambda: chunks.extend(iter(lambda: os.read(r, 1 << 20), b'')))
+    reader.start()
+    proc = subprocess.run([args.unzboot, args.image, '/dev/fd/%d' % w],
+                          pass_fds=(w,), stdout=subprocess.DEVNULL)
+    os.close(w)
+    reader.join()
+    os.close(r)
+
+    if proc.returncode != 0:
+        return 'exited with %d writing to a pipe' % proc.returncode
+    if b''.join(chunks) != expected:
+        return 'the kernel written to a pipe differs'
+    return None
+
+
+def test_pack_lz4(args, tmp):
+    """A kernel smaller than a compressed lz4 block packed with lz4 is the
+    one unpacked again. The kernel of the image is cut to 3 MB for that."""
+    path = os.path.join(tmp, 'Image')
+    extract(args.unzboot, args.image, path)
+    kernel = read_file(path)[:3 << 20]
+    with open(path, 'wb') as f:
+        f.write(kernel)
+
+    packed = os.path.join(tmp, 'vmlinuz.efi')
+    proc = subprocess.run([args.unzboot, 'pack', '--compress=lz4', path,
+                           packed], stdout=subprocess.DEVNULL)
+    if proc.returncode != 0:
+        return 'exited with %d packing with lz4' % proc.returncode
+    unpacked = os.path.join(tmp, 'Image.unpacked')
+    extract(args.unzboot, packed, unpacked)
+    if read_file(unpacked) != kernel:
+        return 'the kernel unpacked from lz4 differs'
+    return None
+
+
+def test_tee(args, tmp):
+    """The kernel written to more files with --tee, as it is and compressed
+    with gzip, is the one written to a file on its own."""
+    path = os.path.join(tmp, 'Image')
+    extract(args.unzboot, args.image, path)
+    expected = read_file(path)
+
+    main = os.path.join(tmp, 'main')
+    copy = os.path.join(tmp, 'copy')
+    extract(args.unzboot, args.image, main, '--tee=' + copy,
+            '--tee=' + copy + '.gz')
+    if read_file(main) != expected:
+        return 'the output of a tee differs'
+    if read_file(copy) != expected:
+        return 'the file written by --tee differs'
+    if gzip.decompress(read_file(copy + '.gz')) != expected:
+        return 'the file written compressed by --tee differs'
+    return None
+
+
+def test_tee_fail(args, tmp):
+    """If a file of --tee can not be written, the command fails and leaves
+    no output behind, not even the complete ones. The kernel is cut to
+    200 KB and packed again, so that all of it is decoded before the failing
+    branch gets to write, a few times over as that is up to the threads."""
+    kernel = os.path.join(tmp, 'Image')
+    extract(args.unzboot, args.image, kernel)
+    with open(kernel, 'r+b') as f:
+        f.truncate(200 << 10)
+    image = os.path.join(tmp, 'small.efi')
+    subprocess.run([args.unzboot, 'pack', kernel, image], check=True,
+                   stdout=subprocess.DEVNULL)
+
+    outputs = os.path.join(tmp, 'out')
+    os.mkdir(outputs)
+    main = os.path.join(outputs, 'main')
+    for _ in range(5):
+        proc = subprocess.run([args.unzboot, '--tee=/dev/full', image, main],
+                              stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+        if proc.returncode == 0:
+            return 'writing to /dev/full succeeded'
+        if os.listdir(outputs):
+            return 'files left behind: %s' % ', '.join(os.listdir(outputs))
+    return None
+
+
+def test_digest(args, tmp):
+    """The SHA-256 digests printed by --digest are those of the zboot
+    payload and of the kernel, and --digest-files writes the one of the
+    kernel next to it in the format of sha256sum."""
+    image = read_file(args.image)
+    offset, size = struct.unpack_from('<II', image, 8)
+    payload = hashlib.sha256(image[offset:offset + size]).hexdigest()
+
+    path = os.path.join(tmp, 'Image')
+    proc = subprocess.run([args.unzboot, '--digest=sha256', args.image, path],
+                          check=True, capture_output=True, text=True)
+    kernel = hashlib.sha256(read_file(path)).hexdigest()
+    if 'sha256 of the payload ' + payload not in proc.stdout:
+        return 'the digest of the payload is not %s' % payload
+    if 'sha256 of the kernel  ' + kernel not in proc.stdout:
+        return 'the digest of the kernel is not %s' % kernel
+
+    extract(args.unzboot, args.image, path, '--digest=sha256',
+            '--digest-files')
+    if read_file(path + '.sha256') != ('%s  Image\n' % kernel).encode():
+        return 'Image.sha256 is not the digest of the kernel'
+    return None
+
+
+def test_if_changed(args, tmp):
+    """With --if-changed, an output that would not change is left as it is,
+    and one that was modified is unpacked again."""
+    path = os.path.join(tmp, 'Image')
+    extract(args.unzboot, args.image, path)
+    expected = read_file(path)
+    os.unlink(path)
+
+    extract(args.unzboot, args.image, path, '--if-changed')
+    if read_file(path) != expected:
+        return 'the kernel written with --if-changed differs'
+    before = os.stat(path)
+    extract(args.unzboot, args.image, path, '--if-changed')
+    after = os.stat(path)
+    if (after.st_ino, after.st_mtime_ns) != (before.st_ino,
+                                            before.st_mtime_ns):
+        return 'an output that would not change was written again'
+
+    with open(path, 'r+b') as f:
+        f.seek(len(expected) // 2)
+        f.write(b'unzboot')
+    extract(args.unzboot, args.image, path, '--if-changed')
+    if read_file(path) != expected:
+        return 'a modified output was not unpacked again'
+    return None
+
+
+# Run by unzboot --output-memfd: copy the kernel in fd 3 to a file, and
+# fail if the memfd can still be written to
+MEMFD_COMMAND = '''
+import os, shutil, sys
+with open('/proc/self/fd/3', 'rb') as src, open(sys.argv[1], 'wb') as dst:
+    shutil.copyfileobj(src, dst)
+try:
+    os.pwrite(3, b'unzboot', 0)
+except PermissionError:
+    sys.exit(0)
+sys.exit(3)
+'''
+
+
+def test_memfd(args, tmp):
+    """The kernel handed over as a sealed memfd by --output-memfd is the one
+    written to a file."""
+    path = os.path.join(tmp, 'Image')
+    extract(args.unzboot, args.image, path)
+    expected = read_file(path)
+
+    copy = os.path.join(tmp, 'memfd')
+    proc = subprocess.run([args.unzboot, '--output-memfd', args.image, '--',
+                           sys.executable, '-c', MEMFD_COMMAND, copy],
+                          stdout=subprocess.DEVNULL)
+    if proc.returncode == 3:
+        return 'the memfd is not sealed against writes'
+    if proc.returncode != 0:
+        return 'exited with %d handing over a memfd' % proc.returncode
+    if read_file(copy) != expected:
+        return 'the kernel in the memfd differs'
+    return None
+
+
+TESTS = {
+    'pipe': test_pipe,
+    'pack-lz4': test_pack_lz4,
+    'tee': test_tee,
+    'tee-fail': test_tee_fail,
+    'digest': test_digest,
+    'if-changed': test_if_changed,
+    'memfd': test_memfd,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('test', choices=sorted(TESTS))
+    parser.add_argument('unzboot')
+    parser.add_argument('image')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        error = TESTS[args.test](args, tmp)
+    if error:
+        print('%s: %s' % (args.test, error), file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
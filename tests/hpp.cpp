@@ -0,0 +1,159 @@
+/*
+ * Tests of the C++20 interface of libunzboot, libunzboot.hpp
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+#include "libunzboot.hpp"
+
+namespace {
+
+int failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+bool check(bool ok, const char *what, int line)
+{
+    if (!ok) {
+        std::fprintf(stderr, "hpp.cpp:%d: %s failed\n", line, what);
+        failures++;
+    }
+    return ok;
+}
+
+bool same(std::span<const std::byte> a, std::span<const std::byte> b)
+{
+    return std::ranges::equal(a, b);
+}
+
+/* Counts what is allocated through it and not given back yet */
+class counting_resource : public std::pmr::memory_resource {
+public:
+    std::size_t allocations = 0;
+    std::size_t outstanding = 0;
+
+private:
+    void *do_allocate(std::size_t size, std::size_t align) override
+    {
+        allocations++;
+        outstanding += size;
+        return std::pmr::new_delete_resource()->allocate(size, align);
+    }
+    void do_deallocate(void *p, std::size_t size, std::size_t align) override
+    {
+        outstanding -= size;
+        std::pmr::new_delete_resource()->deallocate(p, size, align);
+    }
+    bool do_is_equal(const memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+/* The kernel extracted at once, and into a buffer of the caller */
+void test_extract(libunzboot::context &u, std::span<const std::byte> kernel)
+{
+    std::vector<std::byte> buf(kernel.size());
+    libunzboot::image image = u.extract();
+
+    CHECK(same(image.bytes(), kernel));
+    CHECK(u.extract_to(buf) == kernel.size());
+    CHECK(same(buf, kernel));
+
+    buf.resize(4096);
+    try {
+        u.extract_to(buf);
+        CHECK(!"extract_to() fits the kernel in 4096 bytes");
+    } catch (const libunzboot::error &e) {
+        CHECK(e.status() == UNZBOOT_ERROR_NO_SPACE);
+    }
+}
+
+/* A generator dropped before the end stops the stream */
+void test_chunks(libunzboot::context &u, std::span<const std::byte> kernel)
+{
+    std::vector<std::byte> out;
+
+    for (std::span<const std::byte> chunk : u.chunks()) {
+        out.insert(out.end(), chunk.begin(), chunk.end());
+    }
+    CHECK(same(out, kernel));
+
+    for (std::span<const std::byte> chunk : u.chunks()) {
+        CHECK(chunk.size() < kernel.size());
+        CHECK(same(chunk, kernel.first(chunk.size())));
+        break;
+    }
+    CHECK(same(u.extract().bytes(), kernel));
+}
+
+/* The memory of extractions comes from the resource, all of it goes back */
+void test_memory_resource(const char *path, std::span<const std::byte> kernel)
+{
+    counting_resource counting;
+    std::pmr::monotonic_buffer_resource arena(1 << 20, &counting);
+
+    {
+        libunzboot::context u;
+
+        u.set_memory_resource(&counting);
+        u.open(path);
+        CHECK(same(u.extract().bytes(), kernel));
+        CHECK(counting.allocations > 0);
+    }
+    CHECK(counting.outstanding == 0);
+
+    {
+        libunzboot::context u;
+
+        u.set_memory_resource(&arena);
+        u.open(path);
+        CHECK(same(u.extract().bytes(), kernel));
+        u.set_memory_resource(nullptr);
+        CHECK(same(u.extract().bytes(), kernel));
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    libunzboot::context u;
+    std::vector<std::byte> kernel;
+
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: %s <image>\n", argv[0]);
+        return 2;
+    }
+
+    try {
+        u.open(std::string(argv[1]) + ".missing");
+        CHECK(!"open() of a missing file succeeds");
+    } catch (const libunzboot::error &e) {
+        CHECK(e.status() == UNZBOOT_ERROR_IO);
+    }
+
+    try {
+        u.open(argv[1]);
+        for (std::span<const std::byte> chunk : u.chunks()) {
+            kernel.insert(kernel.end(), chunk.begin(), chunk.end());
+        }
+        CHECK(!kernel.empty());
+
+        test_extract(u, kernel);
+        test_chunks(u, kernel);
+        test_memory_resource(argv[1], kernel);
+    } catch (const libunzboot::error &e) {
+        std::fprintf(stderr, "hpp.cpp: %s\n", e.what());
+        return 1;
+    }
+    return failures ? 1 : 0;
+}
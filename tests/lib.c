@@ -0,0 +1,267 @@
+/*
+ * Tests of libunzboot: the kernel of an image extracted through each entry
+ * point of the library is the same
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libunzboot.h"
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static int check(int ok, const char *what, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "lib.c:%d: %s failed\n", line, what);
+        failures++;
+    }
+    return ok;
+}
+
+#define CHECK_OK(u, call) check_status((u), (call), #call, __LINE__)
+
+static int check_status(unzboot *u, int status, const char *what, int line)
+{
+    if (status < 0) {
+        fprintf(stderr, "lib.c:%d: %s: %s: %s\n", line, what,
+                unzboot_strerror(status), unzboot_error_message(u));
+        failures++;
+    }
+    return status >= 0;
+}
+
+/* The output of an extraction, grown as it comes */
+struct output {
+    unsigned char   *buf;
+    size_t          len;
+    size_t          size;
+};
+
+static int output_write(void *opaque, const void *buf, size_t len)
+{
+    struct output *o = opaque;
+
+    if (o->len + len > o->size) {
+        o->size = (o->len + len) * 2;
+        o->buf = realloc(o->buf, o->size);
+        if (!o->buf) {
+            return -1;
+        }
+    }
+    memcpy(o->buf + o->len, buf, len);
+    o->len += len;
+    return 0;
+}
+
+static int stop_write(void *opaque, const void *buf, size_t len)
+{
+    (void)opaque;
+    (void)buf;
+    (void)len;
+    return 1;
+}
+
+static int read_file(const char *path, struct output *o)
+{
+    unsigned char buf[65536];
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        output_write(o, buf, n);
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+static int same(const struct output *o, const struct output *kernel)
+{
+    return o->len == kernel->len && memcmp(o->buf, kernel->buf, o->len) == 0;
+}
+
+/* The kernel in a file, which the other entry points are compared with */
+static void test_file(unzboot *u, const char *dir, struct output *kernel)
+{
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/Image", dir);
+    if (CHECK_OK(u, unzboot_extract_to_file(u, path))) {
+        CHECK(read_file(path, kernel) == 0);
+        CHECK(kernel->len > 0);
+    }
+    unlink(path);
+}
+
+static void test_callback(unzboot *u, const struct output *kernel)
+{
+    struct output o = { 0 };
+
+    if (CHECK_OK(u, unzboot_extract_to_callback(u, output_write, &o))) {
+        CHECK(same(&o, kernel));
+    }
+    free(o.buf);
+
+    CHECK(unzboot_extract_to_callback(u, stop_write, NULL) ==
+          UNZBOOT_ERROR_CALLBACK);
+}
+
+/* Asked for more room, the buffer is resized to what is needed */
+static void test_buffer(unzboot *u, const struct output *kernel)
+{
+    struct output o = { 0 };
+    struct unzboot_info info;
+    size_t len = 0;
+
+    CHECK(unzboot_extract_to_buffer(u, NULL, 0, &len) ==
+          UNZBOOT_ERROR_NO_SPACE);
+    CHECK(len == kernel->len);
+
+    o.size = 4096;
+    o.buf = malloc(o.size);
+    CHECK(unzboot_extract_to_buffer(u, o.buf, o.size, &len) ==
+          UNZBOOT_ERROR_NO_SPACE);
+    if (CHECK(len == kernel->len)) {
+        o.size = len;
+        o.buf = realloc(o.buf, o.size);
+        if (CHECK_OK(u, unzboot_extract_to_buffer(u, o.buf, o.size,
+                                                  &o.len))) {
+            CHECK(same(&o, kernel));
+        }
+    }
+    free(o.buf);
+
+    if (CHECK_OK(u, unzboot_inspect(u, &info))) {
+        CHECK(info.kernel_size == kernel->len);
+    }
+}
+
+static void test_stream(unzboot *u, const struct output *kernel)
+{
+    struct output o = { 0 };
+    const void *chunk;
+    size_t len;
+    int ret;
+
+    if (CHECK_OK(u, unzboot_stream_begin(u))) {
+        while ((ret = unzboot_stream_next(u, &chunk, &len)) == 1) {
+            output_write(&o, chunk, len);
+        }
+        if (CHECK_OK(u, ret)) {
+            CHECK(same(&o, kernel));
+        }
+    }
+    free(o.buf);
+
+    /* stopped after the first piece, the next extraction is whole */
+    if (CHECK_OK(u, unzboot_stream_begin(u))) {
+        CHECK(unzboot_stream_next(u, &chunk, &len) == 1);
+        unzboot_stream_end(u);
+    }
+}
+
+static void test_map(unzboot *u, const struct output *kernel)
+{
+    const void *addr;
+    size_t len;
+
+    if (CHECK_OK(u, unzboot_map_begin(u, &addr, &len))) {
+        CHECK(len == kernel->len);
+        /* the last page first, the decoder has to get there */
+        CHECK(memcmp((const char *)addr + len - 1,
+                     kernel->buf + kernel->len - 1, 1) == 0);
+        if (CHECK_OK(u, unzboot_map_wait(u))) {
+            CHECK(len == kernel->len && memcmp(addr, kernel->buf, len) == 0);
+        }
+        unzboot_map_end(u);
+    }
+
+    /* ended while it is decoded */
+    if (CHECK_OK(u, unzboot_map_begin(u, &addr, &len))) {
+        unzboot_map_end(u);
+    }
+}
+
+/*
+ * Without userfaultfd, the kernel is extracted before the mapping is
+ * returned. A seccomp filter makes it fail, which can not be undone: this
+ * is the last test.
+ */
+static void test_map_fallback(unzboot *u, const struct output *kernel)
+{
+#ifdef SYS_userfaultfd
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_userfaultfd, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(filter) / sizeof(filter[0]),
+        .filter = filter,
+    };
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0 ||
+        prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0) {
+        fprintf(stderr, "skipping the map fallback: %s\n", strerror(errno));
+        return;
+    }
+    test_map(u, kernel);
+#else
+    (void)u;
+    (void)kernel;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/unzboot-test-XXXXXX";
+    struct output kernel = { 0 };
+    unzboot *u;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <image>\n", argv[0]);
+        return 2;
+    }
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    u = unzboot_new();
+    if (!CHECK_OK(u, unzboot_open_file(u, argv[1]))) {
+        return 1;
+    }
+    test_file(u, dir, &kernel);
+    rmdir(dir);
+    if (kernel.len == 0) {
+        return 1;
+    }
+    test_callback(u, &kernel);
+    test_buffer(u, &kernel);
+    test_stream(u, &kernel);
+    test_map(u, &kernel);
+    test_map_fallback(u, &kernel);
+    unzboot_free(u);
+
+    free(kernel.buf);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Chrome trace event output, for --trace
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "unzboot.h"
+
+/*
+ * Spans are written as complete ("X") events of the JSON array format, one
+ * per line, which ui.perfetto.dev and chrome://tracing both load. Every
+ * thread is a track of its own, named with trace_thread_name().
+ *
+ * https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+ */
+gboolean trace_enabled;
+
+static FILE *trace_fp;
+static GMutex trace_lock;
+static uint64_t trace_start_ns;
+static int trace_pid;
+
+static _Thread_local int trace_tid;
+
+static int trace_gettid(void)
+{
+    if (!trace_tid) {
+        trace_tid = syscall(SYS_gettid);
+    }
+    return trace_tid;
+}
+
+static void trace_metadata(const char *what, const char *name)
+{
+    GString *s = g_string_new(NULL);
+
+    g_string_append_printf(s, "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,"
+                           "\"tid\":%d,\"args\":{\"name\":", what, trace_pid,
+                           trace_gettid());
+    json_append_string(s, name);
+    g_string_append(s, "}},\n");
+
+    g_mutex_lock(&trace_lock);
+    fputs(s->str, trace_fp);
+    g_mutex_unlock(&trace_lock);
+    g_string_free(s, TRUE);
+}
+
+int trace_open(const char *prog, const char *path, const char *input_file)
+{
+    trace_fp = fopen(path, "we");
+    if (!trace_fp) {
+        fprintf(stderr, "%s: %s: cannot write trace: %s\n", prog, path,
+                strerror(errno));
+        return -1;
+    }
+    trace_start_ns = unpack_clock_ns();
+    trace_pid = getpid();
+    trace_enabled = TRUE;
+
+    fputs("[\n", trace_fp);
+    trace_metadata("process_name", input_file);
+    trace_thread_name("main");
+    return 0;
+}
+
+void trace_close(void)
+{
+    if (!trace_fp) {
+        return;
+    }
+    trace_enabled = FALSE;
+    /* every event is followed by a comma, the last one closes the array */
+    fprintf(trace_fp, "{\"name\":\"end\",\"ph\":\"i\",\"s\":\"g\","
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}\n]\n",
+            (unpack_clock_ns() - trace_start_ns) / 1e3, trace_pid,
+            trace_gettid());
+    fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+void trace_thread_name(const char *name)
+{
+    if (trace_enabled) {
+        trace_metadata("thread_name", name);
+    }
+}
+
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+    int tid = trace_gettid();
+
+    g_mutex_lock(&trace_lock);
+    fprintf(trace_fp, "{\"name\":\"%s\",\"cat\":\"unzboot\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n", name,
+            (start_ns - trace_start_ns) / 1e3, (end_ns - start_ns) / 1e3,
+            trace_pid, tid);
+    g_mutex_unlock(&trace_lock);
+}
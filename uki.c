@@ -0,0 +1,181 @@
+/*
+ * Unified Kernel Image extraction
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pe.h"
+#include "unzboot.h"
+
+/*
+ * Unified Kernel Images (UKI) are PE/COFF executables that carry the kernel
+ * in a .linux section, next to the initrd, the kernel command line and other
+ * resources in sections of their own.
+ *
+ * https://uapi-group.org/specifications/specs/unified_kernel_image/
+ *
+ * Each section is extracted by its own thread from the single mapping of the
+ * input file, to an output file named after the section.
+ */
+struct uki_task {
+    struct unpack_ctx ctx;
+    const struct pe_section *section;
+    char *output_file;
+    int ret;
+};
+
+static int uki_extract_linux(struct uki_task *task)
+{
+    const struct pe_section *sec = task->section;
+    struct sink *out;
+
+    out = output_sink_new(&task->ctx, task->output_file);
+    if (!out) {
+        return -1;
+    }
+    return unpack_image(&task->ctx, sec->data, sec->size, out, TRUE);
+}
+
+static int uki_extract_initrd(struct uki_task *task)
+{
+    const struct pe_section *sec = task->section;
+    struct sink *out;
+
+    out = file_sink_new(&task->ctx, task->output_file);
+    if (!out) {
+        return -1;
+    }
+    /* compressed initrds are decoded, any other format is extracted as is */
+    task->ctx.recursive = TRUE;
+    return unpack_image(&task->ctx, sec->data, sec->size, out, FALSE);
+}
+
+static int uki_extract_raw(struct uki_task *task)
+{
+    const struct pe_section *sec = task->section;
+    struct sink *out;
+
+    out = file_sink_new(&task->ctx, task->output_file);
+    if (!out) {
+        return -1;
+    }
+    return sink_write_all(out, sec->data, sec->size);
+}
+
+static const struct {
+    const char *name;
+    const char *suffix;
+    int (*extract)(struct uki_task *task);
+} uki_sections[] = {
+    { ".linux",     NULL,           uki_extract_linux },
+    { ".initrd",    ".initrd",      uki_extract_initrd },
+    { ".cmdline",   ".cmdline",     uki_extract_raw },
+    { ".osrel",     ".osrel",       uki_extract_raw },
+    { ".dtb",       ".dtb",         uki_extract_raw },
+    { ".uname",     ".uname",       uki_extract_raw },
+    { ".splash",    ".splash",      uki_extract_raw },
+};
+
+static gpointer uki_task_thread(gpointer data)
+{
+    struct uki_task *task = data;
+    size_t i;
+
+    trace_thread_name(task->section->name);
+    /* hardware events are counted per thread */
+    if (task->ctx.perf_counters) {
+        perf_thread_open();
+    }
+    for (i = 0; i < G_N_ELEMENTS(uki_sections); i++) {
+        if (strcmp(uki_sections[i].name, task->section->name) == 0) {
+            task->ret = uki_sections[i].extract(task);
+            break;
+        }
+    }
+    if (task->ret < 0) {
+        unpack_error(&task->ctx, UNPACK_ERROR_FAILED,
+                     "%s: cannot extract %s section", task->ctx.input_file,
+                     task->section->name);
+    }
+    perf_thread_close();
+    return NULL;
+}
+
+int unpack_uki_image(struct unpack_ctx *ctx, const char *output_file,
+                     const uint8_t *image, size_t size)
+{
+    struct pe_section *sections;
+    struct uki_task tasks[G_N_ELEMENTS(uki_sections)];
+    GThread *threads[G_N_ELEMENTS(uki_sections)];
+    struct unpack_layer uki = { .format = "uki", .in_bytes = size };
+    int count, ntasks = 0, ret = 1;
+    struct unpack_cost start;
+    size_t i;
+
+    unpack_cost_begin(&start);
+    count = pe_parse_sections(image, size, &sections);
+    unpack_phase_end(ctx, UNPACK_PHASE_HEADER, &start);
+    if (count < 0) {
+        return 0;
+    }
+    if (!pe_find_section(sections, count, ".linux")) {
+        g_free(sections);
+        return 0;
+    }
+
+    if (!ctx->quiet) {
+        fprintf(stdout, "%s: found Unified Kernel Image\n", ctx->prog);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(uki_sections); i++) {
+        const struct pe_section *sec;
+        struct uki_task *task = &tasks[ntasks];
+
+        sec = pe_find_section(sections, count, uki_sections[i].name);
+        /* only the kernel goes to a file descriptor */
+        if (!sec || (ctx->output_fd >= 0 && uki_sections[i].suffix)) {
+            continue;
+        }
+        unpack_ctx_init(&task->ctx, ctx->prog, ctx->input_file);
+        task->ctx.recursive = ctx->recursive;
+        task->ctx.max_depth = ctx->max_depth;
+        task->ctx.sparse = ctx->sparse;
+        task->ctx.if_changed = ctx->if_changed;
+        task->ctx.perf_counters = ctx->perf_counters;
+        task->ctx.output_codec = ctx->output_codec;
+        task->ctx.output_level = ctx->output_level;
+        task->ctx.tee_files = ctx->tee_files;
+        task->ctx.output_fd = ctx->output_fd;
+        task->ctx.digests = ctx->digests;
+        task->ctx.quiet = ctx->quiet;
+        task->section = sec;
+        task->output_file = uki_sections[i].suffix ?
+            g_strdup_printf("%s%s", output_file, uki_sections[i].suffix) :
+            g_strdup(output_file);
+        task->ret = 0;
+        uki.out_bytes += sec->size;
+        threads[ntasks] = g_thread_new(sec->name, uki_task_thread, task);
+        ntasks++;
+    }
+
+    /* the layers peeled from each section are nested in the UKI one */
+    g_array_append_val(ctx->layers, uki);
+    for (i = 0; i < (size_t)ntasks; i++) {
+        g_thread_join(threads[i]);
+        if (tasks[i].ret < 0) {
+            ret = -1;
+        }
+        unpack_ctx_merge(ctx, &tasks[i].ctx, 1);
+        unpack_ctx_clear(&tasks[i].ctx);
+        g_free(tasks[i].output_file);
+    }
+
+    g_free(sections);
+    return ret;
+}
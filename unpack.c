@@ -0,0 +1,1383 @@
+/*
+ * Extract a kernel vmlinuz image from a EFI application that carries the actual kernel image in compressed form
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * Unpack EFI zboot image functionality in this file is derived from qemu:
+ *
+ * Copyright (c) 2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Gunzip functionality in this file is derived from u-boot:
+ *
+ * (C) Copyright 2008 Semihalf
+ *
+ * (C) Copyright 2000-2005
+ * Wolfgang Denk, DENX Software Engineering, wd@denx.de.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <glib.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "unzboot.h"
+
+G_DEFINE_QUARK(unpack-error-quark, unpack_error)
+
+#define TAR_BLOCK_SIZE      512
+#define TAR_MAGIC_OFFSET    257
+
+/* Enough leading bytes to tell all the supported formats apart */
+#define PROBE_SIZE          TAR_BLOCK_SIZE
+
+/* The leading bytes read to tell whether the input is a kernel image already */
+#define PASSTHROUGH_PROBE_SIZE  4096
+
+/* Input fed at a time to a scan candidate, until it decodes PROBE_SIZE bytes */
+#define SCAN_TRIAL_CHUNK_SIZE   (64 * 1024)
+
+#define le_bswap(v, size) (v)
+
+static inline int ldl_he_p(const void *ptr)
+{
+    int32_t r;
+    memcpy(&r, ptr, sizeof(r));
+    return r;
+}
+
+static inline int ldl_le_p(const void *ptr)
+{
+    return le_bswap(ldl_he_p(ptr), 32);
+}
+
+void unpack_ctx_init(struct unpack_ctx *ctx, const char *prog,
+                     const char *input_file)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->prog = prog;
+    ctx->input_file = input_file;
+    ctx->max_depth = UNPACK_DEFAULT_MAX_DEPTH;
+    ctx->sparse = TRUE;
+    ctx->output_fd = -1;
+    ctx->layers = g_array_new(FALSE, TRUE, sizeof(struct unpack_layer));
+}
+
+void unpack_ctx_clear(struct unpack_ctx *ctx)
+{
+    int i;
+
+    g_array_free(ctx->layers, TRUE);
+    g_clear_error(&ctx->error);
+    for (i = 0; i < N_DIGESTS; i++) {
+        g_free(ctx->payload_digest[i]);
+        g_free(ctx->kernel_digest[i]);
+    }
+}
+
+void *unpack_alloc(const struct unpack_allocator *a, size_t size)
+{
+    void *ptr;
+
+    if (!a) {
+        return g_malloc(size);
+    }
+    ptr = a->alloc(a->opaque, size, UNPACK_ALLOC_ALIGN);
+    if (!ptr && size) {
+        /* as g_malloc() does, nothing here can do without the memory */
+        g_error("%s: failed to allocate %zu bytes", G_STRLOC, size);
+    }
+    return ptr;
+}
+
+void *unpack_alloc0(const struct unpack_allocator *a, size_t size)
+{
+    return memset(unpack_alloc(a, size), 0, size);
+}
+
+void unpack_free(const struct unpack_allocator *a, void *ptr, size_t size)
+{
+    if (!a) {
+        g_free(ptr);
+    } else if (ptr) {
+        a->free(a->opaque, ptr, size, UNPACK_ALLOC_ALIGN);
+    }
+}
+
+void unpack_buf_append(const struct unpack_allocator *a, struct unpack_buf *b,
+                       const uint8_t *data, size_t len)
+{
+    uint8_t *grown;
+    size_t size;
+
+    if (b->len + len > b->size) {
+        size = MAX(b->len + len, MAX(b->size * 2, 4096));
+        grown = unpack_alloc(a, size);
+        if (b->len) {
+            memcpy(grown, b->data, b->len);
+        }
+        unpack_free(a, b->data, b->size);
+        b->data = grown;
+        b->size = size;
+    }
+    if (len) {
+        memcpy(b->data + b->len, data, len);
+    }
+    b->len += len;
+}
+
+void unpack_buf_clear(const struct unpack_allocator *a, struct unpack_buf *b)
+{
+    unpack_free(a, b->data, b->size);
+    memset(b, 0, sizeof(*b));
+}
+
+void unpack_error(struct unpack_ctx *ctx, int code, const char *format, ...)
+{
+    GError *error;
+    va_list ap;
+
+    va_start(ap, format);
+    error = g_error_new_valist(UNPACK_ERROR, code, format, ap);
+    va_end(ap);
+
+    if (!ctx->quiet) {
+        fprintf(stderr, "%s: %s\n", ctx->prog, error->message);
+    }
+    if (!ctx->error) {
+        ctx->error = error;
+    } else {
+        g_error_free(error);
+    }
+}
+
+void unpack_ctx_print_layers(const struct unpack_ctx *ctx, FILE *fp)
+{
+    guint i;
+
+    for (i = 0; i < ctx->layers->len; i++) {
+        const struct unpack_layer *l;
+        char *label;
+
+        l = &g_array_index(ctx->layers, struct unpack_layer, i);
+        label = g_strdup_printf("%*s%s", 2 * l->depth, "", l->format);
+        fprintf(fp, "%s: layer %u: %-12s %12" G_GUINT64_FORMAT
+                " bytes in, %12" G_GUINT64_FORMAT " bytes out\n", ctx->prog,
+                i, label, l->in_bytes, l->out_bytes);
+        g_free(label);
+    }
+    if (ctx->sparse_bytes) {
+        fprintf(fp, "%s: %" G_GUINT64_FORMAT " bytes of zeros left as holes\n",
+                ctx->prog, ctx->sparse_bytes);
+    }
+    if (ctx->unchanged_bytes) {
+        fprintf(fp, "%s: %" G_GUINT64_FORMAT " bytes of output left "
+                "unchanged\n", ctx->prog, ctx->unchanged_bytes);
+    }
+}
+
+void unpack_ctx_merge(struct unpack_ctx *ctx, const struct unpack_ctx *part,
+                      int depth)
+{
+    guint i;
+
+    for (i = 0; i < part->layers->len; i++) {
+        struct unpack_layer l;
+
+        l = g_array_index(part->layers, struct unpack_layer, i);
+        l.depth += depth;
+        g_array_append_val(ctx->layers, l);
+    }
+    for (i = 0; i < UNPACK_N_PHASES; i++) {
+        unpack_cost_add(&ctx->phase[i], &part->phase[i]);
+    }
+    ctx->sparse_bytes += part->sparse_bytes;
+    ctx->out_bytes += part->out_bytes;
+    ctx->unchanged_bytes += part->unchanged_bytes;
+    if (!ctx->error && part->error) {
+        ctx->error = g_error_copy(part->error);
+    }
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (!ctx->payload_digest[i]) {
+            ctx->payload_digest[i] = g_strdup(part->payload_digest[i]);
+        }
+        if (!ctx->kernel_digest[i]) {
+            ctx->kernel_digest[i] = g_strdup(part->kernel_digest[i]);
+        }
+    }
+}
+
+int sink_write_chunked(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        size_t n = MIN(len, UNPACK_CHUNK_SIZE);
+
+        if (sink->write(sink, buf, n) < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int sink_copy_from(struct sink *sink, int fd, uint64_t size)
+{
+    uint8_t *buf;
+    uint64_t off = 0;
+    ssize_t n;
+
+    if (sink->copy_from) {
+        if (sink->copy_from(sink, fd, size) < 0) {
+            sink->abort(sink);
+            return -1;
+        }
+        return sink->finish(sink);
+    }
+
+    buf = g_malloc(UNPACK_CHUNK_SIZE);
+    while (off < size) {
+        n = pread(fd, buf, MIN(size - off, UNPACK_CHUNK_SIZE), off);
+        if (n <= 0 || sink->write(sink, buf, n) < 0) {
+            g_free(buf);
+            sink->abort(sink);
+            return -1;
+        }
+        off += n;
+    }
+    g_free(buf);
+    return sink->finish(sink);
+}
+
+int sink_write_all(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    if (sink_write_chunked(sink, buf, len) < 0) {
+        sink->abort(sink);
+        return -1;
+    }
+    return sink->finish(sink);
+}
+
+/*
+ * Every format found in the input is peeled by a layer, a sink that decodes
+ * the data written to it and writes the result to the next sink.
+ */
+struct layer {
+    struct sink         sink;
+    struct unpack_ctx   *ctx;
+    struct sink         *next;
+    int                 depth;
+    guint               index;      /* in ctx->layers */
+    size_t              size;       /* of the whole layer, to free it */
+};
+
+static struct unpack_layer *layer_stats(struct layer *l)
+{
+    return &g_array_index(l->ctx->layers, struct unpack_layer, l->index);
+}
+
+/* Allocate a layer of size bytes, starting with a struct layer */
+static void *layer_new(struct unpack_ctx *ctx, size_t size, struct sink *next,
+                       int depth, const char *format)
+{
+    struct unpack_layer stats = { .format = format, .depth = depth };
+    struct layer *l = unpack_alloc0(ctx->alloc, size);
+
+    l->size = size;
+    l->ctx = ctx;
+    l->next = next;
+    l->depth = depth;
+    l->index = ctx->layers->len;
+    g_array_append_val(ctx->layers, stats);
+    UNZBOOT_PROBE2(header, format, depth);
+    return l;
+}
+
+static int layer_emit(struct layer *l, const uint8_t *buf, size_t len)
+{
+    layer_stats(l)->out_bytes += len;
+    return l->next->write(l->next, buf, len);
+}
+
+static int layer_finish(struct layer *l)
+{
+    int ret = l->next->finish(l->next);
+
+    unpack_free(l->ctx->alloc, l, l->size);
+    return ret;
+}
+
+static void layer_abort(struct sink *sink)
+{
+    struct layer *l = (struct layer *)sink;
+
+    l->next->abort(l->next);
+    unpack_free(l->ctx->alloc, l, l->size);
+}
+
+static struct sink *probe_new(struct unpack_ctx *ctx, struct sink *out,
+                              int depth, gboolean expect_kernel,
+                              gboolean in_zboot);
+
+/*
+ * The kernel image itself, the innermost layer when a kernel is expected.
+ */
+static int kernel_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct layer *l = (struct layer *)sink;
+
+    layer_stats(l)->in_bytes += len;
+    return layer_emit(l, buf, len);
+}
+
+static int kernel_finish(struct sink *sink)
+{
+    return layer_finish((struct layer *)sink);
+}
+
+static struct sink *kernel_new(struct unpack_ctx *ctx, struct sink *out,
+                               int depth, const char *arch)
+{
+    struct layer *l = layer_new(ctx, sizeof(*l), out, depth, arch);
+
+    l->sink.write = kernel_write;
+    l->sink.finish = kernel_finish;
+    l->sink.abort = layer_abort;
+    return &l->sink;
+}
+
+/*
+ * The kernel builds every zboot payload but gzip with the *_with_size
+ * commands of Makefile.zboot, which append the size of the kernel as a
+ * 32-bit little endian value that is not part of the compressed stream.
+ */
+static size_t zboot_trailer_size(const struct codec *codec)
+{
+    return codec == &codecs[CODEC_GZIP] ? 0 : 4;
+}
+
+/*
+ * A Linux EFI zboot image: forward the compressed payload described by the
+ * header to the next layer, without its size trailer, and drop everything
+ * else. The whole payload is hashed on the way for --digest.
+ */
+struct zboot_layer {
+    struct layer    l;
+    uint64_t        offset;         /* of the stream written so far */
+    uint64_t        ploff;
+    uint64_t        plend;
+    uint64_t        stream_end;     /* of the compressed stream in it */
+    struct digest   *digest[N_DIGESTS];
+};
+
+static void zboot_free_digests(struct zboot_layer *z)
+{
+    int i;
+
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (z->digest[i]) {
+            digest_free(z->digest[i]);
+        }
+    }
+}
+
+static int zboot_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct zboot_layer *z = (struct zboot_layer *)sink;
+    uint64_t start = z->offset, end = z->offset + len;
+    int i;
+
+    layer_stats(&z->l)->in_bytes += len;
+    z->offset = end;
+
+    start = MAX(start, z->ploff);
+    end = MIN(end, z->plend);
+    if (start >= end) {
+        return 0;
+    }
+    buf += start - (z->offset - len);
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (z->digest[i]) {
+            digest_update(z->digest[i], buf, end - start);
+        }
+    }
+    end = MIN(end, z->stream_end);
+    if (start >= end) {
+        return 0;
+    }
+    return layer_emit(&z->l, buf, end - start);
+}
+
+static void zboot_abort(struct sink *sink)
+{
+    zboot_free_digests((struct zboot_layer *)sink);
+    layer_abort(sink);
+}
+
+static int zboot_finish(struct sink *sink)
+{
+    struct zboot_layer *z = (struct zboot_layer *)sink;
+    struct unpack_ctx *ctx = z->l.ctx;
+    int i;
+
+    if (z->offset < z->plend) {
+        unpack_error(ctx, UNPACK_ERROR_CORRUPT,
+                     "%s: unable to handle corrupt EFI zboot image",
+                     ctx->input_file);
+        zboot_abort(sink);
+        return -1;
+    }
+    /* the outermost payload, whose layer finishes first, is the one kept */
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (z->digest[i] && !ctx->payload_digest[i]) {
+            ctx->payload_digest[i] = digest_finish(z->digest[i]);
+        } else if (z->digest[i]) {
+            digest_free(z->digest[i]);
+        }
+    }
+    return layer_finish(&z->l);
+}
+
+/*
+ * Check the header of a Linux EFI zboot image and create the layer that
+ * extracts its payload, which is decompressed by the layers behind it.
+ */
+static struct sink *unpack_efi_zboot_image(struct unpack_ctx *ctx,
+                                           const uint8_t *buf,
+                                           struct sink *out, int depth,
+                                           gboolean expect_kernel)
+{
+    const struct linux_efi_zboot_header *header;
+    const struct codec *codec;
+    char type[sizeof(header->compression_type) + 1];
+    struct zboot_layer *z;
+    int ploff, plsize, i;
+
+    header = (const struct linux_efi_zboot_header *)buf;
+
+    memcpy(type, header->compression_type, sizeof(header->compression_type));
+    type[sizeof(header->compression_type)] = '\0';
+    codec = codec_from_zboot_type(header->compression_type,
+                                  sizeof(header->compression_type));
+    if (!codec || !codec->ops) {
+        unpack_error(ctx, UNPACK_ERROR_UNSUPPORTED,
+                     "%s: unable to handle EFI zboot image with \"%s\" "
+                     "compression", ctx->input_file, type);
+        return NULL;
+    }
+
+    ploff = ldl_le_p(&header->payload_offset);
+    plsize = ldl_le_p(&header->payload_size);
+    UNZBOOT_PROBE3(zboot_header, type, ploff, plsize);
+
+    if (ploff < 0 || plsize < 0 || (size_t)ploff < sizeof(*header) ||
+        (size_t)plsize < zboot_trailer_size(codec)) {
+        unpack_error(ctx, UNPACK_ERROR_CORRUPT,
+                     "%s: unable to handle corrupt EFI zboot image",
+                     ctx->input_file);
+        return NULL;
+    }
+
+    z = layer_new(ctx, sizeof(*z), NULL, depth, "zboot");
+    z->l.next = probe_new(ctx, out, depth + 1, expect_kernel, TRUE);
+    z->l.sink.write = zboot_write;
+    z->l.sink.finish = zboot_finish;
+    z->l.sink.abort = zboot_abort;
+    z->ploff = ploff;
+    z->plend = (uint64_t)ploff + plsize;
+    z->stream_end = z->plend - zboot_trailer_size(codec);
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (ctx->digests & (1 << i)) {
+            z->digest[i] = digest_new(i);
+        }
+    }
+    return &z->l.sink;
+}
+
+/*
+ * A compressed stream, decoded by the decoder of its format.
+ */
+struct codec_layer {
+    struct layer            l;
+    const struct decoder_ops *ops;
+    void                    *state;
+    /*
+     * input the decoder could not make progress with yet, and a buffer to
+     * swap it with, so that it is carried over without new allocations
+     */
+    struct unpack_buf       pending;
+    struct unpack_buf       spare;
+    gboolean                ended;
+    uint8_t                 *chunk;
+};
+
+/*
+ * Decode as much of buf as possible. What the decoder leaves unconsumed,
+ * like a header split across writes, is kept until the next write.
+ */
+static int codec_decode(struct codec_layer *c, const uint8_t *buf, size_t len,
+                        gboolean eof)
+{
+    struct unpack_ctx *ctx = c->l.ctx;
+    GError *error = NULL;
+    uint8_t *out;
+    size_t outlen, inlen;
+    struct unpack_cost start, verify;
+    int r;
+
+    while (!c->ended) {
+        out = c->chunk;
+        outlen = UNPACK_CHUNK_SIZE;
+        inlen = len;
+        unpack_cost_begin(&start);
+        UNZBOOT_PROBE2(inflate_start, layer_stats(&c->l)->format, len);
+        r = c->ops->decode(c->state, &buf, &len, &out, &outlen, eof, &error);
+        UNZBOOT_PROBE3(inflate_end, layer_stats(&c->l)->format, inlen - len,
+                       UNPACK_CHUNK_SIZE - outlen);
+        /* the checksums are verified while decoding */
+        codec_take_verify_cost(&verify);
+        unpack_phase_end(ctx, UNPACK_PHASE_INFLATE, &start);
+        unpack_cost_sub(&ctx->phase[UNPACK_PHASE_INFLATE], &verify);
+        unpack_cost_add(&ctx->phase[UNPACK_PHASE_VERIFY], &verify);
+        if (r < 0) {
+            unpack_error(ctx, error->domain == UNPACK_ERROR ? error->code :
+                         UNPACK_ERROR_FAILED, "%s: %s", ctx->input_file,
+                         error->message);
+            g_error_free(error);
+            return -1;
+        }
+        if (outlen < UNPACK_CHUNK_SIZE &&
+            layer_emit(&c->l, c->chunk, UNPACK_CHUNK_SIZE - outlen) < 0) {
+            return -1;
+        }
+        if (r == 1) {
+            /* whatever follows the stream is ignored */
+            c->ended = TRUE;
+            break;
+        }
+        if (len == inlen && outlen == UNPACK_CHUNK_SIZE) {
+            if (eof) {
+                unpack_error(ctx, UNPACK_ERROR_CORRUPT, "%s: %s out of data",
+                             ctx->input_file, layer_stats(&c->l)->format);
+                return -1;
+            }
+            unpack_buf_append(ctx->alloc, &c->pending, buf, len);
+            break;
+        }
+        if (len == 0 && !eof && outlen > 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Decode the pending input followed by buf */
+static int codec_decode_pending(struct codec_layer *c, const uint8_t *buf,
+                                size_t len, gboolean eof)
+{
+    struct unpack_buf in = c->pending;
+    int ret;
+
+    c->pending = c->spare;
+    c->pending.len = 0;
+    unpack_buf_append(c->l.ctx->alloc, &in, buf, len);
+    ret = codec_decode(c, in.data, in.len, eof);
+    c->spare = in;
+    return ret;
+}
+
+static int codec_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct codec_layer *c = (struct codec_layer *)sink;
+
+    layer_stats(&c->l)->in_bytes += len;
+
+    if (c->pending.len == 0) {
+        return codec_decode(c, buf, len, FALSE);
+    }
+    return codec_decode_pending(c, buf, len, FALSE);
+}
+
+static void codec_free(struct codec_layer *c)
+{
+    struct unpack_ctx *ctx = c->l.ctx;
+
+    decoder_cache_put(ctx->cache, c->ops, c->state);
+    unpack_buf_clear(ctx->alloc, &c->pending);
+    unpack_buf_clear(ctx->alloc, &c->spare);
+    decoder_cache_put_chunk(ctx->cache, ctx->alloc, c->chunk);
+}
+
+static int codec_finish(struct sink *sink)
+{
+    struct codec_layer *c = (struct codec_layer *)sink;
+    int ret;
+
+    ret = codec_decode_pending(c, NULL, 0, TRUE);
+
+    codec_free(c);
+    if (ret < 0) {
+        layer_abort(sink);
+        return -1;
+    }
+    return layer_finish(&c->l);
+}
+
+static void codec_abort(struct sink *sink)
+{
+    codec_free((struct codec_layer *)sink);
+    layer_abort(sink);
+}
+
+static struct sink *codec_new(struct unpack_ctx *ctx,
+                              const struct codec *codec, struct sink *next,
+                              int depth)
+{
+    struct codec_layer *c;
+    GError *error = NULL;
+    void *state;
+
+    state = decoder_cache_get(ctx->cache, ctx->alloc, codec->ops, &error);
+    if (!state) {
+        unpack_error(ctx, UNPACK_ERROR_FAILED, "%s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    c = layer_new(ctx, sizeof(*c), next, depth, codec->name);
+    layer_stats(&c->l)->codec = codec;
+    c->l.sink.write = codec_write;
+    c->l.sink.finish = codec_finish;
+    c->l.sink.abort = codec_abort;
+    c->ops = codec->ops;
+    c->state = state;
+    c->chunk = decoder_cache_get_chunk(ctx->cache, ctx->alloc);
+    return &c->l.sink;
+}
+
+/*
+ * A tar archive: forward the first member that looks like a kernel image to
+ * the next layer and skip everything else.
+ */
+enum tar_state {
+    TAR_HEADER,
+    TAR_DATA,
+    TAR_DONE,
+};
+
+struct tar_layer {
+    struct layer    l;
+    enum tar_state  state;
+    uint8_t         header[TAR_BLOCK_SIZE];
+    size_t          header_len;
+    /* bytes left in the current member, and its padding */
+    uint64_t        remaining;
+    uint64_t        padding;
+    gboolean        selected;
+    gboolean        found;
+};
+
+static gboolean tar_member_is_kernel(const char *name)
+{
+    const char *base = strrchr(name, '/');
+
+    base = base ? base + 1 : name;
+    return g_str_has_prefix(base, "Image") ||
+           g_str_has_prefix(base, "vmlinu") ||
+           g_str_has_prefix(base, "zImage") ||
+           g_str_has_suffix(base, ".efi");
+}
+
+static uint64_t tar_octal(const uint8_t *p, size_t len)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    for (i = 0; i < len && (p[i] == ' ' || p[i] == '0'); i++) {
+        /* skip leading padding */
+    }
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++) {
+        v = (v << 3) | (p[i] - '0');
+    }
+    return v;
+}
+
+static int tar_parse_header(struct tar_layer *t)
+{
+    const uint8_t *h = t->header;
+    char name[256];
+    uint64_t size;
+    char type;
+
+    /* the archive ends with zero blocks */
+    if (h[0] == '\0') {
+        t->state = TAR_DONE;
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "%.155s%s%.100s",
+             memcmp(h + TAR_MAGIC_OFFSET, "ustar", 5) == 0 ?
+                (const char *)h + 345 : "",
+             h[345] && memcmp(h + TAR_MAGIC_OFFSET, "ustar", 5) == 0 ? "/" : "",
+             (const char *)h);
+    size = tar_octal(h + 124, 12);
+    type = h[156];
+
+    t->remaining = size;
+    t->padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    t->selected = !t->found && (type == '0' || type == '\0') &&
+                  tar_member_is_kernel(name);
+    t->found |= t->selected;
+    t->state = TAR_DATA;
+    return 0;
+}
+
+static int tar_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct tar_layer *t = (struct tar_layer *)sink;
+    size_t n;
+
+    layer_stats(&t->l)->in_bytes += len;
+
+    while (len > 0) {
+        switch (t->state) {
+        case TAR_HEADER:
+            n = MIN(len, TAR_BLOCK_SIZE - t->header_len);
+            memcpy(t->header + t->header_len, buf, n);
+            t->header_len += n;
+            buf += n;
+            len -= n;
+            if (t->header_len == TAR_BLOCK_SIZE) {
+                t->header_len = 0;
+                tar_parse_header(t);
+            }
+            break;
+        case TAR_DATA:
+            if (t->remaining > 0) {
+                n = MIN(len, t->remaining);
+                if (t->selected && layer_emit(&t->l, buf, n) < 0) {
+                    return -1;
+                }
+                t->remaining -= n;
+            } else {
+                n = MIN(len, t->padding);
+                t->padding -= n;
+            }
+            buf += n;
+            len -= n;
+            if (t->remaining == 0 && t->padding == 0) {
+                /* nothing else of interest after the selected member */
+                t->state = t->selected ? TAR_DONE : TAR_HEADER;
+            }
+            break;
+        case TAR_DONE:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int tar_finish(struct sink *sink)
+{
+    struct tar_layer *t = (struct tar_layer *)sink;
+
+    if (!t->found || (t->selected && t->remaining > 0)) {
+        unpack_error(t->l.ctx, UNPACK_ERROR_NOT_FOUND,
+                     "%s: no kernel image found in tar archive",
+                     t->l.ctx->input_file);
+        layer_abort(sink);
+        return -1;
+    }
+    return layer_finish(&t->l);
+}
+
+static struct sink *tar_new(struct unpack_ctx *ctx, struct sink *out,
+                            int depth, gboolean expect_kernel)
+{
+    struct tar_layer *t = layer_new(ctx, sizeof(*t), NULL, depth, "tar");
+
+    t->l.next = probe_new(ctx, out, depth + 1, expect_kernel, FALSE);
+    t->l.sink.write = tar_write;
+    t->l.sink.finish = tar_finish;
+    t->l.sink.abort = layer_abort;
+    t->state = TAR_HEADER;
+    return &t->l.sink;
+}
+
+/*
+ * Look at the first bytes of a stream to find out its format, then set up
+ * the layer that decodes it and forward everything to it.
+ */
+struct probe {
+    struct sink     sink;
+    struct unpack_ctx *ctx;
+    struct sink     *out;
+    struct sink     *child;
+    int             depth;
+    gboolean        expect_kernel;
+    /* the payload of a zboot image, whose compression has been checked */
+    gboolean        in_zboot;
+    uint8_t         buf[PROBE_SIZE];
+    size_t          len;
+};
+
+static gboolean is_efi_zboot_image(const uint8_t *buf, size_t len)
+{
+    const struct linux_efi_zboot_header *header;
+
+    header = (const struct linux_efi_zboot_header *)buf;
+    return len >= sizeof(*header) &&
+           memcmp(&header->msdos_magic, EFI_PE_MSDOS_MAGIC, 2) == 0 &&
+           memcmp(&header->zimg, "zimg", 4) == 0 &&
+           memcmp(&header->linux_magic, EFI_PE_LINUX_MAGIC, 4) == 0;
+}
+
+static const char *kernel_arch(const uint8_t *buf, size_t len)
+{
+    /* check the arm64 magic header value -- very old kernels may not have it */
+    if (len > ARM64_MAGIC_OFFSET + 4 &&
+        (memcmp(buf + ARM64_MAGIC_OFFSET, "ARM\x64", 4) == 0)) {
+        return "arm64";
+    } else if (len > ARM64_MAGIC_OFFSET + 4 &&
+        (memcmp(buf + ARM64_MAGIC_OFFSET, "RSC\x05", 4) == 0)) {
+        return "riscv";
+    }
+    return NULL;
+}
+
+enum format {
+    FORMAT_UNKNOWN,
+    FORMAT_ZBOOT,
+    FORMAT_KERNEL,
+    FORMAT_CODEC,
+    FORMAT_TAR,
+};
+
+/*
+ * Tell the format of the stream starting with buf. Only zboot images and
+ * their payload are peeled, unless in recursive mode.
+ */
+static enum format detect_format(const struct unpack_ctx *ctx,
+                                 const uint8_t *buf, size_t len, int depth,
+                                 gboolean expect_kernel, gboolean in_zboot,
+                                 const struct codec **codec)
+{
+    if ((ctx->recursive || depth == 0) && is_efi_zboot_image(buf, len)) {
+        return FORMAT_ZBOOT;
+    }
+    if (expect_kernel && kernel_arch(buf, len)) {
+        return FORMAT_KERNEL;
+    }
+    if ((ctx->recursive || in_zboot) && (*codec = codec_detect(buf, len))) {
+        return FORMAT_CODEC;
+    }
+    if (ctx->recursive && len >= TAR_MAGIC_OFFSET + 5 &&
+        memcmp(buf + TAR_MAGIC_OFFSET, "ustar", 5) == 0) {
+        return FORMAT_TAR;
+    }
+    return FORMAT_UNKNOWN;
+}
+
+static void report_kernel(const struct unpack_ctx *ctx, const char *arch)
+{
+    if (ctx->quiet) {
+        return;
+    }
+    fprintf(stdout, "%s: found %s header\n", ctx->prog,
+            strcmp(arch, "arm64") == 0 ? "ARM64" : "RISC-V");
+}
+
+static struct sink *probe_detect(struct probe *p)
+{
+    struct unpack_ctx *ctx = p->ctx;
+    const struct codec *codec = NULL;
+    struct sink *next, *layer;
+    const char *arch;
+
+    if (p->depth > ctx->max_depth) {
+        unpack_error(ctx, UNPACK_ERROR_UNSUPPORTED,
+                     "%s: more than %d nested formats", ctx->input_file,
+                     ctx->max_depth);
+        return NULL;
+    }
+
+    switch (detect_format(ctx, p->buf, p->len, p->depth, p->expect_kernel,
+                          p->in_zboot, &codec)) {
+    case FORMAT_ZBOOT:
+        return unpack_efi_zboot_image(ctx, p->buf, p->out, p->depth,
+                                      p->expect_kernel);
+    case FORMAT_KERNEL:
+        arch = kernel_arch(p->buf, p->len);
+        report_kernel(ctx, arch);
+        return kernel_new(ctx, p->out, p->depth, arch);
+    case FORMAT_CODEC:
+        if (!codec->ops) {
+            unpack_error(ctx, UNPACK_ERROR_UNSUPPORTED,
+                         "%s: %s support is not built in", ctx->input_file,
+                         codec->name);
+            return NULL;
+        }
+        next = probe_new(ctx, p->out, p->depth + 1, p->expect_kernel, FALSE);
+        layer = codec_new(ctx, codec, next, p->depth);
+        if (!layer) {
+            /* the new probe has not taken over the output yet */
+            unpack_free(ctx->alloc, next, sizeof(struct probe));
+        }
+        return layer;
+    case FORMAT_TAR:
+        return tar_new(ctx, p->out, p->depth, p->expect_kernel);
+    case FORMAT_UNKNOWN:
+        break;
+    }
+
+    if (p->expect_kernel) {
+        unpack_error(ctx, UNPACK_ERROR_NOT_FOUND,
+                     "%s: cannot find ARM64/RISC-V compressed image",
+                     ctx->input_file);
+        return NULL;
+    }
+    return kernel_new(ctx, p->out, p->depth, "raw");
+}
+
+static int probe_start(struct probe *p)
+{
+    struct unpack_cost start;
+
+    unpack_cost_begin(&start);
+    p->child = probe_detect(p);
+    unpack_phase_end(p->ctx, UNPACK_PHASE_HEADER, &start);
+    if (!p->child) {
+        return -1;
+    }
+    return p->child->write(p->child, p->buf, p->len);
+}
+
+static int probe_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct probe *p = (struct probe *)sink;
+    size_t n;
+
+    if (p->child) {
+        return p->child->write(p->child, buf, len);
+    }
+
+    n = MIN(len, PROBE_SIZE - p->len);
+    memcpy(p->buf + p->len, buf, n);
+    p->len += n;
+    if (p->len < PROBE_SIZE) {
+        return 0;
+    }
+    if (probe_start(p) < 0) {
+        return -1;
+    }
+    return len > n ? p->child->write(p->child, buf + n, len - n) : 0;
+}
+
+static void probe_abort(struct sink *sink)
+{
+    struct probe *p = (struct probe *)sink;
+
+    if (p->child) {
+        p->child->abort(p->child);
+    } else {
+        p->out->abort(p->out);
+    }
+    unpack_free(p->ctx->alloc, p, sizeof(*p));
+}
+
+static int probe_finish(struct sink *sink)
+{
+    struct probe *p = (struct probe *)sink;
+    int ret;
+
+    if (!p->child && (p->len == 0 || probe_start(p) < 0)) {
+        if (p->len == 0) {
+            unpack_error(p->ctx, UNPACK_ERROR_CORRUPT,
+                         "%s: unexpected end of data", p->ctx->input_file);
+        }
+        probe_abort(sink);
+        return -1;
+    }
+    ret = p->child->finish(p->child);
+    unpack_free(p->ctx->alloc, p, sizeof(*p));
+    return ret;
+}
+
+static struct sink *probe_new(struct unpack_ctx *ctx, struct sink *out,
+                              int depth, gboolean expect_kernel,
+                              gboolean in_zboot)
+{
+    struct probe *p = unpack_new0(ctx->alloc, struct probe);
+
+    p->sink.write = probe_write;
+    p->sink.finish = probe_finish;
+    p->sink.abort = probe_abort;
+    p->ctx = ctx;
+    p->out = out;
+    p->depth = depth;
+    p->expect_kernel = expect_kernel;
+    p->in_zboot = in_zboot;
+    return &p->sink;
+}
+
+struct sink *unpack_new(struct unpack_ctx *ctx, struct sink *out,
+                        gboolean expect_kernel)
+{
+    return probe_new(ctx, out, 0, expect_kernel, FALSE);
+}
+
+/*
+ * Collect the first bytes decoded from a scan candidate, then stop it.
+ */
+struct trial_sink {
+    struct sink     sink;
+    uint8_t         buf[PROBE_SIZE];
+    size_t          len;
+};
+
+static int trial_write(struct sink *sink, const uint8_t *buf, size_t len)
+{
+    struct trial_sink *t = (struct trial_sink *)sink;
+    size_t n = MIN(len, PROBE_SIZE - t->len);
+
+    memcpy(t->buf + t->len, buf, n);
+    t->len += n;
+    /* enough to tell, stop decoding */
+    return t->len == PROBE_SIZE ? -1 : 0;
+}
+
+static int trial_finish(struct sink *sink)
+{
+    (void)sink;
+    return 0;
+}
+
+static void trial_abort(struct sink *sink)
+{
+    (void)sink;
+}
+
+/*
+ * Decode the beginning of a scan candidate and check that it is what we are
+ * looking for.
+ */
+static gboolean scan_try(struct unpack_ctx *ctx,
+                         const struct scan_candidate *cand,
+                         const uint8_t *image, size_t size)
+{
+    struct trial_sink t = {
+        .sink = { trial_write, trial_finish, trial_abort },
+    };
+    const struct codec *codec = NULL;
+    struct unpack_ctx scratch;
+    struct unpack_cost verify;
+    struct sink *sink;
+    size_t pos = cand->offset;
+    gboolean ok = TRUE;
+
+    unpack_ctx_init(&scratch, ctx->prog, ctx->input_file);
+    scratch.quiet = TRUE;
+    scratch.recursive = ctx->recursive;
+    /* candidates of the same format reuse the same decoder */
+    scratch.cache = ctx->cache;
+    scratch.alloc = ctx->alloc;
+
+    sink = codec_new(&scratch, cand->codec, &t.sink, 1);
+    if (!sink) {
+        unpack_ctx_clear(&scratch);
+        return FALSE;
+    }
+    while (pos < size && t.len < PROBE_SIZE) {
+        size_t n = MIN(size - pos, SCAN_TRIAL_CHUNK_SIZE);
+
+        if (sink->write(sink, image + pos, n) < 0) {
+            ok = t.len == PROBE_SIZE;
+            break;
+        }
+        pos += n;
+    }
+    if (pos == size && t.len < PROBE_SIZE) {
+        ok = sink->finish(sink) == 0;
+    } else {
+        sink->abort(sink);
+    }
+    /* trying candidates out is part of locating the payload */
+    codec_take_verify_cost(&verify);
+    unpack_ctx_clear(&scratch);
+
+    return ok && detect_format(ctx, t.buf, t.len, 2, TRUE, FALSE,
+                               &codec) != FORMAT_UNKNOWN;
+}
+
+/*
+ * Look for a compressed kernel anywhere in the image and decode the first
+ * candidate that turns out to be one.
+ */
+static struct sink *unpack_scan(struct unpack_ctx *ctx,
+                                const uint8_t *image, size_t size,
+                                struct sink *out, size_t *offset)
+{
+    struct unpack_cost start;
+    GArray *cands;
+    guint i;
+
+    unpack_cost_begin(&start);
+    cands = scan_signatures(image, size);
+
+    for (i = 0; i < cands->len; i++) {
+        struct scan_candidate cand;
+        struct unpack_layer scan = { .format = "scan", .in_bytes = size };
+        struct sink *next, *head;
+
+        cand = g_array_index(cands, struct scan_candidate, i);
+        if (!scan_try(ctx, &cand, image, size)) {
+            continue;
+        }
+        g_array_free(cands, TRUE);
+        unpack_phase_end(ctx, UNPACK_PHASE_HEADER, &start);
+
+        scan.out_bytes = size - cand.offset;
+        g_array_append_val(ctx->layers, scan);
+
+        next = probe_new(ctx, out, 2, TRUE, FALSE);
+        head = codec_new(ctx, cand.codec, next, 1);
+        if (!head) {
+            probe_abort(next);
+            return NULL;
+        }
+        *offset = cand.offset;
+        return head;
+    }
+    g_array_free(cands, TRUE);
+    unpack_phase_end(ctx, UNPACK_PHASE_HEADER, &start);
+
+    unpack_error(ctx, UNPACK_ERROR_NOT_FOUND,
+                 "%s: not a Linux EFI zboot image, cannot find ARM64/RISC-V "
+                 "compressed image", ctx->input_file);
+    out->abort(out);
+    return NULL;
+}
+
+struct sink *unpack_image_new(struct unpack_ctx *ctx, const uint8_t *image,
+                              size_t size, struct sink *out,
+                              gboolean expect_kernel, size_t *offset)
+{
+    const struct codec *codec = NULL;
+    struct unpack_cost start;
+    enum format format;
+
+    *offset = 0;
+    if (expect_kernel) {
+        unpack_cost_begin(&start);
+        format = detect_format(ctx, image, MIN(size, PROBE_SIZE), 0, TRUE,
+                               FALSE, &codec);
+        unpack_phase_end(ctx, UNPACK_PHASE_HEADER, &start);
+        if (format == FORMAT_UNKNOWN) {
+            return unpack_scan(ctx, image, size, out, offset);
+        }
+    }
+    return unpack_new(ctx, out, expect_kernel);
+}
+
+int unpack_image(struct unpack_ctx *ctx, const uint8_t *image, size_t size,
+                 struct sink *out, gboolean expect_kernel)
+{
+    struct sink *head;
+    size_t offset;
+
+    head = unpack_image_new(ctx, image, size, out, expect_kernel, &offset);
+    if (!head) {
+        return -1;
+    }
+    return sink_write_all(head, image + offset, size - offset);
+}
+
+ssize_t unpack_zboot_to_buffer(struct unpack_ctx *ctx, const uint8_t *image,
+                               size_t size, uint8_t *buf, size_t bufsize)
+{
+    const struct linux_efi_zboot_header *header;
+    const struct codec *codec;
+    struct unpack_cost start;
+    GError *error = NULL;
+    size_t len = bufsize;
+    int ploff, plsize, r;
+
+    if (!is_efi_zboot_image(image, size)) {
+        return -1;
+    }
+    header = (const struct linux_efi_zboot_header *)image;
+    codec = codec_from_zboot_type(header->compression_type,
+                                  sizeof(header->compression_type));
+    ploff = ldl_le_p(&header->payload_offset);
+    plsize = ldl_le_p(&header->payload_size);
+    if (!codec || !codec->ops || ploff < (int)sizeof(*header) ||
+        plsize < 0 || (size_t)ploff > size || (size_t)plsize > size - ploff ||
+        (size_t)plsize < zboot_trailer_size(codec)) {
+        return -1;
+    }
+
+    unpack_cost_begin(&start);
+    r = codec_decode_buffer(codec, ctx->cache, ctx->alloc, image + ploff,
+                            plsize - zboot_trailer_size(codec), buf, &len,
+                            &error);
+    unpack_phase_end(ctx, UNPACK_PHASE_INFLATE, &start);
+    if (r < 0) {
+        g_error_free(error);
+        return -1;
+    }
+    return kernel_arch(buf, len) ? (ssize_t)len : -1;
+}
+
+char *unpack_zboot_payload_digest(const uint8_t *image, size_t size,
+                                  enum digest_algo algo)
+{
+    const struct linux_efi_zboot_header *header;
+    struct digest *d;
+    int ploff, plsize;
+
+    if (!is_efi_zboot_image(image, size)) {
+        return NULL;
+    }
+    header = (const struct linux_efi_zboot_header *)image;
+    ploff = ldl_le_p(&header->payload_offset);
+    plsize = ldl_le_p(&header->payload_size);
+    if (ploff < (int)sizeof(*header) || plsize < 0 || (size_t)ploff > size ||
+        (size_t)plsize > size - ploff) {
+        return NULL;
+    }
+
+    d = digest_new(algo);
+    digest_update(d, image + ploff, plsize);
+    return digest_finish(d);
+}
+
+int64_t unpack_zboot_kernel_size(const uint8_t *image, size_t size)
+{
+    const struct linux_efi_zboot_header *header;
+    const struct codec *codec;
+    int ploff, plsize;
+
+    if (!is_efi_zboot_image(image, size)) {
+        return -1;
+    }
+    header = (const struct linux_efi_zboot_header *)image;
+    codec = codec_from_zboot_type(header->compression_type,
+                                  sizeof(header->compression_type));
+    ploff = ldl_le_p(&header->payload_offset);
+    plsize = ldl_le_p(&header->payload_size);
+    if (!codec || ploff < (int)sizeof(*header) || plsize < 4 ||
+        (size_t)ploff > size || (size_t)plsize > size - ploff) {
+        return -1;
+    }
+
+    if (zboot_trailer_size(codec)) {
+        return (uint32_t)ldl_le_p(image + ploff + plsize - 4);
+    }
+    /* gzip streams end with it modulo 4 GiB */
+    if (codec->ops && codec->ops->content_size) {
+        return codec->ops->content_size(image + ploff, plsize);
+    }
+    return -1;
+}
+
+int unpack_stream(struct unpack_ctx *ctx, int fd, struct sink *out)
+{
+    struct sink *head = unpack_new(ctx, out, TRUE);
+    struct unpack_cost start;
+    uint8_t *buf;
+    ssize_t n;
+
+    buf = unpack_alloc(ctx->alloc, UNPACK_CHUNK_SIZE);
+    for (;;) {
+        unpack_cost_begin(&start);
+        n = read(fd, buf, UNPACK_CHUNK_SIZE);
+        unpack_phase_end(ctx, UNPACK_PHASE_LOAD, &start);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            unpack_error(ctx, UNPACK_ERROR_IO, "%s: cannot read input file: %s",
+                         ctx->input_file, strerror(errno));
+        }
+        if (n <= 0 || head->write(head, buf, n) < 0) {
+            break;
+        }
+    }
+    unpack_free(ctx->alloc, buf, UNPACK_CHUNK_SIZE);
+
+    if (n != 0) {
+        head->abort(head);
+        return -1;
+    }
+    return head->finish(head);
+}
+
+int unpack_passthrough(struct unpack_ctx *ctx, int fd,
+                       const char *output_file)
+{
+    uint8_t page[PASSTHROUGH_PROBE_SIZE];
+    struct unpack_layer layer = { 0 };
+    struct sink *out;
+    struct stat st;
+    struct unpack_cost start;
+    ssize_t n;
+
+    unpack_cost_begin(&start);
+    n = pread(fd, page, sizeof(page), 0);
+    unpack_phase_end(ctx, UNPACK_PHASE_LOAD, &start);
+    if (n < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    unpack_cost_begin(&start);
+    layer.format = kernel_arch(page, n);
+    unpack_phase_end(ctx, UNPACK_PHASE_HEADER, &start);
+    if (!layer.format) {
+        return 0;
+    }
+
+    report_kernel(ctx, layer.format);
+    layer.in_bytes = layer.out_bytes = st.st_size;
+    g_array_append_val(ctx->layers, layer);
+
+    out = output_sink_new(ctx, output_file);
+    if (!out) {
+        return -1;
+    }
+    return sink_copy_from(out, fd, st.st_size) < 0 ? -1 : 1;
+}
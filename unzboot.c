@@ -47,263 +47,613 @@
  */
 
 #include <glib.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h>
-#include <zlib.h>
- 
-#define ARM64_MAGIC_OFFSET  56
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/xattr.h>
+
+#include "probes.h"
+#include "unzboot.h"
+
+enum stats_format {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+};
 
-#define ZALLOC_ALIGNMENT	16
+enum input_mode {
+    INPUT_MMAP,
+    INPUT_READ,
+    INPUT_STREAM,
+};
 
-#define HEAD_CRC	        2
-#define EXTRA_FIELD         4
-#define ORIG_NAME           8
-#define COMMENT	            0x10
-#define RESERVED            0xe0
-#define DEFLATED            8
-#define LOAD_IMAGE_MAX_GUNZIP_BYTES (256 << 20)
+static gboolean recursive;
+static gint max_depth = UNPACK_DEFAULT_MAX_DEPTH;
+static enum stats_format stats;
+static gboolean no_sparse;
+static gboolean perf_counters;
+static gchar *trace_path;
+static enum input_mode input_mode;
+static const struct codec *output_codec;
+static gint output_level;
+static gchar **tee_files;
+static guint digests;
+static gboolean digest_files;
+static gboolean if_changed;
+static gboolean output_memfd;
+static gchar *memfd_socket;
+static gchar **filenames;
+
+static gboolean parse_stats(const gchar *name, const gchar *value,
+                            gpointer data, GError **error)
+{
+    (void)name;
+    (void)data;
+    if (!value || strcmp(value, "text") == 0) {
+        stats = STATS_TEXT;
+    } else if (strcmp(value, "json") == 0) {
+        stats = STATS_JSON;
+    } else {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "Unknown statistics format \"%s\"", value);
+        return FALSE;
+    }
+    return TRUE;
+}
 
-#define le_bswap(v, size) (v)
+static gboolean parse_input(const gchar *name, const gchar *value,
+                            gpointer data, GError **error)
+{
+    (void)name;
+    (void)data;
+    if (strcmp(value, "mmap") == 0) {
+        input_mode = INPUT_MMAP;
+    } else if (strcmp(value, "read") == 0) {
+        input_mode = INPUT_READ;
+    } else if (strcmp(value, "stream") == 0) {
+        input_mode = INPUT_STREAM;
+    } else {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "Unknown input mode \"%s\"", value);
+        return FALSE;
+    }
+    return TRUE;
+}
 
-/* The PE/COFF MS-DOS stub magic number */
-#define EFI_PE_MSDOS_MAGIC        "MZ"
+static gboolean parse_output_compress(const gchar *name, const gchar *value,
+                                      gpointer data, GError **error)
+{
+    size_t i;
+
+    (void)name;
+    (void)data;
+    for (i = 0; i < N_CODECS; i++) {
+        if (strcmp(value, codecs[i].name) == 0) {
+            output_codec = &codecs[i];
+            return TRUE;
+        }
+    }
+    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                "Unknown compression format \"%s\"", value);
+    return FALSE;
+}
+
+static gboolean parse_digest(const gchar *name, const gchar *value,
+                             gpointer data, GError **error)
+{
+    GError *err = NULL;
+
+    (void)name;
+    (void)data;
+    if (!digest_parse(value, &digests, &err)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "%s",
+                    err->message);
+        g_error_free(err);
+        return FALSE;
+    }
+    return TRUE;
+}
 
 /*
- * The Linux header magic number for a EFI PE/COFF
- * image targetting an unspecified architecture.
+ * Write the digests of the kernel next to it, one file per algorithm, in the
+ * format of sha256sum and b3sum, to be checked with their --check option
  */
-#define EFI_PE_LINUX_MAGIC        "\xcd\x23\x82\x81"
+static int write_digest_files(const struct unpack_ctx *ctx,
+                              const char *output_file)
+{
+    GError *error = NULL;
+    char *path, *line, *base;
+    int i, ret = 0;
+
+    base = g_path_get_basename(output_file);
+    for (i = 0; i < N_DIGESTS; i++) {
+        if (!ctx->kernel_digest[i]) {
+            continue;
+        }
+        path = g_strdup_printf("%s.%s", output_file, digest_names[i]);
+        line = g_strdup_printf("%s  %s\n", ctx->kernel_digest[i], base);
+        if (!g_file_set_contents(path, line, -1, &error)) {
+            fprintf(stderr, "%s: %s\n", ctx->prog, error->message);
+            g_clear_error(&error);
+            ret = -1;
+        }
+        g_free(line);
+        g_free(path);
+    }
+    g_free(base);
+    return ret;
+}
 
 /*
- * Bootable Linux kernel images may be packaged as EFI zboot images, which are
- * self-decompressing executables when loaded via EFI. The compressed payload
- * can also be extracted from the image and decompressed by a non-EFI loader.
- *
- * The de facto specification for this format is at the following URL:
- *
- * https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/drivers/firmware/efi/libstub/zboot-header.S
- *
- * This definition is based on Linux upstream commit 29636a5ce87beba.
+ * For --if-changed, the output records what it was unpacked from in an
+ * extended attribute: the digest of the zboot payload and how it was
+ * written, along with the size and modification time the output had then.
+ * As long as they all match, unpacking the same payload again would not
+ * change it, and it is not even decompressed.
  */
-struct linux_efi_zboot_header {
-    uint8_t     msdos_magic[2];         /* PE/COFF 'MZ' magic number */
-    uint8_t     reserved0[2];
-    uint8_t     zimg[4];                /* "zimg" for Linux EFI zboot images */
-    uint32_t    payload_offset;         /* LE offset to compressed payload */
-    uint32_t    payload_size;           /* LE size of the compressed payload */
-    uint8_t     reserved1[8];
-    char        compression_type[32];   /* Compression type, NUL terminated */
-    uint8_t     linux_magic[4];         /* Linux header magic */
-    uint32_t    pe_header_offset;       /* LE offset to the PE header */
-};
+#define SOURCE_XATTR    "user.unzboot.source"
 
-static inline int ldl_he_p(const void *ptr)
+static char *source_key(const uint8_t *image, size_t size)
 {
-    int32_t r;
-    memcpy(&r, ptr, sizeof(r));
-    return r;
+    char *digest, *key;
+
+    digest = unpack_zboot_payload_digest(image, size, DIGEST_SHA256);
+    if (!digest) {
+        return NULL;
+    }
+    if (output_codec) {
+        key = g_strdup_printf("sha256:%s %s:%d%s", digest, output_codec->name,
+                              output_level, recursive ? " recursive" : "");
+    } else {
+        key = g_strdup_printf("sha256:%s raw%s", digest,
+                              recursive ? " recursive" : "");
+    }
+    g_free(digest);
+    return key;
 }
 
-static inline int ldl_le_p(const void *ptr)
+static char *source_record(const char *key, const char *output_file)
 {
-    return le_bswap(ldl_he_p(ptr), 32);
+    struct stat st;
+
+    if (stat(output_file, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    return g_strdup_printf("%s %lld %lld.%09ld", key, (long long)st.st_size,
+                           (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
 }
 
-static void *zalloc(void *x, unsigned items, unsigned size)
+static gboolean source_unchanged(const char *key, const char *output_file)
 {
-    void *p;
+    char *record = source_record(key, output_file);
+    char value[256];
+    ssize_t n;
+    gboolean same;
 
-    size *= items;
-    size = (size + ZALLOC_ALIGNMENT - 1) & ~(ZALLOC_ALIGNMENT - 1);
+    if (!record) {
+        return FALSE;
+    }
+    n = getxattr(output_file, SOURCE_XATTR, value, sizeof(value) - 1);
+    same = n > 0 && (size_t)n == strlen(record) &&
+           memcmp(value, record, n) == 0;
+    g_free(record);
+    return same;
+}
 
-    p = g_malloc(size);
+/* Filesystems without user extended attributes only miss the shortcut */
+static void source_save(const char *key, const char *output_file)
+{
+    char *record = source_record(key, output_file);
 
-    return (p);
+    if (record) {
+        setxattr(output_file, SOURCE_XATTR, record, strlen(record), 0);
+    }
+    g_free(record);
 }
 
-static void zfree(void *x, void *addr)
+/*
+ * For --output-memfd, the kernel is never written to disk: it is unpacked
+ * to a memfd that is sealed, so that whoever it is handed to can map it
+ * knowing it will not change under them, then sent over a Unix socket or
+ * inherited by a command as MEMFD_EXEC_FD, /proc/self/fd/3.
+ */
+#define MEMFD_EXEC_FD   3
+
+static int memfd_seal(int memfd)
 {
-    g_free(addr);
+    return fcntl(memfd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK |
+                                     F_SEAL_GROW | F_SEAL_SEAL);
 }
 
-static ssize_t gunzip(void *dst, size_t dstlen, uint8_t *src, size_t srclen)
+/* Send the memfd to whatever listens on path, with its size as a line */
+static int memfd_send(int memfd, const char *path)
 {
-    z_stream s;
-    ssize_t dstbytes;
-    int r, flags;
+    static const int types[] = { SOCK_STREAM, SOCK_SEQPACKET, SOCK_DGRAM };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    union {
+        struct cmsghdr  hdr;
+        char            buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct stat st;
+    char line[32];
+    int sock = -1, err;
     size_t i;
+    ssize_t n;
 
-    /* skip header */
-    i = 10;
-    if (srclen < 4) {
-        goto toosmall;
-    }
-    flags = src[3];
-    if (src[2] != DEFLATED || (flags & RESERVED) != 0) {
-        puts ("Error: Bad gzipped data\n");
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
         return -1;
     }
-    if ((flags & EXTRA_FIELD) != 0) {
-        if (srclen < 12) {
-            goto toosmall;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    for (i = 0; i < G_N_ELEMENTS(types) && sock < 0; i++) {
+        sock = socket(AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            return -1;
         }
-        i = 12 + src[10] + (src[11] << 8);
-    }
-    if ((flags & ORIG_NAME) != 0) {
-        while (i < srclen && src[i++] != 0) {
-            /* do nothing */
-        }
-    }
-    if ((flags & COMMENT) != 0) {
-        while (i < srclen && src[i++] != 0) {
-            /* do nothing */
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            err = errno;
+            close(sock);
+            sock = -1;
+            errno = err;
+            /* not the type of socket listening there */
+            if (err != EPROTOTYPE) {
+                return -1;
+            }
         }
     }
-    if ((flags & HEAD_CRC) != 0) {
-        i += 2;
-    }
-    if (i >= srclen) {
-        goto toosmall;
-    }
-
-    s.zalloc = zalloc;
-    s.zfree = zfree;
-
-    r = inflateInit2(&s, -MAX_WBITS);
-    if (r != Z_OK) {
-        printf ("Error: inflateInit2() returned %d\n", r);
-        return (-1);
-    }
-    s.next_in = src + i;
-    s.avail_in = srclen - i;
-    s.next_out = dst;
-    s.avail_out = dstlen;
-    r = inflate(&s, Z_FINISH);
-    if (r != Z_OK && r != Z_STREAM_END) {
-        printf ("Error: inflate() returned %d\n", r);
+    if (sock < 0 || fstat(memfd, &st) < 0) {
         return -1;
     }
-    dstbytes = s.next_out - (unsigned char *) dst;
-    inflateEnd(&s);
-
-    return dstbytes;
 
-toosmall:
-    puts("Error: gunzip out of data in header\n");
-    return -1;
+    iov.iov_base = line;
+    iov.iov_len = snprintf(line, sizeof(line), "%lld\n", (long long)st.st_size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    err = errno;
+    close(sock);
+    errno = err;
+    return n < 0 ? -1 : 0;
 }
 
-/*
- * Check whether *buffer points to a Linux EFI zboot image in memory.
- *
- * If it does, attempt to decompress it to a new buffer, and free the old one.
- * If any of this fails, return an error to the caller.
- *
- * If the image is not a Linux EFI zboot image, do nothing and return success.
- */
-static ssize_t unpack_efi_zboot_image(uint8_t **buffer, int *size)
+/* Only returns if command could not be run */
+static void memfd_exec(int memfd, char **command)
 {
-    const struct linux_efi_zboot_header *header;
-    uint8_t *data = NULL;
-    int ploff, plsize;
-    ssize_t bytes;
+    if (memfd == MEMFD_EXEC_FD) {
+        fcntl(memfd, F_SETFD, 0);
+    } else if (dup2(memfd, MEMFD_EXEC_FD) < 0) {
+        return;
+    }
+    execvp(command[0], command);
+}
 
-    /* ignore if this is too small to be a EFI zboot image */
-    if (*size < sizeof(*header)) {
-        fprintf(stderr, "The input file is too small to be a EFI zboot image\n");
-        return 0;
+/* Read the whole input file into memory */
+static uint8_t *read_input(int fd, size_t size)
+{
+    uint8_t *buf = g_malloc(size ? size : 1);
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < size) {
+        n = pread(fd, buf + off, size - off, off);
+        if (n <= 0) {
+            g_free(buf);
+            return NULL;
+        }
+        off += n;
     }
+    return buf;
+}
 
-    header = (struct linux_efi_zboot_header *)*buffer;
+static GOptionEntry entries[] = {
+    { "recursive", 'r', 0, G_OPTION_ARG_NONE, &recursive,
+      "Keep unpacking nested formats until a kernel image is found", NULL },
+    { "max-depth", 0, 0, G_OPTION_ARG_INT, &max_depth,
+      "Maximum number of nested formats to unpack (default: 8)", "N" },
+    { "stats", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK,
+      G_GNUC_EXTENSION (gpointer)parse_stats,
+      "Print the unpacked layers and where the time went, "
+      "as text or json", "FORMAT" },
+    { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_path,
+      "Write a Chrome trace of the run to FILE, for ui.perfetto.dev", "FILE" },
+    { "input", 0, 0, G_OPTION_ARG_CALLBACK,
+      G_GNUC_EXTENSION (gpointer)parse_input,
+      "Map the input file (mmap, the default), read it into memory (read) "
+      "or unpack it while reading it (stream)", "MODE" },
+    { "output-compress", 0, 0, G_OPTION_ARG_CALLBACK,
+      G_GNUC_EXTENSION (gpointer)parse_output_compress,
+      "Compress the kernel again with zstd, gzip or lz4, on all the "
+      "processors", "FORMAT" },
+    { "output-level", 0, 0, G_OPTION_ARG_INT, &output_level,
+      "Compression level of --output-compress (default: the format's)", "N" },
+    { "tee", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &tee_files,
+      "Write the kernel to FILE as well, from the same decode, compressed if "
+      "FILE ends in .gz, .zst or .lz4; can be repeated", "FILE" },
+    { "digest", 0, 0, G_OPTION_ARG_CALLBACK,
+      G_GNUC_EXTENSION (gpointer)parse_digest,
+      "Compute the sha256 or blake3 digests, comma separated, of the zboot "
+      "payload and of the kernel, as they are unpacked", "LIST" },
+    { "digest-files", 0, 0, G_OPTION_ARG_NONE, &digest_files,
+      "Write the digests of the kernel to OUTPUT.sha256 and OUTPUT.blake3",
+      NULL },
+    { "if-changed", 0, 0, G_OPTION_ARG_NONE, &if_changed,
+      "Leave output files that would not change as they are, without "
+      "unpacking the zboot payload they were unpacked from", NULL },
+    { "output-memfd", 0, 0, G_OPTION_ARG_NONE, &output_memfd,
+      "Unpack the kernel to a sealed memfd instead of a file, run COMMAND "
+      "with it as /proc/self/fd/3 or send it to --memfd-socket", NULL },
+    { "memfd-socket", 0, 0, G_OPTION_ARG_FILENAME, &memfd_socket,
+      "Send the memfd of --output-memfd over the Unix socket PATH", "PATH" },
+    { "no-sparse", 0, 0, G_OPTION_ARG_NONE, &no_sparse,
+      "Write blocks of zeros instead of leaving holes in the output", NULL },
+    { "perf-counters", 0, 0, G_OPTION_ARG_NONE, &perf_counters,
+      "Count cycles, instructions, branch and cache misses of each phase",
+      NULL },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames,
+      NULL, "<input file> <output file>" },
+    G_OPTION_ENTRY_NULL
+};
 
-    /* ignore if this is not a Linux EFI zboot image */
-    if (memcmp(&header->msdos_magic, EFI_PE_MSDOS_MAGIC, 2) != 0 ||
-        memcmp(&header->zimg, "zimg", 4) != 0 ||
-        memcmp(&header->linux_magic, EFI_PE_LINUX_MAGIC, 4) != 0) {
-        fprintf(stderr, "The input file is not a Linux EFI zboot image\n");
-        return 0;
+int main(int argc, char *argv[]) {
+    GOptionContext *context;
+    GMappedFile *mapped = NULL;
+    uint8_t *buf = NULL;
+    struct unpack_ctx ctx;
+    struct sink *out;
+    const uint8_t *image;
+    char *source = NULL;
+    GError *error = NULL;
+    struct unpack_cost phase;
+    uint64_t start;
+    struct stat st;
+    size_t size;
+    int fd, memfd = -1, ret, i;
+
+    start = unpack_clock_ns();
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return unpack_bench(argc, argv);
     }
-
-    if (strcmp(header->compression_type, "gzip") != 0) {
-        fprintf(stderr,
-                "unable to handle EFI zboot image with \"%.*s\" compression\n",
-                (int)sizeof(header->compression_type) - 1,
-                header->compression_type);
-        return -1;
+    if (argc > 1 && strcmp(argv[1], "pack") == 0) {
+        return pack_zboot(argc, argv);
     }
 
-    ploff = ldl_le_p(&header->payload_offset);
-    plsize = ldl_le_p(&header->payload_size);
-
-    if (ploff < 0 || plsize < 0 || ploff + plsize > *size) {
-        fprintf(stderr, "unable to handle corrupt EFI zboot image\n");
-        return -1;
+    /*
+     * GLib takes the next argument as the value of an option whose value is
+     * optional, the format of --stats can only be given as --stats=FORMAT.
+     */
+    for (i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            argv[i] = "--stats=text";
+        }
     }
 
-    data = g_malloc(LOAD_IMAGE_MAX_GUNZIP_BYTES);
-    bytes = gunzip(data, LOAD_IMAGE_MAX_GUNZIP_BYTES, *buffer + ploff, plsize);
-    if (bytes < 0) {
-        fprintf(stderr, "failed to decompress EFI zboot image\n");
-        g_free(data);
-        return -1;
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s: %s\n", argv[0], error->message);
+        exit(EXIT_FAILURE);
     }
+    g_option_context_free(context);
 
-    g_free(*buffer);
-    *buffer = g_realloc(data, bytes);
-    *size = bytes;
-    return bytes;
-}
+    /* with --output-memfd, what follows the input file is the command */
+    if (output_memfd) {
+        if (!filenames || (!filenames[1] && !memfd_socket)) {
+            fprintf(stderr, "Usage: %s --output-memfd [OPTION...] "
+                    "<input file> [-- COMMAND...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (if_changed || digest_files) {
+            fprintf(stderr, "%s: --output-memfd can not be used with "
+                    "--if-changed or --digest-files\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    } else if (memfd_socket) {
+        fprintf(stderr, "%s: --memfd-socket needs --output-memfd\n", argv[0]);
+        exit(EXIT_FAILURE);
+    } else if (!filenames || g_strv_length(filenames) != 2) {
+        fprintf(stderr, "Usage: %s [OPTION...] <input file> <output file>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
-int main(int argc, char *argv[]) {
-    uint8_t *buffer;
-    gsize len;
-    int size;
+    const char* input_file = filenames[0];
+    const char* output_file = output_memfd ? "memfd" : filenames[1];
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+    if (output_codec && !encode_check(output_codec, output_level, &error)) {
+        fprintf(stderr, "%s: %s\n", argv[0], error->message);
         exit(EXIT_FAILURE);
     }
+    /* the sidecar files are of the sha256 digest unless told otherwise */
+    if (digest_files && !digests) {
+        digests = 1 << DIGEST_SHA256;
+    }
+    for (i = 0; tee_files && tee_files[i]; i++) {
+        const struct codec *codec = encode_codec_for_path(tee_files[i]);
 
-    const char* input_file = argv[1];
-    const char* output_file = argv[2];
+        if (codec && !encode_check(codec, 0, &error)) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], tee_files[i],
+                    error->message);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    /* Load as raw file otherwise */
-    if (!g_file_get_contents(input_file, (char **)&buffer, &len, NULL)) {
-        fprintf(stderr, "%s: %s: cannot load input file\n", argv[0], input_file);
-        exit(EXIT_FAILURE);
+    /* Count the hardware events of this thread from here on */
+    if (perf_counters) {
+        if (!perf_thread_open()) {
+            fprintf(stderr, "%s: cannot count hardware events, they are "
+                    "not supported or not allowed by perf_event_paranoid\n",
+                    argv[0]);
+            perf_counters = FALSE;
+        }
+        if (stats == STATS_NONE) {
+            stats = STATS_TEXT;
+        }
     }
-    size = len;
 
-    /* Unpack the image if it is a EFI zboot image */
-    if (unpack_efi_zboot_image(&buffer, &size) < 0) {
-        g_free(buffer);
-        fprintf(stderr, "%s: cannot write to unpack zboot image\n", argv[0]);
+    if (trace_path && trace_open(argv[0], trace_path, input_file) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    /* check the arm64 magic header value -- very old kernels may not have it */
-    if (size > ARM64_MAGIC_OFFSET + 4 &&
-        (memcmp(buffer + ARM64_MAGIC_OFFSET, "ARM\x64", 4) == 0)) {
-        fprintf(stdout, "%s: found ARM64 header\n", argv[0]);
-        if (!g_file_set_contents(output_file, (char *)buffer, size, NULL)) {
-            g_free(buffer);
-            fprintf(stderr, "%s: cannot write to output file\n", argv[0]);
+    unpack_cost_begin(&phase);
+    fd = open(input_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s: cannot load input file\n", argv[0], input_file);
+        exit(EXIT_FAILURE);
+    }
+    UNZBOOT_PROBE2(load, input_file, st.st_size);
+
+    unpack_ctx_init(&ctx, argv[0], input_file);
+    ctx.recursive = recursive;
+    ctx.max_depth = max_depth;
+    ctx.sparse = !no_sparse;
+    ctx.perf_counters = perf_counters;
+    ctx.output_codec = output_codec;
+    ctx.output_level = output_level;
+    ctx.tee_files = tee_files;
+    ctx.digests = digests;
+    ctx.if_changed = if_changed;
+    if (output_memfd) {
+        memfd = memfd_create("kernel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (memfd < 0) {
+            fprintf(stderr, "%s: cannot create memfd: %s\n", argv[0],
+                    strerror(errno));
             exit(EXIT_FAILURE);
         }
-    } else if (size > ARM64_MAGIC_OFFSET + 4 &&
-        (memcmp(buffer + ARM64_MAGIC_OFFSET, "RSC\x05", 4) == 0)) {
-        fprintf(stdout, "%s: found RISC-V header\n", argv[0]);
-        if (!g_file_set_contents(output_file, (char *)buffer, size, NULL)) {
-            g_free(buffer);
-            fprintf(stderr, "%s: cannot write to output file\n", argv[0]);
-            exit(EXIT_FAILURE);
+        ctx.output_fd = memfd;
+    }
+    /* scanning tries candidates out with decoders of the same format */
+    ctx.cache = decoder_cache_new(NULL);
+    unpack_phase_end(&ctx, UNPACK_PHASE_LOAD, &phase);
+
+    /* Copy the input as it is if it is not compressed, without reading it */
+    ret = unpack_passthrough(&ctx, fd, output_file);
+    if (ret != 0) {
+        goto out;
+    }
+
+    /*
+     * Without the whole image at hand it can not be looked into for UKI
+     * sections or scanned, only a zboot image or a kernel can be streamed.
+     */
+    if (input_mode == INPUT_STREAM) {
+        out = output_sink_new(&ctx, output_file);
+        ret = out ? unpack_stream(&ctx, fd, out) : -1;
+        if (ret < 0) {
+            fprintf(stderr, "%s: cannot unpack %s\n", argv[0], input_file);
         }
+        goto out;
+    }
+
+    /* Load the input file once, every layer is unpacked from memory */
+    unpack_cost_begin(&phase);
+    if (input_mode == INPUT_READ) {
+        buf = read_input(fd, st.st_size);
+        image = buf;
+        size = st.st_size;
     } else {
-        fprintf(stderr, "%s: %s: cannot find ARM64/RISC-V compressed image\n", argv[0], input_file);
+        mapped = g_mapped_file_new_from_fd(fd, FALSE, NULL);
+        if (mapped) {
+            image = (const uint8_t *)g_mapped_file_get_contents(mapped);
+            size = g_mapped_file_get_length(mapped);
+        }
+    }
+    if (!mapped && !buf) {
+        fprintf(stderr, "%s: %s: cannot load input file\n", argv[0], input_file);
         exit(EXIT_FAILURE);
     }
+    unpack_phase_end(&ctx, UNPACK_PHASE_LOAD, &phase);
+
+    /*
+     * Unless there is more to write than the output, or its digests are
+     * wanted, there is nothing to do if it was unpacked from this payload.
+     */
+    if (if_changed) {
+        source = source_key(image, size);
+    }
+    if (source && !tee_files && !digests &&
+        source_unchanged(source, output_file)) {
+        printf("%s: %s is up to date\n", argv[0], output_file);
+        ret = 1;
+    } else {
+        /* Extract all the sections if it is a Unified Kernel Image */
+        ret = unpack_uki_image(&ctx, output_file, image, size);
+    }
+    if (ret == 0) {
+        /* Otherwise unpack the image through as many layers as needed */
+        out = output_sink_new(&ctx, output_file);
+        ret = out ? unpack_image(&ctx, image, size, out, TRUE) : -1;
+        if (ret < 0) {
+            fprintf(stderr, "%s: cannot unpack %s\n", argv[0], input_file);
+        }
+    }
+    if (ret >= 0 && source) {
+        source_save(source, output_file);
+    }
+    g_free(source);
+
+    if (mapped) {
+        g_mapped_file_unref(mapped);
+    }
+    g_free(buf);
 
-    g_free(buffer);
-    exit(EXIT_SUCCESS);
+out:
+    if (ret >= 0 && digest_files && write_digest_files(&ctx, output_file) < 0) {
+        ret = -1;
+    }
+    if (ret >= 0 && memfd >= 0 && memfd_seal(memfd) < 0) {
+        fprintf(stderr, "%s: cannot seal memfd: %s\n", argv[0],
+                strerror(errno));
+        ret = -1;
+    }
+    if (ret >= 0 && memfd_socket && memfd_send(memfd, memfd_socket) < 0) {
+        fprintf(stderr, "%s: %s: cannot send memfd: %s\n", argv[0],
+                memfd_socket, strerror(errno));
+        ret = -1;
+    }
+    if (stats != STATS_NONE) {
+        unpack_stats_print(&ctx, stdout, stats == STATS_JSON, st.st_size,
+                           unpack_clock_ns() - start);
+    } else if (!digest_files) {
+        unpack_print_digests(&ctx, stdout);
+    }
+    perf_thread_close();
+    trace_close();
+    g_free(trace_path);
+
+    decoder_cache_free(ctx.cache);
+    unpack_ctx_clear(&ctx);
+    close(fd);
+    g_strfreev(tee_files);
+    g_free(memfd_socket);
+
+    if (ret >= 0 && memfd >= 0 && filenames[1]) {
+        fflush(stdout);
+        memfd_exec(memfd, filenames + 1);
+        fprintf(stderr, "%s: %s: cannot run: %s\n", argv[0], filenames[1],
+                strerror(errno));
+        ret = -1;
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    g_strfreev(filenames);
+    exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -0,0 +1,667 @@
+/*
+ * Extract a kernel vmlinuz image from a EFI application that carries the actual kernel image in compressed form
+ *
+ * Copyright (c) 2023 Enric Balletbo i Serra
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef UNZBOOT_H
+#define UNZBOOT_H
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define ARM64_MAGIC_OFFSET  56
+
+/* The PE/COFF MS-DOS stub magic number */
+#define EFI_PE_MSDOS_MAGIC        "MZ"
+
+/*
+ * The Linux header magic number for a EFI PE/COFF
+ * image targetting an unspecified architecture.
+ */
+#define EFI_PE_LINUX_MAGIC        "\xcd\x23\x82\x81"
+
+/*
+ * Bootable Linux kernel images may be packaged as EFI zboot images, which are
+ * self-decompressing executables when loaded via EFI. The compressed payload
+ * can also be extracted from the image and decompressed by a non-EFI loader.
+ *
+ * The de facto specification for this format is at the following URL:
+ *
+ * https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/drivers/firmware/efi/libstub/zboot-header.S
+ *
+ * This definition is based on Linux upstream commit 29636a5ce87beba.
+ */
+struct linux_efi_zboot_header {
+    uint8_t     msdos_magic[2];         /* PE/COFF 'MZ' magic number */
+    uint8_t     reserved0[2];
+    uint8_t     zimg[4];                /* "zimg" for Linux EFI zboot images */
+    uint32_t    payload_offset;         /* LE offset to compressed payload */
+    uint32_t    payload_size;           /* LE size of the compressed payload */
+    uint8_t     reserved1[8];
+    char        compression_type[32];   /* Compression type, NUL terminated */
+    uint8_t     linux_magic[4];         /* Linux header magic */
+    uint32_t    pe_header_offset;       /* LE offset to the PE header */
+};
+
+/* Layers hand data to each other in chunks of at most this size */
+#define UNPACK_CHUNK_SIZE           (1 << 20)
+
+/* Default limit of nested formats peeled in recursive mode */
+#define UNPACK_DEFAULT_MAX_DEPTH    8
+
+/*
+ * A consumer of a byte stream.
+ *
+ * The unpacking pipeline is a chain of sinks: every layer decodes what it is
+ * written and writes the result to the next one, the last one produces the
+ * output. finish() flushes the stream and abort() discards it; both release
+ * the sink and the rest of the chain behind it.
+ *
+ * Sinks backed by a file may also implement copy_from(), to take size bytes
+ * from the file at fd without them being read into memory.
+ */
+struct sink {
+    int (*write)(struct sink *sink, const uint8_t *buf, size_t len);
+    int (*finish)(struct sink *sink);
+    void (*abort)(struct sink *sink);
+    int (*copy_from)(struct sink *sink, int fd, uint64_t size);
+};
+
+#define UNPACK_ERROR unpack_error_quark()
+GQuark unpack_error_quark(void);
+
+enum {
+    UNPACK_ERROR_FAILED,
+    UNPACK_ERROR_CORRUPT,
+    UNPACK_ERROR_UNSUPPORTED,
+    /* no kernel image in the input */
+    UNPACK_ERROR_NOT_FOUND,
+    UNPACK_ERROR_IO,
+};
+
+/* What the time spent unpacking goes to, for --stats */
+enum unpack_phase {
+    UNPACK_PHASE_LOAD,
+    UNPACK_PHASE_HEADER,
+    UNPACK_PHASE_INFLATE,
+    UNPACK_PHASE_VERIFY,
+    UNPACK_PHASE_WRITE,
+    UNPACK_N_PHASES,
+};
+
+/* The hardware events counted with --perf-counters */
+enum unpack_event {
+    UNPACK_EVENT_CYCLES,
+    UNPACK_EVENT_INSTRUCTIONS,
+    UNPACK_EVENT_BRANCH_MISSES,
+    UNPACK_EVENT_LLC_MISSES,
+    UNPACK_N_EVENTS,
+};
+
+/*
+ * Start counting hardware events in the calling thread with
+ * perf_event_open(). Events that can not be counted, because of the
+ * hardware or of perf_event_paranoid, are left out. Return FALSE if none
+ * can be counted.
+ */
+gboolean perf_thread_open(void);
+void perf_thread_close(void);
+
+/* Read the counters of the calling thread, all zeros if it has none */
+void perf_read(uint64_t events[UNPACK_N_EVENTS]);
+
+/* Whether an event could be counted by any thread */
+gboolean perf_event_available(enum unpack_event event);
+
+/* Name of a phase, as reported by --stats and --trace */
+const char *unpack_phase_name(enum unpack_phase phase);
+
+/*
+ * Write a trace of the run to path, in the Chrome trace event format. Spans
+ * are added from any thread with trace_span(), with unpack_clock_ns() times.
+ */
+extern gboolean trace_enabled;
+
+int trace_open(const char *prog, const char *path, const char *input_file);
+void trace_close(void);
+void trace_thread_name(const char *name);
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+/* Monotonic nanoseconds and hardware events spent on something */
+struct unpack_cost {
+    uint64_t    ns;
+    uint64_t    events[UNPACK_N_EVENTS];
+};
+
+static inline uint64_t unpack_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * G_GUINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+/* Take a mark of the current time and event counts */
+static inline void unpack_cost_begin(struct unpack_cost *mark)
+{
+    mark->ns = unpack_clock_ns();
+    perf_read(mark->events);
+}
+
+static inline void unpack_cost_add(struct unpack_cost *cost,
+                                   const struct unpack_cost *other)
+{
+    int i;
+
+    cost->ns += other->ns;
+    for (i = 0; i < UNPACK_N_EVENTS; i++) {
+        cost->events[i] += other->events[i];
+    }
+}
+
+static inline void unpack_cost_sub(struct unpack_cost *cost,
+                                   const struct unpack_cost *other)
+{
+    int i;
+
+    cost->ns -= other->ns;
+    for (i = 0; i < UNPACK_N_EVENTS; i++) {
+        cost->events[i] -= other->events[i];
+    }
+}
+
+/* Add what was spent since mark to cost */
+static inline void unpack_cost_add_since(struct unpack_cost *cost,
+                                         const struct unpack_cost *mark)
+{
+    struct unpack_cost now;
+
+    unpack_cost_begin(&now);
+    unpack_cost_sub(&now, mark);
+    unpack_cost_add(cost, &now);
+}
+
+/*
+ * Where the decode path gets its memory from: layers, decoder states, the
+ * memory of the libraries behind them and output chunks. Everything is given
+ * back to free() with the size and alignment it was allocated with, so an
+ * arena that only frees all at once fits as well as a general allocator.
+ * Wherever one is taken, NULL stands for GLib's.
+ */
+struct unpack_allocator {
+    void    *(*alloc)(void *opaque, size_t size, size_t align);
+    void    (*free)(void *opaque, void *ptr, size_t size, size_t align);
+    void    *opaque;
+};
+
+/* Alignment of the memory from unpack_alloc() */
+#define UNPACK_ALLOC_ALIGN          16
+
+void *unpack_alloc(const struct unpack_allocator *a, size_t size);
+void *unpack_alloc0(const struct unpack_allocator *a, size_t size);
+void unpack_free(const struct unpack_allocator *a, void *ptr, size_t size);
+
+#define unpack_new0(a, type)    ((type *)unpack_alloc0((a), sizeof(type)))
+
+/* A buffer growing as data is appended to it */
+struct unpack_buf {
+    uint8_t     *data;
+    size_t      len;
+    size_t      size;
+};
+
+void unpack_buf_append(const struct unpack_allocator *a, struct unpack_buf *b,
+                       const uint8_t *data, size_t len);
+void unpack_buf_clear(const struct unpack_allocator *a, struct unpack_buf *b);
+
+/*
+ * A streaming decoder.
+ *
+ * init() allocates the state and everything the decoder needs from a.
+ * reset() makes a state ready for a new stream, reusing its memory, and
+ * returns -1 if it can not. It is NULL if the format has no way to.
+ *
+ * decode() consumes from *in and produces to *out, advancing both. eof is set
+ * once there is no more input to come. It returns 1 when the compressed
+ * stream has ended, whatever follows it is ignored, 0 when it needs more
+ * input or output space to progress and -1 on errors.
+ *
+ * decode_buffer() is the one-shot entry point, for formats whose library
+ * decodes a whole stream in memory faster than it streams it: it decodes
+ * in to out at once, *outlen being the room in out and then what was
+ * decoded. It is NULL where the stream decoder does as well.
+ *
+ * content_size() parses the header, or trailer, of the whole stream in buf
+ * for the size it decodes to, and returns -1 if it is not recorded. It is
+ * NULL if the format never records it.
+ */
+struct decoder_ops {
+    void    *(*init)(const struct unpack_allocator *a, GError **error);
+    int     (*reset)(void *state);
+    int     (*decode)(void *state, const uint8_t **in, size_t *inlen,
+                      uint8_t **out, size_t *outlen, gboolean eof,
+                      GError **error);
+    void    (*end)(void *state);
+    int     (*decode_buffer)(void *state, const uint8_t *in, size_t inlen,
+                             uint8_t *out, size_t *outlen, GError **error);
+    int64_t (*content_size)(const uint8_t *buf, size_t len);
+};
+
+/* The known formats, from the most to the least common in kernels */
+enum codec_id {
+    CODEC_GZIP,
+    CODEC_ZSTD,
+    CODEC_XZ,
+    CODEC_LZMA,
+    CODEC_LZ4,
+    CODEC_LZO,
+    CODEC_BZIP2,
+    N_CODECS,
+};
+
+#define CODEC_MAGIC_MAX     9
+
+/*
+ * A compression format, recognised by its magic bytes. The table of them is
+ * built at compile time: formats whose support is not built in only take
+ * their entry, to tell why their streams can not be decoded.
+ */
+struct codec {
+    enum codec_id           id;
+    const char              *name;
+    uint8_t                 magic[CODEC_MAGIC_MAX];
+    size_t                  magic_len;
+    /* NULL if support for this format has not been built in */
+    const struct decoder_ops *ops;
+};
+
+/* All the known formats, indexed by their id */
+extern const struct codec codecs[N_CODECS];
+
+/* Return the format whose magic is at the start of buf, or NULL */
+const struct codec *codec_detect(const uint8_t *buf, size_t len);
+
+/*
+ * Return the format used by a zboot compression type, the NUL padded field
+ * of len bytes of the zboot header, or NULL
+ */
+const struct codec *codec_from_zboot_type(const char *type, size_t len);
+
+/*
+ * Decoders and output chunks kept by a worker across images, so that each
+ * new one costs next to no allocations. A cache is used by a single thread
+ * at a time, and with the allocator it was created with; wherever one is
+ * taken, NULL stands for no caching.
+ */
+struct decoder_cache;
+
+struct decoder_cache *decoder_cache_new(const struct unpack_allocator *a);
+void decoder_cache_free(struct decoder_cache *cache);
+
+/* Take a state of ops from the cache and reset it, or initialise a new one */
+void *decoder_cache_get(struct decoder_cache *cache,
+                        const struct unpack_allocator *a,
+                        const struct decoder_ops *ops, GError **error);
+
+/* Give a state back, to be reused or, if the cache is full, ended */
+void decoder_cache_put(struct decoder_cache *cache,
+                       const struct decoder_ops *ops, void *state);
+
+/* The same for the UNPACK_CHUNK_SIZE buffers decoders write to */
+uint8_t *decoder_cache_get_chunk(struct decoder_cache *cache,
+                                 const struct unpack_allocator *a);
+void decoder_cache_put_chunk(struct decoder_cache *cache,
+                             const struct unpack_allocator *a, uint8_t *chunk);
+
+/*
+ * Decode the whole stream in, of the format codec, to out at once, with a
+ * state from cache. *outlen is the room in out, and then what was decoded.
+ * Returns -1 with error set if the stream is corrupt or does not fit.
+ */
+int codec_decode_buffer(const struct codec *codec, struct decoder_cache *cache,
+                        const struct unpack_allocator *a, const uint8_t *in,
+                        size_t inlen, uint8_t *out, size_t *outlen,
+                        GError **error);
+
+/* What the allocator given to zlib has been asked for, for --stats */
+struct zalloc_stats {
+    uint64_t    allocs;
+    uint64_t    frees;
+    uint64_t    bytes;
+    /* most bytes allocated at the same time */
+    uint64_t    peak_bytes;
+};
+
+void codec_get_zalloc_stats(struct zalloc_stats *stats);
+
+/*
+ * Store in *cost what the calling thread has spent checking the checksums of
+ * decoded data since the last call. Only the checks done here are accounted,
+ * not those done by the libraries of the other formats while decoding.
+ */
+void codec_take_verify_cost(struct unpack_cost *cost);
+
+/* The offset of a known magic in an image, see scan_signatures() */
+struct scan_candidate {
+    const struct codec  *codec;
+    size_t              offset;
+};
+
+/*
+ * Find every occurrence of the magic of a built-in format in buf, in a single
+ * pass. Return an array of struct scan_candidate, sorted from the most to the
+ * least likely one to be the compressed kernel.
+ */
+GArray *scan_signatures(const uint8_t *buf, size_t len);
+
+/* The digests --digest computes, of the payload and of the kernel */
+enum digest_algo {
+    DIGEST_SHA256,
+    DIGEST_BLAKE3,
+    N_DIGESTS,
+};
+
+/* Their names, as in --digest and the extension of the sidecar files */
+extern const char *const digest_names[N_DIGESTS];
+
+/* Whether an algorithm is supported by the libraries built in */
+gboolean digest_available(enum digest_algo algo);
+
+/*
+ * Parse a comma separated list of algorithms into a mask of 1 << algo, or
+ * return FALSE with error set
+ */
+gboolean digest_parse(const char *list, guint *algos, GError **error);
+
+/* A digest being computed */
+struct digest;
+
+struct digest *digest_new(enum digest_algo algo);
+void digest_update(struct digest *d, const uint8_t *buf, size_t len);
+void digest_free(struct digest *d);
+
+/* Free d and return its digest, as a newly allocated lower case hex string */
+char *digest_finish(struct digest *d);
+
+/* A format peeled by the unpacking pipeline, for --stats */
+struct unpack_layer {
+    const char  *format;
+    /* the format of compressed layers, NULL for the others */
+    const struct codec *codec;
+    int         depth;
+    uint64_t    in_bytes;
+    uint64_t    out_bytes;
+};
+
+struct unpack_ctx {
+    const char  *prog;
+    const char  *input_file;
+    /* keep peeling nested formats instead of just a zboot image */
+    gboolean    recursive;
+    int         max_depth;
+    /*
+     * do not print errors, when trying candidates out, nor what is found,
+     * when benchmarking or used as a library
+     */
+    gboolean    quiet;
+    /* struct unpack_layer, in the order they were found */
+    GArray      *layers;
+    /* leave whole blocks of zeros as holes in the output files */
+    gboolean    sparse;
+    /* bytes of output not written for being holes */
+    uint64_t    sparse_bytes;
+    /* bytes of all the output files */
+    uint64_t    out_bytes;
+    /* leave output files that would not change as they are */
+    gboolean    if_changed;
+    /* bytes of output files left as they were for being the same */
+    uint64_t    unchanged_bytes;
+    /* compress the kernel written to output files with it, or NULL */
+    const struct codec *output_codec;
+    int         output_level;
+    /* more files to write the kernel to, from the same decode, or NULL */
+    char        **tee_files;
+    /* write the kernel to this file descriptor rather than a file, or -1 */
+    int         output_fd;
+    /*
+     * if set, output files are complete but left under their temporary
+     * names, which are added to it for the tee to rename them all together
+     */
+    GArray      *staged_outputs;
+    /* the digests to compute, a mask of 1 << enum digest_algo */
+    guint       digests;
+    /* hex digests of the zboot payload and of the kernel, once computed */
+    char        *payload_digest[N_DIGESTS];
+    char        *kernel_digest[N_DIGESTS];
+    /* count hardware events in the threads working for this context */
+    gboolean    perf_counters;
+    /* what each phase cost */
+    struct unpack_cost phase[UNPACK_N_PHASES];
+    /* the first error met, see unpack_error() */
+    GError      *error;
+    /* decoders to reuse, owned by whoever set it, or NULL */
+    struct decoder_cache *cache;
+    /* of the decode path, and of cache, NULL for GLib's */
+    const struct unpack_allocator *alloc;
+};
+
+/*
+ * Account what was spent since mark, from unpack_cost_begin(), to a phase
+ * and add it to the trace as a span.
+ */
+static inline void unpack_phase_end(struct unpack_ctx *ctx,
+                                    enum unpack_phase phase,
+                                    const struct unpack_cost *mark)
+{
+    struct unpack_cost now;
+
+    unpack_cost_begin(&now);
+    if (G_UNLIKELY(trace_enabled)) {
+        trace_span(unpack_phase_name(phase), mark->ns, now.ns);
+    }
+    unpack_cost_sub(&now, mark);
+    unpack_cost_add(&ctx->phase[phase], &now);
+}
+
+void unpack_ctx_init(struct unpack_ctx *ctx, const char *prog,
+                     const char *input_file);
+void unpack_ctx_clear(struct unpack_ctx *ctx);
+void unpack_ctx_print_layers(const struct unpack_ctx *ctx, FILE *fp);
+
+/*
+ * Report an error: it is printed on stderr, unless ctx->quiet is set, and
+ * the first one is kept in ctx->error. The message names the file it is
+ * about, if any, but not the program.
+ */
+void unpack_error(struct unpack_ctx *ctx, int code, const char *format, ...)
+    G_GNUC_PRINTF(3, 4);
+
+/* Add the statistics of a context used for part of the work to ctx */
+void unpack_ctx_merge(struct unpack_ctx *ctx, const struct unpack_ctx *part,
+                      int depth);
+
+/*
+ * Print the statistics of a run that took wall_ns and read in_bytes, as text
+ * or as a JSON object on a single line.
+ */
+void unpack_stats_print(const struct unpack_ctx *ctx, FILE *fp,
+                        gboolean json, uint64_t in_bytes, uint64_t wall_ns);
+
+/* Print the digests computed, of the payload and of the kernel */
+void unpack_print_digests(const struct unpack_ctx *ctx, FILE *fp);
+
+/* Append str to s as a JSON string */
+void json_append_string(GString *s, const char *str);
+
+/*
+ * Unpack image to out.
+ *
+ * If image is neither a zboot image nor a kernel image, it is scanned for
+ * the signature of a compressed kernel, like the kernel's extract-vmlinux
+ * script does.
+ */
+int unpack_image(struct unpack_ctx *ctx, const uint8_t *image, size_t size,
+                 struct sink *out, gboolean expect_kernel);
+
+/*
+ * Create the pipeline unpack_image() writes image to, for callers that
+ * write it themselves a piece at a time, starting at *offset. If it can
+ * not be created, out is aborted and NULL returned.
+ */
+struct sink *unpack_image_new(struct unpack_ctx *ctx, const uint8_t *image,
+                              size_t size, struct sink *out,
+                              gboolean expect_kernel, size_t *offset);
+
+/*
+ * Decode the payload of the zboot image in image straight to buf, with the
+ * one-shot decoder of its format, and return the size of the kernel. If it
+ * is anything but a kernel that fits in bufsize bytes, -1 is returned and
+ * the image must go through unpack_image(), which tells what is wrong.
+ */
+ssize_t unpack_zboot_to_buffer(struct unpack_ctx *ctx, const uint8_t *image,
+                               size_t size, uint8_t *buf, size_t bufsize);
+
+/*
+ * The digest of the payload of the zboot image in image, as a newly
+ * allocated hex string, without unpacking it. NULL if it is not a zboot
+ * image or its header is corrupt.
+ */
+char *unpack_zboot_payload_digest(const uint8_t *image, size_t size,
+                                  enum digest_algo algo);
+
+/*
+ * The size of the kernel in the zboot image in image, from the trailer the
+ * kernel build appends to the payload, or from the compressed stream for
+ * gzip, which has none. -1 if it is not a zboot image or the size is not
+ * known.
+ */
+int64_t unpack_zboot_kernel_size(const uint8_t *image, size_t size);
+
+/*
+ * Create the head of an unpacking pipeline writing to out.
+ *
+ * If expect_kernel is set, the innermost layer must be an ARM64 or RISC-V
+ * kernel image, otherwise whatever can not be decoded any further is written
+ * to out as it is.
+ */
+struct sink *unpack_new(struct unpack_ctx *ctx, struct sink *out,
+                        gboolean expect_kernel);
+
+/*
+ * Unpack the file at fd to out while reading it, from its current offset.
+ * Only zboot images and kernels can be unpacked this way, unpack_image()
+ * is needed for UKIs and images to be scanned.
+ */
+int unpack_stream(struct unpack_ctx *ctx, int fd, struct sink *out);
+
+/*
+ * If the file at fd is a kernel image already, which is found out from its
+ * first page, copy it to output_file as it is: its extents are shared with
+ * FICLONE or copied in the kernel with copy_file_range(). With
+ * ctx->output_codec set, it is read and compressed instead.
+ *
+ * Return 0 if it is not a kernel image, 1 if it was copied or -1 on error.
+ */
+int unpack_passthrough(struct unpack_ctx *ctx, int fd,
+                       const char *output_file);
+
+/* Copy size bytes from the file at fd to a sink and finish it */
+int sink_copy_from(struct sink *sink, int fd, uint64_t size);
+
+/* Write a buffer to a sink in UNPACK_CHUNK_SIZE pieces */
+int sink_write_chunked(struct sink *sink, const uint8_t *buf, size_t len);
+
+/* Write a buffer to a pipeline and finish it, or abort it on errors */
+int sink_write_all(struct sink *sink, const uint8_t *buf, size_t len);
+
+/*
+ * A sink writing to a temporary file next to path, which is renamed to path
+ * when the sink is finished. If ctx->sparse is set, blocks of zeros are left
+ * as holes and accounted in ctx->sparse_bytes.
+ *
+ * If ctx->if_changed is set and path is a regular file, it is compared with
+ * what is written instead, and only replaced from the first difference on.
+ * If there is none, it is left untouched and accounted in
+ * ctx->unchanged_bytes.
+ */
+struct sink *file_sink_new(struct unpack_ctx *ctx, const char *path);
+
+/*
+ * A sink writing to fd in place, from its start, like a memfd, which is
+ * left open. name is what errors call it.
+ */
+struct sink *fd_sink_new(struct unpack_ctx *ctx, int fd, const char *name);
+
+/* A sink discarding what it is written, only adding it to ctx->out_bytes */
+struct sink *null_sink_new(struct unpack_ctx *ctx);
+
+/* Open the branch i of a tee sink with ctx, or return NULL */
+typedef struct sink *(*tee_open_fn)(struct unpack_ctx *ctx, int i,
+                                    gpointer data);
+
+/*
+ * A sink writing the same stream to n branches, so that a single decode
+ * produces them all. The first branch is written in the calling thread, with
+ * ctx. Every other one is written in a thread of its own, with a context of
+ * its own merged into ctx once the tee is finished or aborted. If a branch
+ * can not be opened, the others are aborted and NULL returned.
+ *
+ * Output files are only renamed into place once all of them are complete,
+ * and none is if any branch fails. Outputs written in place, like devices or
+ * files in directories that can not be written to, can not wait for that.
+ */
+struct sink *tee_sink_new(struct unpack_ctx *ctx, int n, tee_open_fn open,
+                          gpointer data);
+
+/* A sink hashing the kernel into ctx->kernel_digest[algo] */
+struct sink *digest_sink_new(struct unpack_ctx *ctx, enum digest_algo algo);
+
+/*
+ * Tell whether the kernel can be compressed again with codec, at level or
+ * at the default level of the format if it is 0.
+ */
+gboolean encode_check(const struct codec *codec, int level, GError **error);
+
+/*
+ * A sink compressing what it is written with codec to out, with as many
+ * threads as there are processors. If it can not be created, out is aborted
+ * and NULL returned.
+ */
+struct sink *encode_sink_new(struct unpack_ctx *ctx, const struct codec *codec,
+                             int level, struct sink *out);
+
+/* The format a file name ends like, as in "Image.gz", or NULL */
+const struct codec *encode_codec_for_path(const char *path);
+
+/*
+ * A sink writing the kernel to path, like file_sink_new(), or to
+ * ctx->output_fd if it is set, compressed with ctx->output_codec if it is
+ * set. If ctx->tee_files is set, it is written
+ * to each of them as well, compressed in the format they end like, and the
+ * digests of ctx->digests are computed from it, each in a thread.
+ */
+struct sink *output_sink_new(struct unpack_ctx *ctx, const char *path);
+
+/*
+ * Check whether image is a Unified Kernel Image and, if it is, extract all
+ * its known sections concurrently. The kernel is written to output_file and
+ * every other section next to it, with the section name as suffix.
+ *
+ * Return 0 if the image is not a UKI, 1 if it was extracted or -1 on error.
+ */
+int unpack_uki_image(struct unpack_ctx *ctx, const char *output_file,
+                     const uint8_t *image, size_t size);
+
+/* Run the bench subcommand, argv[1] being "bench", and return the exit code */
+int unpack_bench(int argc, char *argv[]);
+
+/* Run the pack subcommand, argv[1] being "pack", and return the exit code */
+int pack_zboot(int argc, char *argv[]);
+
+#endif /* UNZBOOT_H */